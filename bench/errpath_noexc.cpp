@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Cost of producing, propagating, printing and releasing one error with
+ * error objects. errpath_exc.cpp measures the same with exceptions. */
+
+#include"ne_utils.h"
+
+#include<cerrno>
+#include<chrono>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<string>
+
+namespace {
+
+const constexpr int DEPTH = 3;
+const char *fname = "some/directory/inside/the/archive/file.dat";
+volatile size_t sink;
+
+enum Kind {
+    STATIC_MESSAGE,
+    FORMATTED_MESSAGE,
+    SYSTEM_ERROR,
+};
+
+__attribute__((noinline)) void fail(Kind k, int depth, Error **e) {
+    if(depth > 0) {
+        fail(k, depth-1, e);
+        if(*e) {
+            return;
+        }
+        sink = sink + 1;
+        return;
+    }
+    switch(k) {
+    case STATIC_MESSAGE: *e = create_error("CRC32 checksum is invalid."); break;
+    case FORMATTED_MESSAGE: *e = create_error_fmt("Could not unpack %s.", fname); break;
+    case SYSTEM_ERROR:
+        errno = ENOENT;
+        *e = create_system_error_fmt("Could not open file %s:", fname);
+        break;
+    }
+}
+
+double run(Kind k, int iterations) {
+    auto start = std::chrono::steady_clock::now();
+    for(int i=0; i<iterations; i++) {
+        Error *e = nullptr;
+        fail(k, DEPTH, &e);
+        if(e) {
+            sink = strlen(error_message(e));
+            free_error(e);
+        }
+    }
+    std::chrono::duration<double, std::nano> d = std::chrono::steady_clock::now() - start;
+    return d.count() / iterations;
+}
+
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    if(iterations < 1) {
+        printf("%s [iterations]\n", argv[0]);
+        return 1;
+    }
+    const char *names[] = {"static", "formatted", "system"};
+    printf("{\n  \"benchmarks\": [");
+    for(int k=STATIC_MESSAGE; k<=SYSTEM_ERROR; k++) {
+        run((Kind)k, iterations/10);
+        printf("%s\n    {\"name\": \"%s\", \"iterations\": %d, \"ns_per_error\": %.1f}",
+               k == 0 ? "" : ",", names[k], iterations, run((Kind)k, iterations));
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
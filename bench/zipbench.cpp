@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runtime benchmarks for the exception based unpacker.
+ *
+ * Every benchmark is run a few times to warm up caches and then timed
+ * for a number of repetitions. The results are printed as JSON so that
+ * they can be compared between builds. */
+
+#include"zipfile.h"
+#include"decompress.h"
+#include"fileutils.h"
+#include"utils.h"
+#include"file.h"
+#include"zipwriter.h"
+#include"arena.h"
+#include"zipfs.h"
+#include"salvage.h"
+#include"mmapper.h"
+
+#include<ftw.h>
+#include<sys/resource.h>
+#include<sys/stat.h>
+
+#include<algorithm>
+#include<chrono>
+#include<cmath>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<functional>
+#include<stdexcept>
+#include<string>
+#include<vector>
+
+namespace {
+
+const constexpr uint64_t PAYLOAD_SIZE = 16*1024*1024;
+const constexpr uint64_t SMALL_PAYLOAD_SIZE = 4*1024;
+const constexpr int SMALL_DECODES = 1000;
+
+struct BenchOptions {
+    int warmup = 2;
+    int reps = 10;
+    std::string filter;
+};
+
+struct BenchResult {
+    std::string name;
+    int reps;
+    uint64_t bytes;
+    uint64_t items;
+    double median_ns;
+    double p99_ns;
+    uint64_t page_faults; // Median per repetition.
+};
+
+uint64_t page_faults() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+int remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+    return remove(path);
+}
+
+void remove_tree(const std::string &path) {
+    nftw(path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+std::string make_tempdir() {
+    const char *tmp = getenv("TMPDIR");
+    std::string templ(tmp ? tmp : "/tmp");
+    templ += "/zipbench-XXXXXX";
+    if(!mkdtemp(&templ[0])) {
+        throw_system("Could not create temporary directory:");
+    }
+    return templ;
+}
+
+/* Text-like data that compresses roughly as well as source code does.
+ * The generator is seeded so every run decodes exactly the same bytes. */
+std::vector<unsigned char> make_payload(uint64_t size) {
+    static const char *words[] = {"zip", "entry", "header", "central", "local",
+        "directory", "deflate", "lzma", "store", "crc", "offset", "size",
+        "\n", "    ", "{", "}", "(", ")", ";", "return"};
+    std::vector<unsigned char> data;
+    data.reserve(size);
+    uint32_t state = 2463534242u;
+    while(data.size() < size) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        const char *w = words[state % (sizeof(words)/sizeof(words[0]))];
+        while(*w && data.size() < size) {
+            data.push_back(*w++);
+        }
+        if(data.size() < size) {
+            data.push_back(' ');
+        }
+    }
+    return data;
+}
+
+class Runner final {
+public:
+    explicit Runner(const BenchOptions &o) : opts(o) {}
+
+    void run(const std::string &name, uint64_t bytes, uint64_t items, const std::function<void()> &f) {
+        if(!opts.filter.empty() && name.find(opts.filter) == std::string::npos) {
+            return;
+        }
+        for(int i=0; i<opts.warmup; i++) {
+            f();
+        }
+        std::vector<double> samples;
+        std::vector<uint64_t> faults;
+        samples.reserve(opts.reps);
+        faults.reserve(opts.reps);
+        for(int i=0; i<opts.reps; i++) {
+            auto start_faults = page_faults();
+            auto start = std::chrono::steady_clock::now();
+            f();
+            auto end = std::chrono::steady_clock::now();
+            faults.push_back(page_faults() - start_faults);
+            samples.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+        }
+        std::sort(samples.begin(), samples.end());
+        std::sort(faults.begin(), faults.end());
+        auto p99_index = std::max<size_t>(1, (size_t)std::ceil(0.99*samples.size())) - 1;
+        results.push_back(BenchResult{name, opts.reps, bytes, items,
+            samples[samples.size()/2], samples[p99_index], faults[faults.size()/2]});
+    }
+
+    void report(FILE *out) const {
+        fprintf(out, "{\n  \"warmup\": %d,\n  \"benchmarks\": [", opts.warmup);
+        for(size_t i=0; i<results.size(); i++) {
+            const auto &r = results[i];
+            fprintf(out, "%s\n    {\"name\": \"%s\", \"reps\": %d, \"bytes\": %llu, \"items\": %llu, "
+                    "\"median_ns\": %.0f, \"p99_ns\": %.0f, \"page_faults\": %llu",
+                    i == 0 ? "" : ",",
+                    r.name.c_str(), r.reps,
+                    (unsigned long long)r.bytes, (unsigned long long)r.items,
+                    r.median_ns, r.p99_ns, (unsigned long long)r.page_faults);
+            if(r.bytes > 0) {
+                fprintf(out, ", \"mb_per_s\": %.2f", r.bytes/(r.median_ns/1e9)/1e6);
+            }
+            if(r.items > 0) {
+                fprintf(out, ", \"items_per_s\": %.0f", r.items/(r.median_ns/1e9));
+            }
+            fprintf(out, "}");
+        }
+        fprintf(out, "\n  ]\n}\n");
+    }
+
+private:
+    BenchOptions opts;
+    std::vector<BenchResult> results;
+};
+
+void bench_archive(Runner &r, const std::string &archive, const std::string &tmpdir) {
+    const uint64_t archive_size = File(archive, "rb").size();
+    uint64_t num_entries = 0;
+    uint64_t uncompressed = 0;
+    {
+        ZipFile zf(archive.c_str());
+        num_entries = zf.size();
+        for(const auto &lh : zf.localheaders()) {
+            uncompressed += lh.uncompressed_size;
+        }
+    }
+
+    r.run("open", archive_size, num_entries, [&archive]() {
+        ZipFile zf(archive.c_str());
+    });
+
+    // Find where the central directory begins so the two header types can be timed separately.
+    File f(archive, "rb");
+    int64_t central_start = 0;
+    while(f.read32le() == LOCAL_SIG) {
+        auto lh = read_local_entry(f);
+        f.seek(lh.compressed_size, SEEK_CUR);
+        if(lh.gp_bitflag & FLAG_DATA_DESCRIPTOR) {
+            f.seek(3*4, SEEK_CUR);
+        }
+        central_start = f.tell();
+    }
+
+    r.run("parse_local_headers", central_start, num_entries, [&f]() {
+        f.seek(0);
+        while(f.read32le() == LOCAL_SIG) {
+            auto lh = read_local_entry(f);
+            f.seek(lh.compressed_size, SEEK_CUR);
+            if(lh.gp_bitflag & FLAG_DATA_DESCRIPTOR) {
+                f.seek(3*4, SEEK_CUR);
+            }
+        }
+    });
+
+    r.run("parse_central_headers", archive_size - central_start, num_entries, [&f, central_start]() {
+        f.seek(central_start);
+        while(f.read32le() == CENTRAL_SIG) {
+            read_central_entry(f);
+        }
+    });
+
+    // The signature scan of salvage mode, which should run at memory bandwidth.
+    MMapper mapped(f);
+    r.run("find_records", archive_size, num_entries, [&mapped, archive_size]() {
+        std::vector<uint64_t> local, central;
+        find_records(mapped, archive_size, local, central);
+        if(local.empty()) {
+            throw std::runtime_error("No local headers found.");
+        }
+    });
+
+    int round = 0;
+    auto extract = [&archive, &tmpdir, &round](bool huge_pages, InputBackend input) {
+        std::string outdir = tmpdir + "/extract" + std::to_string(round++);
+        {
+            // Failures would end up in the middle of the JSON report, but there should not be any.
+            UnzipOptions opts;
+            opts.report = REPORT_QUIET;
+            opts.out = stderr;
+            opts.huge_pages = huge_pages;
+            opts.input = input;
+            ZipFile zf(archive.c_str());
+            zf.unzip(outdir, opts);
+        }
+        remove_tree(outdir);
+    };
+    r.run("extract", uncompressed, num_entries, [&extract]() { extract(false, INPUT_MMAP); });
+    r.run("extract_huge_pages", uncompressed, num_entries, [&extract]() { extract(true, INPUT_MMAP); });
+    r.run("extract_pread", uncompressed, num_entries, [&extract]() { extract(false, INPUT_PREAD); });
+
+    std::vector<std::string> files;
+    {
+        ZipFS fs(archive.c_str());
+        for(const auto &lh : ZipFile(archive.c_str()).localheaders()) {
+            if(fs.stat(lh.fname).type == FILE_ENTRY) {
+                files.push_back(lh.fname);
+            }
+        }
+    }
+    std::vector<unsigned char> buf(64*1024);
+    auto read_all = [&files, &buf](const ZipFS &fs) {
+        for(const auto &name : files) {
+            auto f = fs.open(name);
+            uint64_t offset = 0;
+            while(size_t n = f.pread(buf.data(), buf.size(), offset)) {
+                offset += n;
+            }
+        }
+    };
+    // Cold decodes everything, hot should be served from the block cache
+    // once the warmup has filled it.
+    r.run("zipfs_cold_read", uncompressed, files.size(), [&archive, &read_all]() {
+        ZipFS fs(archive.c_str(), 1024*1024*1024);
+        read_all(fs);
+    });
+    r.run("entry_reader", uncompressed, num_entries, [&archive]() {
+        ZipFile zf(archive.c_str());
+        MMapper mapping = zf.map();
+        for(size_t i=0; i<zf.size(); i++) {
+            EntryReader reader(zf.raw(i, mapping));
+            ZipSpan chunk;
+            while(reader.next(chunk)) {
+            }
+        }
+    });
+    ZipFS hot(archive.c_str(), 1024*1024*1024);
+    read_all(hot);
+    r.run("zipfs_hot_read", uncompressed, files.size(), [&hot, &read_all]() { read_all(hot); });
+    // What serving the compressed data as it is costs, copied out the way
+    // a send would.
+    r.run("zipfs_raw_read", uncompressed, files.size(), [&hot, &files, &buf]() {
+        for(const auto &name : files) {
+            const RawEntry e = hot.raw(name);
+            for(uint64_t offset=0; offset<e.data.size; offset += buf.size()) {
+                memcpy(buf.data(), e.data.data + offset, (size_t)std::min<uint64_t>(buf.size(), e.data.size - offset));
+            }
+        }
+    });
+}
+
+void bench_decoders(Runner &r) {
+    auto payload = make_payload(PAYLOAD_SIZE);
+    auto deflated = encode_buffer(ZIP_DEFLATE, payload);
+    auto lzmad = encode_buffer(ZIP_LZMA, payload);
+    const uint32_t expected = CRC32(payload.data(), payload.size());
+    File out(tmpfile());
+    if(!out.get()) {
+        throw_system("Could not create temporary file:");
+    }
+
+    auto decode = [&out, expected](decltype(inflate_to_file) *f, const std::vector<unsigned char> &in) {
+        rewind(out.get());
+        InputRange data(in.data(), in.size());
+        if(f(data, out.get(), nullptr) != expected) {
+            throw std::runtime_error("Decoded data does not match.");
+        }
+    };
+    r.run("unstore_to_file", payload.size(), 1, [&]() { decode(unstore_to_file, payload); });
+    r.run("inflate_to_file", payload.size(), 1, [&]() { decode(inflate_to_file, deflated); });
+    r.run("lzma_to_file", payload.size(), 1, [&]() { decode(lzma_to_file, lzmad); });
+    {
+        ArenaScope huge(true, 0);
+        r.run("inflate_to_file_huge_pages", payload.size(), 1, [&]() { decode(inflate_to_file, deflated); });
+        r.run("lzma_to_file_huge_pages", payload.size(), 1, [&]() { decode(lzma_to_file, lzmad); });
+    }
+
+    // Small entries are dominated by setting up and tearing down decoder state.
+    auto small = make_payload(SMALL_PAYLOAD_SIZE);
+    auto small_deflated = encode_buffer(ZIP_DEFLATE, small);
+    auto small_lzmad = encode_buffer(ZIP_LZMA, small);
+    const uint32_t small_expected = CRC32(small.data(), small.size());
+    auto decode_small = [&out, small_expected](decltype(inflate_to_file) *f, const std::vector<unsigned char> &in) {
+        for(int i=0; i<SMALL_DECODES; i++) {
+            rewind(out.get());
+            InputRange data(in.data(), in.size());
+            if(f(data, out.get(), nullptr) != small_expected) {
+                throw std::runtime_error("Decoded data does not match.");
+            }
+        }
+    };
+    r.run("inflate_small_entries", SMALL_PAYLOAD_SIZE*SMALL_DECODES, SMALL_DECODES,
+          [&]() { decode_small(inflate_to_file, small_deflated); });
+    r.run("lzma_small_entries", SMALL_PAYLOAD_SIZE*SMALL_DECODES, SMALL_DECODES,
+          [&]() { decode_small(lzma_to_file, small_lzmad); });
+    r.run("crc32", payload.size(), 1, [&payload]() {
+        if(CRC32(payload.data(), payload.size()) == 0) {
+            throw std::runtime_error("Impossible checksum.");
+        }
+    });
+}
+
+void bench_mkdirp(Runner &r, const std::string &tmpdir) {
+    const int depth = 8;
+    int round = 0;
+    r.run("mkdirp", 0, depth, [&tmpdir, &round]() {
+        std::string top = tmpdir + "/dirs" + std::to_string(round++);
+        std::string path = top;
+        for(int i=0; i<depth; i++) {
+            path += "/level" + std::to_string(i);
+        }
+        mkdirp(path);
+        remove_tree(top);
+    });
+}
+
+void usage(const char *prog) {
+    printf("%s [--warmup N] [--reps N] [--filter NAME] <zip file>\n", prog);
+}
+
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opts;
+    std::string archive;
+    for(int i=1; i<argc; i++) {
+        std::string arg(argv[i]);
+        if(arg == "--warmup" && i+1 < argc) {
+            opts.warmup = atoi(argv[++i]);
+        } else if(arg == "--reps" && i+1 < argc) {
+            opts.reps = atoi(argv[++i]);
+        } else if(arg == "--filter" && i+1 < argc) {
+            opts.filter = argv[++i];
+        } else if(archive.empty() && arg[0] != '-') {
+            archive = arg;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(archive.empty() || opts.reps < 1 || opts.warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string tmpdir;
+    try {
+        tmpdir = make_tempdir();
+        Runner r(opts);
+        bench_archive(r, archive, tmpdir);
+        bench_decoders(r);
+        bench_mkdirp(r, tmpdir);
+        remove_tree(tmpdir);
+        r.report(stdout);
+    } catch(std::exception &e) {
+        if(!tmpdir.empty()) {
+            remove_tree(tmpdir);
+        }
+        printf("Benchmark failed: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Generates synthetic zip archives for scale and performance testing.
+ *
+ * All randomness comes from a seeded generator, so the same command
+ * line always produces a byte identical archive. */
+
+#include"zipwriter.h"
+#include"zipdefs.h"
+
+#include<algorithm>
+#include<cmath>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<stdexcept>
+#include<string>
+#include<vector>
+
+namespace {
+
+enum SizeClass {
+    SIZE_TINY,
+    SIZE_SMALL,
+    SIZE_HUGE,
+    SIZE_MIXED,
+};
+
+struct GenOptions {
+    uint64_t seed = 1;
+    uint64_t entries = 1000;
+    SizeClass sizes = SIZE_MIXED;
+    uint64_t max_size = 16*1024*1024;
+    // Relative weights of store, deflate and LZMA.
+    unsigned store_weight = 1;
+    unsigned deflate_weight = 3;
+    unsigned lzma_weight = 1;
+    int depth = 2;
+    int fanout = 8;
+    bool descriptors = false;
+    bool zip64 = false;
+    double compressibility = 0.7;
+    double corrupt_fraction = 0.0;
+    Corruption corrupt_kind = CORRUPT_CRC;
+    std::string output;
+};
+
+/* splitmix64, small and good enough for picking sizes and bytes. */
+class Rng final {
+public:
+    explicit Rng(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    double uniform() {
+        return (next() >> 11) * (1.0/9007199254740992.0);
+    }
+
+    // Log-uniform so that small values are as common as in real archives.
+    uint64_t log_range(uint64_t lo, uint64_t hi) {
+        if(hi <= lo) {
+            return lo;
+        }
+        double l = std::log((double)lo + 1);
+        double h = std::log((double)hi + 1);
+        return std::min<uint64_t>(hi, (uint64_t)std::exp(l + uniform()*(h - l)) - 1);
+    }
+
+private:
+    uint64_t state;
+};
+
+uint64_t pick_size(Rng &rng, const GenOptions &opts) {
+    SizeClass c = opts.sizes;
+    if(c == SIZE_MIXED) {
+        double r = rng.uniform();
+        c = r < 0.7 ? SIZE_TINY : (r < 0.97 ? SIZE_SMALL : SIZE_HUGE);
+    }
+    switch(c) {
+    case SIZE_TINY: return rng.log_range(0, std::min<uint64_t>(256, opts.max_size));
+    case SIZE_SMALL: return rng.log_range(256, std::min<uint64_t>(64*1024, opts.max_size));
+    default: return rng.log_range(std::min<uint64_t>(1024*1024, opts.max_size), opts.max_size);
+    }
+}
+
+uint16_t pick_method(Rng &rng, const GenOptions &opts) {
+    const unsigned total = opts.store_weight + opts.deflate_weight + opts.lzma_weight;
+    auto r = rng.next() % total;
+    if(r < opts.store_weight) {
+        return ZIP_NO_COMPRESSION;
+    }
+    if(r < opts.store_weight + opts.deflate_weight) {
+        return ZIP_DEFLATE;
+    }
+    return ZIP_LZMA;
+}
+
+std::string pick_name(Rng &rng, const GenOptions &opts, uint64_t index) {
+    std::string name;
+    for(int i=0; i<opts.depth; i++) {
+        name += "dir" + std::to_string(rng.next() % opts.fanout) + "/";
+    }
+    name += "file" + std::to_string(index) + ".dat";
+    return name;
+}
+
+/* Produces entry contents. With probability equal to the compressibility
+ * each byte run is copied from a small vocabulary, otherwise it is random. */
+class ContentSource final {
+public:
+    ContentSource(uint64_t seed, uint64_t size, double compressibility) :
+        rng(seed), remaining(size), compressibility(compressibility) {}
+
+    size_t operator()(unsigned char *buf, size_t bufsize) {
+        static const char *words[] = {"zip ", "entry ", "header ", "central ",
+            "local ", "directory ", "deflate ", "lzma ", "store ", "crc ",
+            "offset ", "size ", "\n", "    ", "return ", "0123456789"};
+        size_t n = (size_t)std::min<uint64_t>(bufsize, remaining);
+        size_t i = 0;
+        while(i < n) {
+            if(rng.uniform() < compressibility) {
+                const char *w = words[rng.next() % (sizeof(words)/sizeof(words[0]))];
+                size_t len = std::min(strlen(w), n - i);
+                memcpy(buf + i, w, len);
+                i += len;
+            } else {
+                uint64_t r = rng.next();
+                size_t len = std::min<size_t>(8, n - i);
+                memcpy(buf + i, &r, len);
+                i += len;
+            }
+        }
+        remaining -= n;
+        return n;
+    }
+
+private:
+    Rng rng;
+    uint64_t remaining;
+    double compressibility;
+};
+
+void generate(const GenOptions &opts) {
+    ZipWriter w(opts.output, opts.zip64, opts.descriptors);
+    Rng rng(opts.seed);
+    for(uint64_t i=0; i<opts.entries; i++) {
+        auto size = pick_size(rng, opts);
+        auto method = pick_method(rng, opts);
+        auto name = pick_name(rng, opts, i);
+        // Always draw so that corrupted archives differ from clean ones only in the damaged entries.
+        auto corruption = rng.uniform() < opts.corrupt_fraction ? opts.corrupt_kind : CORRUPT_NONE;
+        ContentSource source(rng.next(), size, opts.compressibility);
+        w.add_entry(name, method, size, std::ref(source), corruption);
+    }
+    w.finish();
+}
+
+bool parse_methods(const std::string &spec, GenOptions &opts) {
+    opts.store_weight = opts.deflate_weight = opts.lzma_weight = 0;
+    size_t start = 0;
+    while(start < spec.size()) {
+        auto end = spec.find(',', start);
+        if(end == std::string::npos) {
+            end = spec.size();
+        }
+        auto item = spec.substr(start, end - start);
+        unsigned weight = 1;
+        auto eq = item.find('=');
+        if(eq != std::string::npos) {
+            weight = atoi(item.c_str() + eq + 1);
+            item = item.substr(0, eq);
+        }
+        if(item == "store") {
+            opts.store_weight = weight;
+        } else if(item == "deflate") {
+            opts.deflate_weight = weight;
+        } else if(item == "lzma") {
+            opts.lzma_weight = weight;
+        } else {
+            return false;
+        }
+        start = end + 1;
+    }
+    return opts.store_weight + opts.deflate_weight + opts.lzma_weight > 0;
+}
+
+bool parse_sizes(const std::string &spec, GenOptions &opts) {
+    if(spec == "tiny") {
+        opts.sizes = SIZE_TINY;
+    } else if(spec == "small") {
+        opts.sizes = SIZE_SMALL;
+    } else if(spec == "huge") {
+        opts.sizes = SIZE_HUGE;
+    } else if(spec == "mixed") {
+        opts.sizes = SIZE_MIXED;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_corruption(const std::string &spec, GenOptions &opts) {
+    if(spec == "crc") {
+        opts.corrupt_kind = CORRUPT_CRC;
+    } else if(spec == "truncate") {
+        opts.corrupt_kind = CORRUPT_TRUNCATE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void usage(const char *prog) {
+    printf("%s [options] <output zip>\n\n", prog);
+    printf("  --seed N               seed for all random choices (default 1)\n");
+    printf("  --entries N            number of entries (default 1000)\n");
+    printf("  --sizes CLASS          tiny, small, huge or mixed (default mixed)\n");
+    printf("  --max-size BYTES       upper bound for entry sizes (default 16 MiB)\n");
+    printf("  --methods SPEC         weights, e.g. store=1,deflate=3,lzma=1 (default)\n");
+    printf("  --depth N              directory levels above each file (default 2)\n");
+    printf("  --fanout N             subdirectories per directory (default 8)\n");
+    printf("  --descriptors          write sizes in data descriptors after the data\n");
+    printf("  --zip64                use zip64 records even when not needed\n");
+    printf("  --compressibility F    0.0 is random data, 1.0 compresses well (default 0.7)\n");
+    printf("  --corrupt-fraction F   fraction of entries to damage (default 0)\n");
+    printf("  --corrupt-kind KIND    crc or truncate (default crc)\n");
+}
+
+}
+
+int main(int argc, char **argv) {
+    GenOptions opts;
+    for(int i=1; i<argc; i++) {
+        std::string arg(argv[i]);
+        const bool has_value = i+1 < argc;
+        if(arg == "--seed" && has_value) {
+            opts.seed = strtoull(argv[++i], nullptr, 10);
+        } else if(arg == "--entries" && has_value) {
+            opts.entries = strtoull(argv[++i], nullptr, 10);
+        } else if(arg == "--sizes" && has_value) {
+            if(!parse_sizes(argv[++i], opts)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(arg == "--max-size" && has_value) {
+            opts.max_size = strtoull(argv[++i], nullptr, 10);
+        } else if(arg == "--methods" && has_value) {
+            if(!parse_methods(argv[++i], opts)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(arg == "--depth" && has_value) {
+            opts.depth = atoi(argv[++i]);
+        } else if(arg == "--fanout" && has_value) {
+            opts.fanout = std::max(1, atoi(argv[++i]));
+        } else if(arg == "--descriptors") {
+            opts.descriptors = true;
+        } else if(arg == "--zip64") {
+            opts.zip64 = true;
+        } else if(arg == "--compressibility" && has_value) {
+            opts.compressibility = std::min(1.0, std::max(0.0, atof(argv[++i])));
+        } else if(arg == "--corrupt-fraction" && has_value) {
+            opts.corrupt_fraction = std::min(1.0, std::max(0.0, atof(argv[++i])));
+        } else if(arg == "--corrupt-kind" && has_value) {
+            if(!parse_corruption(argv[++i], opts)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(opts.output.empty() && arg[0] != '-') {
+            opts.output = arg;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(opts.output.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    try {
+        generate(opts);
+    } catch(std::exception &e) {
+        printf("Generating archive failed: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"zipwriter.h"
+#include"zipdefs.h"
+#include"utils.h"
+
+#include<unistd.h>
+
+#include<algorithm>
+#include<cstring>
+#include<stdexcept>
+
+namespace {
+
+const constexpr uint32_t DESCRIPTOR_SIG = 0x08074b50;
+const constexpr uint16_t VERSION_MADE_BY = (MADE_BY_UNIX << 8) | NEEDED_VERSION;
+const constexpr uint32_t REGULAR_FILE_ATTRS = 0100644u << 16;
+// 1980-01-01 00:00, the earliest date the DOS format can express.
+const constexpr uint16_t DOS_DATE = (1 << 5) | 1;
+const constexpr uint16_t DOS_TIME = 0;
+const constexpr size_t CHUNK_SIZE = 1024*1024;
+
+}
+
+Encoder::Encoder(uint16_t method, uint64_t size_hint) : method(method), started(false), lstrm(LZMA_STREAM_INIT) {
+    memset(&zstrm, 0, sizeof(zstrm));
+    if(method == ZIP_DEFLATE) {
+        if(deflateInit2(&zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("Could not init zlib compressor.");
+        }
+    } else if(method == ZIP_LZMA) {
+        lzma_lzma_preset(&lzma_opts, 6);
+        // A dictionary larger than the data only costs memory and setup time.
+        if(size_hint < lzma_opts.dict_size) {
+            lzma_opts.dict_size = std::max<uint32_t>(LZMA_DICT_SIZE_MIN, size_hint);
+        }
+        lzma_filter filters[2];
+        filters[0].id = LZMA_FILTER_LZMA1;
+        filters[0].options = &lzma_opts;
+        filters[1].id = LZMA_VLI_UNKNOWN;
+        if(lzma_raw_encoder(&lstrm, filters) != LZMA_OK) {
+            throw std::runtime_error("Could not initialize LZMA encoder.");
+        }
+    } else if(method != ZIP_NO_COMPRESSION) {
+        throw std::runtime_error("Unsupported compression format.");
+    }
+}
+
+Encoder::~Encoder() {
+    if(method == ZIP_DEFLATE) {
+        deflateEnd(&zstrm);
+    } else if(method == ZIP_LZMA) {
+        lzma_end(&lstrm);
+    }
+}
+
+void Encoder::write(const unsigned char *buf, size_t bufsize, std::vector<unsigned char> &out) {
+    run(buf, bufsize, false, out);
+}
+
+void Encoder::finish(std::vector<unsigned char> &out) {
+    run(nullptr, 0, true, out);
+}
+
+void Encoder::run(const unsigned char *buf, size_t bufsize, bool last, std::vector<unsigned char> &out) {
+    if(method == ZIP_NO_COMPRESSION) {
+        out.insert(out.end(), buf, buf + bufsize);
+        return;
+    }
+    if(method == ZIP_LZMA && !started) {
+        lzma_filter filter;
+        filter.id = LZMA_FILTER_LZMA1;
+        filter.options = &lzma_opts;
+        uint8_t props[5];
+        if(lzma_properties_encode(&filter, props) != LZMA_OK) {
+            throw std::runtime_error("Could not encode LZMA properties.");
+        }
+        // LZMA SDK version 9.20 followed by the size of the properties.
+        out.push_back(9);
+        out.push_back(20);
+        out.push_back(sizeof(props));
+        out.push_back(0);
+        for(auto p : props) {
+            out.push_back(p);
+        }
+    }
+    started = true;
+    unsigned char tmp[64*1024];
+    if(method == ZIP_DEFLATE) {
+        zstrm.next_in = const_cast<unsigned char*>(buf);
+        zstrm.avail_in = bufsize;
+        int ret;
+        do {
+            zstrm.next_out = tmp;
+            zstrm.avail_out = sizeof(tmp);
+            ret = deflate(&zstrm, last ? Z_FINISH : Z_NO_FLUSH);
+            if(ret == Z_STREAM_ERROR) {
+                throw std::runtime_error("Compression failed.");
+            }
+            out.insert(out.end(), tmp, tmp + sizeof(tmp) - zstrm.avail_out);
+        } while(zstrm.avail_out == 0 || (last && ret != Z_STREAM_END));
+    } else {
+        lstrm.next_in = buf;
+        lstrm.avail_in = bufsize;
+        lzma_ret ret;
+        do {
+            lstrm.next_out = tmp;
+            lstrm.avail_out = sizeof(tmp);
+            ret = lzma_code(&lstrm, last ? LZMA_FINISH : LZMA_RUN);
+            if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
+                throw std::runtime_error("LZMA compression failed.");
+            }
+            out.insert(out.end(), tmp, tmp + sizeof(tmp) - lstrm.avail_out);
+        } while(lstrm.avail_out == 0 || (last && ret != LZMA_STREAM_END));
+    }
+}
+
+std::vector<unsigned char> encode_buffer(uint16_t method, const std::vector<unsigned char> &in) {
+    std::vector<unsigned char> out;
+    Encoder enc(method, in.size());
+    enc.write(in.data(), in.size(), out);
+    enc.finish(out);
+    return out;
+}
+
+ZipWriter::ZipWriter(const std::string &fname, bool force_zip64, bool descriptors) :
+    f(fname, "wb"), force_zip64(force_zip64), descriptors(descriptors), in(CHUNK_SIZE) {
+}
+
+void ZipWriter::add_entry(const std::string &name, uint16_t method, uint64_t size, const DataSource &source,
+        Corruption corruption) {
+    CentralRecord r;
+    r.name = name;
+    r.method = method;
+    r.flags = descriptors ? FLAG_DATA_DESCRIPTOR : 0;
+    r.offset = f.tell();
+    // Whether the local header has zip64 sizes must be decided before the data
+    // is compressed. Leave some slack for data that does not compress.
+    const bool zip64 = force_zip64 || size >= 0xF0000000ull;
+
+    f.write32le(LOCAL_SIG);
+    f.write16le(zip64 ? 45 : 20);
+    f.write16le(r.flags);
+    f.write16le(method);
+    f.write16le(DOS_TIME);
+    f.write16le(DOS_DATE);
+    const auto sizes_pos = f.tell();
+    f.write32le(0);
+    f.write32le(zip64 ? 0xFFFFFFFF : 0);
+    f.write32le(zip64 ? 0xFFFFFFFF : 0);
+    f.write16le(name.size());
+    f.write16le(zip64 ? 20 : 0);
+    f.write(name);
+    const auto extra_pos = f.tell();
+    if(zip64) {
+        f.write16le(ZIP_EXTRA_ZIP64);
+        f.write16le(16);
+        f.write64le(0);
+        f.write64le(0);
+    }
+
+    Encoder enc(method, size);
+    std::vector<unsigned char> out;
+    uint32_t crc = crc32(0, Z_NULL, 0);
+    uint64_t total_in = 0;
+    uint64_t total_out = 0;
+    size_t got;
+    while((got = source(in.data(), in.size())) > 0) {
+        crc = crc32(crc, in.data(), got);
+        total_in += got;
+        enc.write(in.data(), got, out);
+        f.write(out.data(), out.size());
+        total_out += out.size();
+        out.clear();
+    }
+    enc.finish(out);
+    f.write(out.data(), out.size());
+    total_out += out.size();
+    if(total_in != size) {
+        throw std::runtime_error("Data source produced the wrong amount of data.");
+    }
+    if(!zip64 && total_out >= 0xFFFFFFFFull) {
+        throw std::runtime_error("Entry did not compress enough to fit without zip64.");
+    }
+    if(corruption == CORRUPT_CRC) {
+        crc = ~crc;
+    } else if(corruption == CORRUPT_TRUNCATE) {
+        const uint64_t data_start = extra_pos + (zip64 ? 20 : 0);
+        total_out /= 2;
+        f.flush();
+        if(ftruncate(f.fileno(), data_start + total_out) != 0) {
+            throw_system("Could not truncate entry:");
+        }
+        f.seek(data_start + total_out);
+    }
+    r.crc = crc;
+    r.compressed_size = total_out;
+    r.uncompressed_size = total_in;
+
+    if(descriptors) {
+        // Streaming writers leave the local header sizes zeroed and append them after the data.
+        f.write32le(DESCRIPTOR_SIG);
+        f.write32le(crc);
+        if(zip64) {
+            f.write64le(total_out);
+            f.write64le(total_in);
+        } else {
+            f.write32le(total_out);
+            f.write32le(total_in);
+        }
+    } else {
+        const auto end = f.tell();
+        f.seek(sizes_pos);
+        f.write32le(crc);
+        if(zip64) {
+            f.seek(extra_pos + 4);
+            f.write64le(total_in);
+            f.write64le(total_out);
+        } else {
+            f.write32le(total_out);
+            f.write32le(total_in);
+        }
+        f.seek(end);
+    }
+    records.push_back(std::move(r));
+}
+
+void ZipWriter::write_central(const CentralRecord &r) {
+    const bool big_sizes = force_zip64 || r.uncompressed_size >= 0xFFFFFFFFull || r.compressed_size >= 0xFFFFFFFFull;
+    const bool big_offset = force_zip64 || r.offset >= 0xFFFFFFFFull;
+    const uint16_t extra_size = (big_sizes ? 16 : 0) + (big_offset ? 8 : 0);
+    f.write32le(CENTRAL_SIG);
+    f.write16le(VERSION_MADE_BY);
+    f.write16le(extra_size ? 45 : 20);
+    f.write16le(r.flags);
+    f.write16le(r.method);
+    f.write16le(DOS_TIME);
+    f.write16le(DOS_DATE);
+    f.write32le(r.crc);
+    f.write32le(big_sizes ? 0xFFFFFFFF : r.compressed_size);
+    f.write32le(big_sizes ? 0xFFFFFFFF : r.uncompressed_size);
+    f.write16le(r.name.size());
+    f.write16le(extra_size ? extra_size + 4 : 0);
+    f.write16le(0); // Comment length.
+    f.write16le(0); // Disk number.
+    f.write16le(0); // Internal attributes.
+    f.write32le(REGULAR_FILE_ATTRS);
+    f.write32le(big_offset ? 0xFFFFFFFF : r.offset);
+    f.write(r.name);
+    if(extra_size) {
+        f.write16le(ZIP_EXTRA_ZIP64);
+        f.write16le(extra_size);
+        if(big_sizes) {
+            f.write64le(r.uncompressed_size);
+            f.write64le(r.compressed_size);
+        }
+        if(big_offset) {
+            f.write64le(r.offset);
+        }
+    }
+}
+
+void ZipWriter::finish() {
+    const uint64_t dir_start = f.tell();
+    for(const auto &r : records) {
+        write_central(r);
+    }
+    const uint64_t dir_end = f.tell();
+    const uint64_t dir_size = dir_end - dir_start;
+    const uint64_t num_entries = records.size();
+    const bool zip64 = force_zip64 || num_entries >= 0xFFFF ||
+            dir_start >= 0xFFFFFFFFull || dir_size >= 0xFFFFFFFFull;
+    if(zip64) {
+        f.write32le(ZIP64_CENTRAL_END_SIG);
+        f.write64le(44);
+        f.write16le(VERSION_MADE_BY);
+        f.write16le(45);
+        f.write32le(0);
+        f.write32le(0);
+        f.write64le(num_entries);
+        f.write64le(num_entries);
+        f.write64le(dir_size);
+        f.write64le(dir_start);
+
+        f.write32le(ZIP64_CENTRAL_LOCATOR_SIG);
+        f.write32le(0);
+        f.write64le(dir_end);
+        f.write32le(1);
+    }
+    f.write32le(CENTRAL_END_SIG);
+    f.write16le(0);
+    f.write16le(0);
+    f.write16le(zip64 ? 0xFFFF : num_entries);
+    f.write16le(zip64 ? 0xFFFF : num_entries);
+    f.write32le(zip64 ? 0xFFFFFFFF : dir_size);
+    f.write32le(zip64 ? 0xFFFFFFFF : dir_start);
+    f.write16le(0);
+    f.close();
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include"file.h"
+
+#include<zlib.h>
+#include<lzma.h>
+
+#include<cstdint>
+#include<functional>
+#include<string>
+#include<vector>
+
+/* Streaming compressor for the methods the unpacker supports. LZMA
+ * output is prefixed with the version and property header that zip
+ * files use. */
+class Encoder final {
+public:
+    Encoder(uint16_t method, uint64_t size_hint);
+    Encoder(const Encoder &) = delete;
+    Encoder& operator=(const Encoder &) = delete;
+    ~Encoder();
+
+    void write(const unsigned char *buf, size_t bufsize, std::vector<unsigned char> &out);
+    void finish(std::vector<unsigned char> &out);
+
+private:
+    void run(const unsigned char *buf, size_t bufsize, bool last, std::vector<unsigned char> &out);
+
+    uint16_t method;
+    bool started;
+    z_stream zstrm;
+    lzma_stream lstrm;
+    lzma_options_lzma lzma_opts;
+};
+
+std::vector<unsigned char> encode_buffer(uint16_t method, const std::vector<unsigned char> &in);
+
+/* Called repeatedly to fill the given buffer with entry data. Returns
+ * the number of bytes produced, zero at the end of the entry. */
+typedef std::function<size_t(unsigned char *buf, size_t bufsize)> DataSource;
+
+enum Corruption {
+    CORRUPT_NONE,
+    CORRUPT_CRC,      // Headers carry a checksum that does not match the data.
+    CORRUPT_TRUNCATE, // Only the first half of the compressed data is stored.
+};
+
+/* Writes zip files entry by entry. Only the central directory records are
+ * kept in memory so archives can have millions of entries and entries
+ * can be arbitrarily large. */
+class ZipWriter final {
+public:
+    ZipWriter(const std::string &fname, bool force_zip64, bool descriptors);
+
+    void add_entry(const std::string &name, uint16_t method, uint64_t size, const DataSource &source,
+            Corruption corruption=CORRUPT_NONE);
+    void finish();
+
+private:
+    struct CentralRecord {
+        std::string name;
+        uint16_t method;
+        uint16_t flags;
+        uint32_t crc;
+        uint64_t compressed_size;
+        uint64_t uncompressed_size;
+        uint64_t offset;
+    };
+
+    void write_central(const CentralRecord &r);
+
+    File f;
+    bool force_zip64;
+    bool descriptors;
+    std::vector<unsigned char> in;
+    std::vector<CentralRecord> records;
+};
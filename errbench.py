@@ -0,0 +1,224 @@
+#!/usr/bin/env python3
+
+# Copyright (C) 2017 Jussi Pakkanen.
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of version 3, or (at your option) any later version,
+# of the GNU General Public License as published
+# by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Measures the runtime cost of exceptions versus error objects. Where
+# measure.py compares binary sizes, this runs the unpackers on generated
+# archives where none, some or most entries fail and reports throughput,
+# the extra time spent per failed entry and instruction counts. The cost
+# of a single failure is also timed in isolation with bench/errpath-*,
+# since in a real extraction it is easily lost in file system noise.
+
+import argparse, json, os, shutil, statistics, subprocess, sys, tempfile, time
+from zipfile import ZipFile
+
+class Variant:
+    def __init__(self, name, exe, errpath):
+        self.name = name
+        self.exe = exe
+        # Microbenchmark of a single failure in the same build.
+        self.errpath = errpath
+
+class Workload:
+    def __init__(self, name, seed, genargs, baseline=None, existing_fraction=0.0):
+        self.name = name
+        self.seed = seed
+        self.genargs = genargs
+        # Name of the workload that is identical except for the failures.
+        # They share the seed so the archives only differ in the damaged entries.
+        self.baseline = baseline
+        # Fraction of entries that already exist in the output directory.
+        self.existing_fraction = existing_fraction
+        self.archive = None
+        self.uncompressed = 0
+        self.names = []
+
+class ErrorBenchmark:
+    def __init__(self, options):
+        self.options = options
+        self.meson = shutil.which('meson') or shutil.which('meson.py') or '../meson/meson.py'
+        self.ninja = 'ninja'
+        self.perf = shutil.which('perf')
+        self.workdir = tempfile.mkdtemp(prefix='errbench-')
+
+    def build(self, builddir, extra_options):
+        if not os.path.exists(os.path.join(builddir, 'build.ninja')):
+            subprocess.check_call([self.meson, builddir, '--buildtype=release'] + extra_options)
+        subprocess.check_call([self.ninja, '-C', builddir])
+
+    def variants(self):
+        exc_build = self.options.builddir
+        noexcept_build = self.options.noexcept_builddir
+        self.build(exc_build, ['-Dstats=false'])
+        pool_build = self.options.pool_builddir
+        self.build(noexcept_build, ['-Dnoexcept=true', '-Dstats=false'])
+        self.build(pool_build, ['-Derror_pool=true', '-Dstats=false'])
+        self.zipgen = os.path.join(exc_build, 'bench/zipgen')
+        return [Variant('exceptions', os.path.join(exc_build, 'src/exc-unzip'),
+                        os.path.join(exc_build, 'bench/errpath-exc')),
+                Variant('error objects', os.path.join(exc_build, 'noexsrc/noexc-unzip'),
+                        os.path.join(exc_build, 'bench/errpath-noexc')),
+                Variant('error objects, -fno-exceptions', os.path.join(noexcept_build, 'noexsrc/noexc-unzip'),
+                        os.path.join(noexcept_build, 'bench/errpath-noexc')),
+                Variant('pooled error objects', os.path.join(pool_build, 'noexsrc/noexc-unzip'),
+                        os.path.join(pool_build, 'bench/errpath-noexc')),
+               ]
+
+    def workloads(self):
+        f = str(self.options.corrupt_fraction)
+        entries = str(self.options.entries)
+        small = ['--entries', entries, '--sizes', 'small', '--methods', 'store=1,deflate=3']
+        return [Workload('large valid', 1, ['--entries', '8', '--sizes', 'huge', '--max-size', str(64*1024*1024)]),
+                Workload('small valid', 2, small),
+                Workload('bad crc', 2, small + ['--corrupt-fraction', f, '--corrupt-kind', 'crc'], 'small valid'),
+                Workload('truncated data', 2, small + ['--corrupt-fraction', f, '--corrupt-kind', 'truncate'], 'small valid'),
+                Workload('existing targets', 2, small, 'small valid', self.options.corrupt_fraction),
+                Workload('header heavy', 3, ['--entries', str(10*self.options.entries), '--sizes', 'tiny', '--depth', '4']),
+               ]
+
+    def generate(self, w, index):
+        w.archive = os.path.join(self.workdir, 'workload%d.zip' % index)
+        subprocess.check_call([self.zipgen, '--seed', str(w.seed)] + w.genargs + [w.archive],
+                              stdout=subprocess.DEVNULL)
+        with ZipFile(w.archive) as zf:
+            w.names = zf.namelist()
+            w.uncompressed = sum(i.file_size for i in zf.infolist())
+
+    def prepare_outdir(self, w):
+        outdir = tempfile.mkdtemp(dir=self.workdir)
+        if w.existing_fraction > 0:
+            step = max(1, int(round(1.0 / w.existing_fraction)))
+            for name in w.names[::step]:
+                fname = os.path.join(outdir, name)
+                os.makedirs(os.path.dirname(fname), exist_ok=True)
+                open(fname, 'w').close()
+        return outdir
+
+    def run_once(self, exe, archive, w):
+        outdir = self.prepare_outdir(w)
+        try:
+            start = time.perf_counter()
+            p = subprocess.run([exe, archive], cwd=outdir, stdout=subprocess.PIPE,
+                               stderr=subprocess.DEVNULL)
+            elapsed = time.perf_counter() - start
+            failures = p.stdout.count(b'FAIL:')
+        finally:
+            shutil.rmtree(outdir)
+        return elapsed, failures
+
+    def instructions(self, exe, archive, w):
+        if not self.perf:
+            return None
+        outdir = self.prepare_outdir(w)
+        try:
+            p = subprocess.run([self.perf, 'stat', '-x', ',', '-e', 'instructions:u', exe, archive],
+                               cwd=outdir, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        finally:
+            shutil.rmtree(outdir)
+        for line in p.stderr.decode(errors='replace').splitlines():
+            fields = line.split(',')
+            if len(fields) > 2 and 'instructions' in fields[2] and fields[0].isdigit():
+                return int(fields[0])
+        return None
+
+    def measure(self, exe, archive, w):
+        for _ in range(self.options.warmup):
+            self.run_once(exe, archive, w)
+        times = []
+        failures = 0
+        for _ in range(self.options.reps):
+            t, failures = self.run_once(exe, archive, w)
+            times.append(t)
+        return statistics.median(times), failures
+
+    def error_path(self, variants):
+        results = []
+        for v in variants:
+            p = subprocess.run([v.errpath], stdout=subprocess.PIPE, check=True)
+            for b in json.loads(p.stdout.decode())['benchmarks']:
+                results.append({'variant': v.name, 'error': b['name'], 'ns_per_error': b['ns_per_error']})
+        return results
+
+    def run(self):
+        variants = self.variants()
+        error_path = self.error_path(variants)
+        workloads = self.workloads()
+        for i, w in enumerate(workloads):
+            self.generate(w, i)
+        results = []
+        for v in variants:
+            baselines = {}
+            for w in workloads:
+                median, failures = self.measure(v.exe, w.archive, w)
+                r = {'variant': v.name,
+                     'workload': w.name,
+                     'entries': len(w.names),
+                     'failures': failures,
+                     'median_s': median,
+                     'mb_per_s': w.uncompressed / median / 1e6,
+                     'entries_per_s': len(w.names) / median,
+                     'instructions': self.instructions(v.exe, w.archive, w),
+                    }
+                baselines[w.name] = median
+                if w.baseline and failures > 0:
+                    r['ns_per_error'] = (median - baselines[w.baseline]) * 1e9 / failures
+                results.append(r)
+        return {'extraction': results, 'error_path': error_path}
+
+    def cleanup(self):
+        shutil.rmtree(self.workdir, ignore_errors=True)
+
+def print_table(all_results):
+    print('%-32s %-18s %14s' % ('variant', 'error', 'ns/error'))
+    for r in all_results['error_path']:
+        print('%-32s %-18s %14.1f' % (r['variant'], r['error'], r['ns_per_error']))
+    print()
+    results = all_results['extraction']
+    print('%-32s %-18s %8s %10s %10s %14s %16s' %
+          ('variant', 'workload', 'fails', 'MB/s', 'entries/s', 'ns/error', 'instructions'))
+    for r in results:
+        ns_per_error = '%.0f' % r['ns_per_error'] if 'ns_per_error' in r else '-'
+        instructions = str(r['instructions']) if r['instructions'] is not None else '-'
+        print('%-32s %-18s %8d %10.1f %10.0f %14s %16s' %
+              (r['variant'], r['workload'], r['failures'], r['mb_per_s'],
+               r['entries_per_s'], ns_per_error, instructions))
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Compare runtime cost of exceptions and error objects.')
+    parser.add_argument('--builddir', default='errbench-build',
+                        help='build directory of the default configuration, created if missing')
+    parser.add_argument('--noexcept-builddir', default='errbench-build-noexcept',
+                        help='build directory configured with -Dnoexcept=true, created if missing')
+    parser.add_argument('--pool-builddir', default='errbench-build-pool',
+                        help='build directory configured with -Derror_pool=true, created if missing')
+    parser.add_argument('--entries', type=int, default=5000,
+                        help='number of entries in the small entry workloads')
+    parser.add_argument('--corrupt-fraction', type=float, default=0.1,
+                        help='fraction of entries that fail in the error workloads')
+    parser.add_argument('--reps', type=int, default=5)
+    parser.add_argument('--warmup', type=int, default=1)
+    parser.add_argument('--json', action='store_true', help='print results as JSON')
+    options = parser.parse_args()
+    b = ErrorBenchmark(options)
+    try:
+        results = b.run()
+    finally:
+        b.cleanup()
+    if options.json:
+        json.dump(results, sys.stdout, indent=2)
+        print()
+    else:
+        print_table(results)
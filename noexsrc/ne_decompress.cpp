@@ -110,7 +110,8 @@ uint32_t inflate_to_file(const unsigned char *data_start,
             case Z_NEED_DICT:
             case Z_DATA_ERROR:
             case Z_MEM_ERROR:
-                *e = create_error(strm.msg);
+                // Msg is not set when allocation fails.
+                *e = create_error(strm.msg ? strm.msg : "Decompression failed.");
                 return 0;
             }
             have = CHUNK - strm.avail_out;
@@ -270,10 +271,7 @@ void create_device(const localheader &lh, const std::string &outname, Error **e)
 #else
     const std::string &d = lh.unix.data;
     if(d.size() != 8) {
-        std::string msg("Incorrect extra data for character device, expected 8, got ");
-        msg += std::to_string(d.size());
-        msg += ".";
-        *e = create_error(msg.c_str());
+        *e = create_error_fmt("Incorrect extra data for character device, expected 8, got %d.", (int)d.size());
         return;
     }
     create_dirs_for_file(outname, e);
@@ -283,12 +281,7 @@ void create_device(const localheader &lh, const std::string &outname, Error **e)
     uint32_t major_id = le32toh(*reinterpret_cast<const uint32_t*>(&d[0]));
     uint32_t minor_id = le32toh(*reinterpret_cast<const uint32_t*>(&d[4]));
     if(mknod(outname.c_str(), S_IFCHR, makedev(major_id, minor_id)) != 0) {
-        std::string msg("Could not create device node, major ");
-        msg += std::to_string(major_id);
-        msg += " minor ";
-        msg += std::to_string(minor_id);
-        msg += ": ";
-        *e = create_system_error(msg.c_str());
+        *e = create_system_error_fmt("Could not create device node, major %u minor %u: ", major_id, minor_id);
     }
 #endif
 }
@@ -34,10 +34,7 @@ void File::initialize(const std::string &fname, const char *mode, Error **e) {
     }
     f = fopen(fname.c_str(), mode);
     if(!f) {
-        std::string msg("Could not open file ");
-        msg += fname;
-        msg += ":";
-        *e = create_system_error(msg.c_str());
+        *e = create_system_error_fmt("Could not open file %s:", fname.c_str());
     }
 
 }
@@ -25,8 +25,10 @@
 
 #include<zlib.h>
 
+#include<algorithm>
 #include<cerrno>
 #include<cassert>
+#include<cstdarg>
 #include<cstring>
 
 #include<stdexcept>
@@ -36,6 +38,115 @@
 using std::min;
 #endif
 
+#ifdef NE_ERROR_POOL
+
+namespace {
+
+const constexpr int MAX_POOLED_ERRORS = 64;
+
+class ErrorPool final {
+public:
+    ~ErrorPool() {
+        while(head) {
+            Error *e = head;
+            head = head->next;
+            delete e;
+        }
+    }
+
+    Error* get() {
+        Error *e = head;
+        if(e) {
+            head = e->next;
+            --size;
+        } else {
+            e = new Error();
+        }
+        e->msg = nullptr;
+        e->errnum = 0;
+        e->next = nullptr;
+        e->text[0] = '\0';
+        return e;
+    }
+
+    void put(Error *e) {
+        if(size >= MAX_POOLED_ERRORS) {
+            delete e;
+            return;
+        }
+        e->next = head;
+        head = e;
+        ++size;
+    }
+
+private:
+    Error *head = nullptr;
+    int size = 0;
+};
+
+ErrorPool& pool() {
+    static thread_local ErrorPool p;
+    return p;
+}
+
+Error* create_error_va(const char *fmt, va_list args) {
+    Error *e = pool().get();
+    vsnprintf(e->context, sizeof(e->context), fmt, args);
+    e->msg = e->context;
+    return e;
+}
+
+}
+
+Error* create_error(const char *msg) {
+    Error *e = pool().get();
+    e->msg = msg;
+    return e;
+}
+
+void free_error(Error *e) {
+    pool().put(e);
+}
+
+Error* create_system_error(const char *msg) {
+    assert(errno != 0);
+    const int errnum = errno;
+    Error *e = create_error(msg);
+    e->errnum = errnum;
+    return e;
+}
+
+const char* error_message(Error *e) {
+    if(e->errnum == 0) {
+        return e->msg;
+    }
+    if(e->text[0] == '\0') {
+        const size_t max = sizeof(e->text) - 1;
+        size_t len = std::min(strlen(e->msg), max);
+        memcpy(e->text, e->msg, len);
+        if(len > 0 && len < max && e->text[len-1] != ' ') {
+            e->text[len++] = ' ';
+        }
+        const char *desc = strerror(e->errnum);
+        const size_t desc_len = std::min(strlen(desc), max - len);
+        memcpy(e->text + len, desc, desc_len);
+        e->text[len + desc_len] = '\0';
+    }
+    return e->text;
+}
+
+#else
+
+namespace {
+
+Error* create_error_va(const char *fmt, va_list args) {
+    char buf[1024];
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    return create_error(buf);
+}
+
+}
+
 Error* create_error(const char *msg) {
     Error *e = new Error();
     e->msg = msg;
@@ -56,6 +167,38 @@ Error* create_system_error(const char *msg) {
     return create_error(error.c_str());
 }
 
+const char* error_message(Error *e) {
+    return e->msg.c_str();
+}
+
+#endif
+
+Error* create_error_fmt(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    Error *e = create_error_va(fmt, args);
+    va_end(args);
+    return e;
+}
+
+Error* create_system_error_fmt(const char *fmt, ...) {
+    assert(errno != 0);
+    const int errnum = errno;
+    va_list args;
+    va_start(args, fmt);
+    Error *e = create_error_va(fmt, args);
+    va_end(args);
+#ifdef NE_ERROR_POOL
+    e->errnum = errnum;
+#else
+    if(e->msg.back() != ' ') {
+        e->msg += ' ';
+    }
+    e->msg += strerror(errnum);
+#endif
+    return e;
+}
+
 uint32_t CRC32(const unsigned char *buf, uint64_t bufsize) {
     uint32_t crcvalue = crc32(0, Z_NULL, 0);
     const uint64_t blocksize = 1024*1024;
@@ -30,15 +30,45 @@ class File;
  * but it's so new that compilers don't support it yet.
  */
 
+#ifdef NE_ERROR_POOL
+
+/* Errors are recycled through a per-thread free list and never allocate
+ * strings. Messages without context are pointers to string literals,
+ * formatted context goes into the fixed buffer and the system error
+ * text is only looked up when the message is printed. */
+struct Error {
+    const char *msg;
+    int errnum;
+    Error *next;
+    char context[128];
+    char text[256];
+};
+
+#else
+
 struct Error {
     std::string msg;
 };
 
+#endif
+
+#if defined(__GNUC__)
+#define NE_PRINTF_FORMAT(fmt, first) __attribute__((format(printf, fmt, first)))
+#else
+#define NE_PRINTF_FORMAT(fmt, first)
+#endif
+
+/* The plain versions must be given string literals. */
 Error* create_error(const char *msg);
+Error* create_error_fmt(const char *fmt, ...) NE_PRINTF_FORMAT(1, 2);
 
 void free_error(Error *e);
 
+/* Appends the description of errno to the message. */
 Error* create_system_error(const char *msg);
+Error* create_system_error_fmt(const char *fmt, ...) NE_PRINTF_FORMAT(1, 2);
+
+const char* error_message(Error *e);
 
 uint32_t CRC32(const unsigned char *buf, uint64_t bufsize);
 uint32_t CRC32(File &f, Error **e);
@@ -348,12 +348,8 @@ void ZipFile::initialize(const char *fname, Error **e) {
         return;
     }
     if(entries.size() != centrals.size()) {
-        std::string msg("Mismatch. File has ");
-        msg += std::to_string(entries.size());
-        msg += " local entries but ";
-        msg += std::to_string(centrals.size());
-        msg += " central entries.";
-        *e = create_error(msg.c_str());
+        *e = create_error_fmt("Mismatch. File has %llu local entries but %llu central entries.",
+                (unsigned long long)entries.size(), (unsigned long long)centrals.size());
         return;
     }
     auto id = zipfile.read32le(e);
@@ -466,12 +462,17 @@ void ZipFile::unzip(const std::string &prefix, Error **e) const {
 
     unsigned char *file_start = map;
     for(size_t i=0; i<entries.size(); i++) {
+        Error *entry_error = nullptr;
         auto r = unpack_entry(prefix, entries[i],
                 centrals[i],
                 file_start + data_offsets[i],
-                entries[i].compressed_size, e);
-        if(*e) {
-            return;
+                entries[i].compressed_size, &entry_error);
+        // A broken entry does not stop the rest from being unpacked, same as in the exception version.
+        if(entry_error) {
+            printf("%s\n%s\n", r.msg.c_str(), error_message(entry_error));
+            free_error(entry_error);
+        } else {
+            printf("%s\n", r.msg.c_str());
         }
     }
 }
@@ -35,13 +35,13 @@ int main(int argc, char **argv) {
     ZipFile f;
     f.initialize(argv[1], &e);
     if(e) {
-        printf("Opening file failed: %s\n", e->msg.c_str());
+        printf("Opening file failed: %s\n", error_message(e));
         free_error(e);
         return 1;
     }
     f.unzip("", &e);
     if(e) {
-        printf("Unzipping failed: %s\n", e->msg.c_str());
+        printf("Unzipping failed: %s\n", error_message(e));
         free_error(e);
         return 1;
     }
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"arena.h"
+#include"stats.h"
+
+#ifndef _WIN32
+#include<sys/mman.h>
+#include<cstdlib>
+#endif
+
+#include<algorithm>
+#include<new>
+
+namespace {
+
+// Every allocation is preceded by its size so frees can be accounted for.
+const constexpr size_t HEADER_SIZE = 16;
+const constexpr size_t MIN_BLOCK_SIZE = 256*1024;
+// An entry with a huge LZMA dictionary should not pin that memory forever.
+const constexpr size_t MAX_RETAINED = 32*1024*1024;
+
+const constexpr size_t HUGE_PAGE_SIZE = 2*1024*1024;
+
+size_t round_up(size_t size, size_t multiple=HEADER_SIZE) {
+    return (size + multiple - 1) / multiple * multiple;
+}
+
+}
+
+void DecoderArena::BlockFree::operator()(unsigned char *p) const noexcept {
+    switch(kind) {
+    case HEAP:
+        delete[] p;
+        break;
+#ifndef _WIN32
+    case ALIGNED:
+        free(p);
+        break;
+    case MAPPED:
+        munmap(p, size);
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+DecoderArena::Block DecoderArena::new_block(size_t size) noexcept {
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+    if(huge) {
+        size = round_up(size, HUGE_PAGE_SIZE);
+#if defined(MAP_HUGETLB)
+        // Only succeeds if the administrator has reserved huge pages.
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(p != MAP_FAILED) {
+            return Block{std::unique_ptr<unsigned char[], BlockFree>(static_cast<unsigned char*>(p),
+                                                                     BlockFree{BlockFree::MAPPED, size}), size, 0};
+        }
+#endif
+        void *aligned = nullptr;
+        if(posix_memalign(&aligned, HUGE_PAGE_SIZE, size) != 0) {
+            return Block{std::unique_ptr<unsigned char[], BlockFree>(nullptr, BlockFree{BlockFree::HEAP, 0}), 0, 0};
+        }
+        madvise(aligned, size, MADV_HUGEPAGE);
+        return Block{std::unique_ptr<unsigned char[], BlockFree>(static_cast<unsigned char*>(aligned),
+                                                                 BlockFree{BlockFree::ALIGNED, size}), size, 0};
+    }
+#endif
+    return Block{std::unique_ptr<unsigned char[], BlockFree>(new(std::nothrow) unsigned char[size],
+                                                             BlockFree{BlockFree::HEAP, size}), size, 0};
+}
+
+void DecoderArena::set_huge_pages(bool enabled) noexcept {
+    if(enabled != huge) {
+        blocks.clear();
+        huge = enabled;
+    }
+}
+
+void DecoderArena::begin_entry() noexcept {
+    size_t capacity = 0;
+    for(const auto &b : blocks) {
+        capacity += b.size;
+    }
+    if(blocks.size() > 1 || capacity > MAX_RETAINED) {
+        // Merge so that the next entry of the same kind fits in a single block.
+        blocks.clear();
+        if(capacity <= MAX_RETAINED) {
+            auto b = new_block(capacity);
+            if(b.data) {
+                blocks.push_back(std::move(b));
+            }
+        }
+    } else if(!blocks.empty()) {
+        blocks.front().used = 0;
+    }
+    live = 0;
+}
+
+void* DecoderArena::allocate(size_t size) noexcept {
+    const size_t needed = round_up(size) + HEADER_SIZE;
+    if(limit != 0 && live + needed > limit) {
+        return nullptr;
+    }
+    if(blocks.empty() || blocks.back().size - blocks.back().used < needed) {
+        auto b = new_block(std::max(needed, MIN_BLOCK_SIZE));
+        if(!b.data) {
+            return nullptr;
+        }
+        try {
+            blocks.push_back(std::move(b));
+        } catch(const std::bad_alloc &) {
+            return nullptr;
+        }
+    }
+    auto &b = blocks.back();
+    unsigned char *p = b.data.get() + b.used;
+    b.used += needed;
+    *reinterpret_cast<size_t*>(p) = needed;
+    live += needed;
+    archive.allocations++;
+    archive.bytes += size;
+    archive.peak_bytes = std::max(archive.peak_bytes, live);
+    return p + HEADER_SIZE;
+}
+
+void DecoderArena::deallocate(void *p) noexcept {
+    if(!p) {
+        return;
+    }
+    // The memory itself is reused once the next entry begins.
+    live -= *reinterpret_cast<size_t*>(static_cast<unsigned char*>(p) - HEADER_SIZE);
+}
+
+void* DecoderArena::zalloc(void *opaque, unsigned items, unsigned size) {
+    return static_cast<DecoderArena*>(opaque)->allocate((size_t)items*size);
+}
+
+void DecoderArena::zfree(void *opaque, void *p) {
+    static_cast<DecoderArena*>(opaque)->deallocate(p);
+}
+
+void* DecoderArena::lzma_alloc(void *opaque, size_t nmemb, size_t size) {
+    return static_cast<DecoderArena*>(opaque)->allocate(nmemb*size);
+}
+
+void DecoderArena::lzma_free(void *opaque, void *p) {
+    static_cast<DecoderArena*>(opaque)->deallocate(p);
+}
+
+DecoderArena& thread_arena() noexcept {
+    static thread_local DecoderArena arena;
+    return arena;
+}
+
+ArenaScope::ArenaScope(bool huge_pages, uint64_t limit) noexcept :
+    arena(thread_arena()), old_huge_pages(arena.huge_pages()), old_limit(arena.memory_limit()) {
+    arena.set_huge_pages(huge_pages);
+    arena.set_limit(limit);
+    arena.begin_archive();
+}
+
+ArenaScope::~ArenaScope() {
+    STATS_COUNT(COUNT_DECODER_ALLOCS, arena.archive_stats().allocations);
+    STATS_COUNT(COUNT_DECODER_BYTES, arena.archive_stats().bytes);
+    STATS_MAX(GAUGE_DECODER_PEAK, arena.archive_stats().peak_bytes);
+    arena.set_limit(old_limit);
+    arena.set_huge_pages(old_huge_pages);
+}
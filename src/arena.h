@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<cstddef>
+#include<cstdint>
+#include<memory>
+#include<vector>
+
+struct AllocStats {
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    uint64_t peak_bytes = 0;
+};
+
+/* Memory for decoder state. zlib and liblzma allocate their state when
+ * a stream is initialised and free it when it ends, so every entry
+ * allocates the same few blocks. The arena hands them out from blocks
+ * it keeps between entries, which turns that into pointer bumps.
+ *
+ * Each thread has its own arena, see thread_arena(). Call begin_entry
+ * before setting up the decoder for an entry. All memory handed out
+ * before that is reused, so no decoder may be alive at that point. */
+class DecoderArena final {
+public:
+    DecoderArena() = default;
+    DecoderArena(const DecoderArena &) = delete;
+    DecoderArena& operator=(const DecoderArena &) = delete;
+
+    void begin_entry() noexcept;
+
+    /* Returns nullptr if the request would go over the limit, which the
+     * decoders report as running out of memory. */
+    void* allocate(size_t size) noexcept;
+    void deallocate(void *p) noexcept;
+
+    /* Maximum number of bytes live at the same time, 0 for no limit.
+     * See UnzipOptions::decoder_memory. */
+    void set_limit(uint64_t bytes) noexcept { limit = bytes; }
+
+    /* Back the blocks with 2 MB pages to save TLB misses on the decode
+     * buffers. Uses hugetlbfs pages if some are reserved and transparent
+     * huge pages otherwise. Changing this releases all blocks, so it
+     * must not be called while a decoder is alive. Ignored on Windows. */
+    void set_huge_pages(bool enabled) noexcept;
+
+    uint64_t memory_limit() const noexcept { return limit; }
+    bool huge_pages() const noexcept { return huge; }
+
+    /* Starts a new per-archive total, see ArenaScope. */
+    void begin_archive() noexcept { archive = AllocStats(); }
+    /* Everything decoded since the last begin_archive. Peak is the
+     * largest entry peak. */
+    const AllocStats& archive_stats() const noexcept { return archive; }
+
+    /* Hooks with the signatures zlib and liblzma expect. The opaque
+     * pointer must be the arena. */
+    static void* zalloc(void *opaque, unsigned items, unsigned size);
+    static void zfree(void *opaque, void *p);
+    static void* lzma_alloc(void *opaque, size_t nmemb, size_t size);
+    static void lzma_free(void *opaque, void *p);
+
+private:
+    struct BlockFree {
+        enum Kind {
+            HEAP,
+            ALIGNED,
+            MAPPED,
+        };
+        Kind kind;
+        size_t size;
+        void operator()(unsigned char *p) const noexcept;
+    };
+
+    struct Block {
+        std::unique_ptr<unsigned char[], BlockFree> data;
+        size_t size;
+        size_t used;
+    };
+
+    /* Returns an empty block on failure. Size may be rounded up. */
+    Block new_block(size_t size) noexcept;
+
+    std::vector<Block> blocks;
+    bool huge = false;
+    uint64_t live = 0;
+    uint64_t limit = 0;
+    AllocStats archive;
+};
+
+DecoderArena& thread_arena() noexcept;
+
+/* Applies the decoder settings of one extraction to the calling
+ * thread's arena and starts its per-archive total. When destroyed it
+ * adds the total to the statistics and puts back the settings that were
+ * there before, so a thread that unpacks several archives, or runs a
+ * benchmark, does not keep the options of the previous one. */
+class ArenaScope final {
+public:
+    ArenaScope(bool huge_pages, uint64_t limit) noexcept;
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope& operator=(const ArenaScope &) = delete;
+    ~ArenaScope();
+
+private:
+    DecoderArena &arena;
+    bool old_huge_pages;
+    uint64_t old_limit;
+};
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"batch.h"
+#include"zipfile.h"
+#include"mmapper.h"
+#include"workerpool.h"
+#include"stats.h"
+
+#include<atomic>
+#include<condition_variable>
+#include<memory>
+#include<mutex>
+#include<thread>
+
+namespace {
+
+// Archives open at the same time per worker thread.
+const constexpr size_t OPEN_PER_THREAD = 2;
+
+struct Archive {
+    std::string name;
+    std::string prefix;
+    std::unique_ptr<ZipFile> zf;
+    std::unique_ptr<MMapper> map;
+    std::atomic<size_t> remaining{0};
+};
+
+class Batch final {
+public:
+    Batch(const std::vector<BatchJob> &jobs, const BatchOptions &opts) :
+            results(opts.report, opts.out),
+            pool(opts.threads ? opts.threads : std::thread::hardware_concurrency()) {
+        archives.reserve(jobs.size());
+        for(const auto &j : jobs) {
+            std::unique_ptr<Archive> a(new Archive());
+            a->name = j.archive;
+            a->prefix = j.prefix;
+            archives.push_back(std::move(a));
+        }
+    }
+
+    UnzipSummary run() {
+        {
+            std::unique_lock<std::mutex> l(m);
+            const size_t initial = std::min(archives.size(), OPEN_PER_THREAD*pool.size());
+            for(next=0; next<initial; next++) {
+                const size_t i = next;
+                pool.submit([this, i]() { open(i); });
+            }
+            all_done.wait(l, [this]() { return finished == archives.size(); });
+        }
+        return results.finish();
+    }
+
+private:
+    void open(size_t i) noexcept {
+        auto &a = *archives[i];
+        try {
+            a.zf.reset(new ZipFile(a.name.c_str()));
+            if(a.zf->size() > 0) {
+                STATS_TIME(PHASE_OPEN);
+                a.map.reset(new MMapper(a.zf->map()));
+            }
+        } catch(const std::exception &e) {
+            STATS_COUNT(COUNT_FAILED, 1);
+            results.push(EntryResult{nullptr, false, e.what(), &a.name});
+            done(a);
+            return;
+        }
+        if(a.zf->size() == 0) {
+            done(a);
+            return;
+        }
+        a.remaining.store(a.zf->size());
+        for(size_t j=0; j<a.zf->size(); j++) {
+            pool.submit([this, i, j]() { unpack(i, j); });
+        }
+    }
+
+    void unpack(size_t i, size_t j) noexcept {
+        auto &a = *archives[i];
+        auto r = a.zf->unpack(j, a.prefix, *a.map);
+        STATS_COUNT(COUNT_ENTRIES, 1);
+        if(!r.success) {
+            STATS_COUNT(COUNT_FAILED, 1);
+        }
+        results.push(EntryResult{&a.zf->header(j), r.success, std::move(r.error), &a.prefix});
+        if(a.remaining.fetch_sub(1) == 1) {
+            done(a);
+        }
+    }
+
+    // The headers stay until the end since the results point to them.
+    void done(Archive &a) noexcept {
+        a.map.reset();
+        if(a.zf) {
+            a.zf->close();
+        }
+        std::lock_guard<std::mutex> l(m);
+        if(next < archives.size()) {
+            const size_t i = next++;
+            pool.submit([this, i]() { open(i); });
+        }
+        if(++finished == archives.size()) {
+            all_done.notify_one();
+        }
+    }
+
+    std::vector<std::unique_ptr<Archive>> archives;
+    std::mutex m;
+    std::condition_variable all_done;
+    size_t next = 0;
+    size_t finished = 0;
+    ResultChannel results;
+    // Last, so that the workers are gone before anything they use.
+    WorkerPool pool;
+};
+
+}
+
+UnzipSummary unzip_batch(const std::vector<BatchJob> &jobs, const BatchOptions &opts) {
+    Batch b(jobs, opts);
+    return b.run();
+}
+
+std::string batch_prefix(const std::string &archive) {
+    auto slash = archive.find_last_of("/\\");
+    std::string base = slash == std::string::npos ? archive : archive.substr(slash + 1);
+    auto dot = base.rfind('.');
+    if(dot != std::string::npos && dot > 0) {
+        base.erase(dot);
+    }
+    return base;
+}
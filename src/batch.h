@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include"report.h"
+
+#include<cstdio>
+#include<string>
+#include<vector>
+
+struct BatchJob {
+    std::string archive;
+    std::string prefix; // Output directory.
+};
+
+struct BatchOptions {
+    ReportMode report = REPORT_DEFAULT;
+    FILE *out = stdout;
+    unsigned threads = 0; // Zero for one per CPU.
+};
+
+/* Extracts many archives in one process. The entries of all archives
+ * run on one shared worker pool, so that small archives keep every
+ * thread busy and every thread reuses its decoder memory from one
+ * archive to the next. Only a few archives are open at a time.
+ *
+ * The results of all archives go through one channel with entry names
+ * prefixed by their output directory. An archive that can not be
+ * opened counts as one failed entry. */
+UnzipSummary unzip_batch(const std::vector<BatchJob> &jobs, const BatchOptions &opts);
+
+/* The output directory for an archive: its file name without the
+ * extension. */
+std::string batch_prefix(const std::string &archive);
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"blockcache.h"
+#include"stats.h"
+
+#include<cstdint>
+
+namespace {
+
+// The finalizer of MurmurHash3, so that neighbouring blocks spread out.
+uint64_t mix(uint64_t h) noexcept {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+}
+
+size_t BlockKeyHash::operator()(const BlockKey &k) const noexcept {
+    return (size_t)mix(mix(mix(reinterpret_cast<uintptr_t>(k.owner)) ^ k.entry) ^ k.block);
+}
+
+BlockCache::BlockCache(uint64_t capacity, size_t num_shards) {
+    if(num_shards == 0) {
+        num_shards = 1;
+    }
+    shard_capacity = capacity / num_shards;
+    for(size_t i=0; i<num_shards; i++) {
+        shards.emplace_back(new Shard());
+    }
+}
+
+BlockCache::Shard& BlockCache::shard_for(const BlockKey &key) noexcept {
+    // The low bits of the hash pick the bucket inside the shard, so use
+    // the high ones here.
+    const uint64_t h = BlockKeyHash()(key);
+    return *shards[(h >> 32) % shards.size()];
+}
+
+CachedBlock BlockCache::get(const BlockKey &key) {
+    Shard &s = shard_for(key);
+    std::lock_guard<std::mutex> l(s.m);
+    auto it = s.index.find(key);
+    if(it == s.index.end()) {
+        STATS_COUNT(COUNT_CACHE_MISSES, 1);
+        return CachedBlock();
+    }
+    STATS_COUNT(COUNT_CACHE_HITS, 1);
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    return it->second->second;
+}
+
+void BlockCache::put(const BlockKey &key, CachedBlock block) {
+    const uint64_t bytes = block->size();
+    if(bytes > shard_capacity) {
+        return;
+    }
+    Shard &s = shard_for(key);
+    std::lock_guard<std::mutex> l(s.m);
+    auto it = s.index.find(key);
+    if(it != s.index.end()) {
+        s.bytes -= it->second->second->size();
+        s.lru.erase(it->second);
+        s.index.erase(it);
+    }
+    evict(s, shard_capacity - bytes);
+    s.lru.emplace_front(key, std::move(block));
+    s.index.emplace(key, s.lru.begin());
+    s.bytes += bytes;
+}
+
+void BlockCache::evict(Shard &s, uint64_t limit) {
+    while(s.bytes > limit && !s.lru.empty()) {
+        s.bytes -= s.lru.back().second->size();
+        s.index.erase(s.lru.back().first);
+        s.lru.pop_back();
+    }
+}
+
+void BlockCache::forget(const void *owner) {
+    for(auto &s : shards) {
+        std::lock_guard<std::mutex> l(s->m);
+        for(auto it = s->lru.begin(); it != s->lru.end();) {
+            if(it->first.owner == owner) {
+                s->bytes -= it->second->size();
+                s->index.erase(it->first);
+                it = s->lru.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+uint64_t BlockCache::size() const {
+    uint64_t total = 0;
+    for(const auto &s : shards) {
+        std::lock_guard<std::mutex> l(s->m);
+        total += s->bytes;
+    }
+    return total;
+}
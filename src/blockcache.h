@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<cstdint>
+#include<list>
+#include<memory>
+#include<mutex>
+#include<unordered_map>
+#include<vector>
+
+/* Identifies one block of one archive's decompressed data. The owner
+ * tells archives apart, so one cache can be shared between them. */
+struct BlockKey {
+    const void *owner;
+    uint64_t entry;
+    uint64_t block;
+
+    bool operator==(const BlockKey &o) const noexcept {
+        return owner == o.owner && entry == o.entry && block == o.block;
+    }
+};
+
+struct BlockKeyHash {
+    size_t operator()(const BlockKey &k) const noexcept;
+};
+
+typedef std::shared_ptr<const std::vector<unsigned char>> CachedBlock;
+
+/* A size bounded LRU cache of decompressed blocks that any number of
+ * threads can share. Keys are spread over shards that each have their
+ * own lock and their own part of the capacity, so readers of different
+ * files rarely wait for each other. Blocks are reference counted, a
+ * reader can keep using one after it has been evicted. */
+class BlockCache final {
+public:
+    explicit BlockCache(uint64_t capacity, size_t num_shards=16);
+    BlockCache(const BlockCache &) = delete;
+    BlockCache& operator=(const BlockCache &) = delete;
+
+    /* Returns null on a miss. */
+    CachedBlock get(const BlockKey &key);
+
+    /* Replaces any block already under the key. A block larger than a
+     * shard's capacity is not cached. */
+    void put(const BlockKey &key, CachedBlock block);
+
+    /* Drops every block of the given owner. */
+    void forget(const void *owner);
+
+    uint64_t size() const;
+    uint64_t capacity() const noexcept { return shard_capacity*shards.size(); }
+
+private:
+    struct Shard {
+        typedef std::list<std::pair<BlockKey, CachedBlock>> LRU;
+        std::mutex m;
+        LRU lru; // Most recently used first.
+        std::unordered_map<BlockKey, LRU::iterator, BlockKeyHash> index;
+        uint64_t bytes = 0;
+    };
+
+    Shard& shard_for(const BlockKey &key) noexcept;
+    void evict(Shard &s, uint64_t limit);
+
+    uint64_t shard_capacity;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
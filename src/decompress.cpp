@@ -28,6 +28,10 @@
 #include"utils.h"
 #include"fileutils.h"
 #include"file.h"
+#include"stats.h"
+#include"trace.h"
+#include"arena.h"
+#include"taskcontrol.h"
 
 #include"portable_endian.h"
 #include<zlib.h>
@@ -52,15 +56,18 @@
 #include<cstdio>
 #include<cstdlib>
 
+#include<functional>
 #include<memory>
+#include<stdexcept>
 
 #define CHUNK 1024*1024
 
 namespace {
 
-uint32_t inflate_to_file(const unsigned char *data_start, uint64_t data_size, FILE *ofile);
-uint32_t lzma_to_file(const unsigned char *data_start, uint64_t data_size, FILE *ofile);
-uint32_t unstore_to_file(const unsigned char *data_start, uint64_t data_size, FILE *ofile);
+// Largest piece of input given to zlib at a time.
+const constexpr uint64_t MAX_INPUT_SLICE = 1024*1024*1024;
+
+}
 
 /* Decompress from file source to file dest until stream ends or EOF.
    inf() returns Z_OK on success, Z_MEM_ERROR if memory could not be
@@ -68,51 +75,82 @@ uint32_t unstore_to_file(const unsigned char *data_start, uint64_t data_size, FI
    invalid or incomplete, Z_VERSION_ERROR if the version of zlib.h and
    the version of the library linked do not match, or Z_ERRNO if there
    is an error reading or writing the files. */
-uint32_t inflate_to_file(const unsigned char *data_start,
-                         uint64_t data_size,
-                         FILE *ofile) {
+uint32_t inflate_to_file(InputRange &in,
+                         FILE *ofile,
+                         TaskControl *tc) {
     uint32_t crcvalue = crc32(0, Z_NULL, 0);
     int ret;
     unsigned have;
     z_stream strm;
-    const unsigned char *current = data_start;
-    std::unique_ptr<unsigned char[]> out(new unsigned char [CHUNK]);
+    DecoderArena &arena = thread_arena();
+    arena.begin_entry();
+    unsigned char *out = static_cast<unsigned char*>(arena.allocate(CHUNK));
+    if(!out) {
+        throw std::runtime_error("Out of decoder memory.");
+    }
 
     /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
+    strm.zalloc = DecoderArena::zalloc;
+    strm.zfree = DecoderArena::zfree;
+    strm.opaque = &arena;
     strm.avail_in = 0;
     strm.next_in = Z_NULL;
     ret = inflateInit2(&strm, -15);
+    if(ret == Z_MEM_ERROR) {
+        throw std::runtime_error("Out of decoder memory.");
+    }
     if (ret != Z_OK)
         throw std::runtime_error("Could not init zlib.");
     std::unique_ptr<z_stream, int (*)(z_stream_s*)> zcloser(&strm, inflateEnd);
 
     /* decompress until deflate stream ends or end of file */
-    strm.avail_in = data_size;
-    strm.next_in = const_cast<unsigned char*>(current); // zlib header is const-broken
+    STATS_COUNT(COUNT_BYTES_IN, in.size());
+    uint64_t consumed = 0;
     do {
-        if(strm.total_in >= data_size) {
-            break;
+        if(strm.avail_in == 0) {
+            // avail_in is 32 bits, so large entries go in slices.
+            const ZipSpan slice = in.next(MAX_INPUT_SLICE);
+            if(slice.size == 0) {
+                break;
+            }
+            strm.next_in = const_cast<unsigned char*>(slice.data); // zlib header is const-broken
+            strm.avail_in = (uInt)slice.size;
         }
 
         /* run inflate() on input until output buffer not full */
         do {
             strm.avail_out = CHUNK;
-            strm.next_out = out.get();
-            ret = inflate(&strm, Z_NO_FLUSH);
+            strm.next_out = out;
+            {
+                STATS_TIME(PHASE_DECODE);
+                ret = inflate(&strm, Z_NO_FLUSH);
+            }
             assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
             switch (ret) {
+            case Z_MEM_ERROR:
+                throw std::runtime_error("Out of decoder memory.");
             case Z_NEED_DICT:
             case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                throw std::runtime_error(strm.msg);
+                throw std::runtime_error(strm.msg ? strm.msg : "Decompression failed.");
             }
             have = CHUNK - strm.avail_out;
-            crcvalue = crc32(crcvalue, out.get(), have);
-            if (fwrite(out.get(), 1, have, ofile) != have || ferror(ofile)) {
-                throw_system("Could not write to file:");
+            {
+                STATS_TIME(PHASE_CRC);
+                crcvalue = crc32(crcvalue, out, have);
+            }
+            {
+                STATS_TIME(PHASE_WRITE);
+                STATS_COUNT(COUNT_FWRITE, 1);
+                STATS_COUNT(COUNT_BYTES_OUT, have);
+                if (fwrite(out, 1, have, ofile) != have || ferror(ofile)) {
+                    throw_system("Could not write to file:");
+                }
+            }
+            if(tc) {
+                const uint64_t used = in.position() - strm.avail_in;
+                tc->add_bytes(used - consumed, have);
+                consumed = used;
+                tc->check();
             }
         } while (strm.avail_out == 0);
         /* done when inflate() says it's done */
@@ -126,76 +164,194 @@ uint32_t inflate_to_file(const unsigned char *data_start,
 }
 
 #ifdef _WIN32
-uint32_t lzma_to_file(const unsigned char *data_start, uint64_t data_size, FILE *ofile) {
+uint32_t lzma_to_file(InputRange &in, FILE *ofile, TaskControl *tc) {
     throw std::runtime_error("LZMA not supported on Windows.");
 }
 
 #else
-uint32_t lzma_to_file(const unsigned char *data_start,
-                      uint64_t data_size,
-                      FILE *ofile) {
+uint32_t lzma_to_file(InputRange &in,
+                      FILE *ofile,
+                      TaskControl *tc) {
     uint32_t crcvalue = crc32(0, Z_NULL, 0);
-    std::unique_ptr<unsigned char[]> out(new unsigned char [CHUNK]);
+    DecoderArena &arena = thread_arena();
+    arena.begin_entry();
+    unsigned char *out = static_cast<unsigned char*>(arena.allocate(CHUNK));
+    if(!out) {
+        throw std::runtime_error("Out of decoder memory.");
+    }
+    const lzma_allocator allocator = {DecoderArena::lzma_alloc, DecoderArena::lzma_free, &arena};
     lzma_stream strm = LZMA_STREAM_INIT;
+    strm.allocator = &allocator;
     lzma_filter filter[2];
     unsigned int have;
 
-    size_t offset = 2;
-    uint16_t properties_size = le16toh(*reinterpret_cast<const uint16_t*>(data_start + offset));
-    offset+=2;
+    // Two bytes of version and the size of the properties. The header
+    // may be split between two pieces of input, so it is copied out.
+    unsigned char header[4];
+    unsigned char properties[16]; // LZMA1 has five.
+    in.read(header, sizeof(header));
+    uint16_t properties_size = le16toh(*reinterpret_cast<const uint16_t*>(header + 2));
+    if(properties_size > sizeof(properties)) {
+        throw std::runtime_error("Could not decode LZMA properties.");
+    }
+    in.read(properties, properties_size);
     filter[0].id = LZMA_FILTER_LZMA1;
     filter[1].id = LZMA_VLI_UNKNOWN;
-    lzma_ret ret = lzma_properties_decode(&filter[0], nullptr, data_start + offset, properties_size);
-    offset += properties_size;
+    lzma_ret ret = lzma_properties_decode(&filter[0], &allocator, properties, properties_size);
     if(ret != LZMA_OK) {
         throw std::runtime_error("Could not decode LZMA properties.");
     }
     ret = lzma_raw_decoder(&strm, &filter[0]);
-    free(filter[0].options);
+    arena.deallocate(filter[0].options);
+    if(ret == LZMA_MEM_ERROR) {
+        throw std::runtime_error("Out of decoder memory.");
+    }
     if(ret != LZMA_OK) {
         throw std::runtime_error("Could not initialize LZMA decoder.");
     }
     std::unique_ptr<lzma_stream, void(*)(lzma_stream*)> lcloser(&strm, lzma_end);
 
-    const unsigned char *current = data_start + offset;
-    strm.avail_in = (size_t)(data_size - offset);
-    strm.next_in = current;
+    STATS_COUNT(COUNT_BYTES_IN, in.size());
+    uint64_t consumed = 0;
     /* decompress until data ends */
     do {
-        if (strm.total_in == data_size - offset)
-            break;
+        if(strm.avail_in == 0) {
+            const ZipSpan slice = in.next(MAX_INPUT_SLICE);
+            if(slice.size == 0) {
+                break;
+            }
+            strm.next_in = slice.data;
+            strm.avail_in = (size_t)slice.size;
+        }
 
         do {
             strm.avail_out = CHUNK;
-            strm.next_out = out.get();
-            ret = lzma_code(&strm, LZMA_RUN);
+            strm.next_out = out;
+            {
+                STATS_TIME(PHASE_DECODE);
+                ret = lzma_code(&strm, LZMA_RUN);
+            }
+            if(ret == LZMA_MEM_ERROR) {
+                throw std::runtime_error("Out of decoder memory.");
+            }
             if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
                 throw std::runtime_error("Decompression failed.");
             }
             have = CHUNK - strm.avail_out;
-            crcvalue = crc32(crcvalue, out.get(), have);
-            if (fwrite(out.get(), 1, have, ofile) != have || ferror(ofile)) {
-                throw_system("Could not write to file:");
+            {
+                STATS_TIME(PHASE_CRC);
+                crcvalue = crc32(crcvalue, out, have);
+            }
+            {
+                STATS_TIME(PHASE_WRITE);
+                STATS_COUNT(COUNT_FWRITE, 1);
+                STATS_COUNT(COUNT_BYTES_OUT, have);
+                if (fwrite(out, 1, have, ofile) != have || ferror(ofile)) {
+                    throw_system("Could not write to file:");
+                }
+            }
+            if(tc) {
+                tc->add_bytes(strm.total_in - consumed, have);
+                consumed = strm.total_in;
+                tc->check();
             }
         } while (strm.avail_out == 0);
-    } while (true);
+    } while (ret != LZMA_STREAM_END);
     return crcvalue;
 }
 #endif
 
-uint32_t unstore_to_file(const unsigned char *data_start,
-                         uint64_t data_size,
-                         FILE *ofile) {
-    auto bytes_written = fwrite(data_start, 1, data_size, ofile);
-    if(bytes_written != data_size) {
-        throw_system("Could not write file fully:");
+uint32_t unstore_to_file(InputRange &in,
+                         FILE *ofile,
+                         TaskControl *tc) {
+    STATS_COUNT(COUNT_BYTES_IN, in.size());
+    // In chunks so that cancellation is noticed and progress advances.
+    uint32_t crcvalue = crc32(0, Z_NULL, 0);
+    while(true) {
+        const ZipSpan piece = in.next(CHUNK);
+        if(piece.size == 0) {
+            break;
+        }
+        const size_t have = (size_t)piece.size;
+        {
+            STATS_TIME(PHASE_WRITE);
+            STATS_COUNT(COUNT_FWRITE, 1);
+            if(fwrite(piece.data, 1, have, ofile) != have) {
+                throw_system("Could not write file fully:");
+            }
+            STATS_COUNT(COUNT_BYTES_OUT, have);
+        }
+        {
+            STATS_TIME(PHASE_CRC);
+            crcvalue = crc32(crcvalue, piece.data, have);
+        }
+        if(tc) {
+            tc->add_bytes(have, have);
+            tc->check();
+        }
+    }
+    return crcvalue;
+}
+
+void write_new_file(const std::string &outname, bool drop_cache, const std::function<void(FILE*)> &write) {
+    if(exists_on_fs(outname)) {
+        throw std::runtime_error("Already exists, will not overwrite.");
+    }
+    {
+        STATS_TIME(PHASE_MKDIR);
+        create_dirs_for_file(outname);
+    }
+    std::string extraction_name = outname + "$ZIPTMP";
+    STATS_COUNT(COUNT_OPEN, 1);
+    File ofile(extraction_name.c_str(), "w+b");
+    try {
+        write(ofile.get());
+    } catch(...) {
+        // Also when cancelled, so that no partial files are left behind.
+        STATS_COUNT(COUNT_UNLINK, 1);
+        unlink(extraction_name.c_str());
+        throw;
+    }
+    {
+        // Closing flushes the last buffered block.
+        STATS_TIME(PHASE_WRITE);
+        if(drop_cache) {
+            ofile.flush();
+            write_back_and_drop(ofile.fileno());
+        }
+        ofile.close();
+    }
+    STATS_TIME(PHASE_RENAME);
+    STATS_COUNT(COUNT_RENAME, 1);
+    if(rename(extraction_name.c_str(), outname.c_str()) != 0) {
+        STATS_COUNT(COUNT_UNLINK, 1);
+        unlink(extraction_name.c_str());
+        throw_system("Could not rename tmp file to target file:");
+    }
+}
+
+std::string read_link_target(InputRange &data) {
+    std::string target((size_t)data.size(), '\0');
+    data.read(reinterpret_cast<unsigned char*>(&target[0]), data.size());
+    return target;
+}
+
+std::string entry_path(const std::string &prefix, const std::string &fname) {
+    if(prefix.empty()) {
+        return fname;
     }
-    return CRC32(data_start, data_size);
+    if(prefix.back() != '/') {
+        return prefix + '/' + fname;
+    }
+    return prefix + fname;
 }
 
+namespace {
+
 void create_symlink(const unsigned char *data_start, uint64_t data_size, const std::string &outname) {
 #ifndef _WIN32
     std::string symlink_target(data_start, data_start + data_size);
+    STATS_COUNT(COUNT_SYMLINK, 1);
     if(symlink(symlink_target.c_str(), outname.c_str()) != 0) {
         throw_system("Symlink creation failed:");
     }
@@ -204,9 +360,10 @@ void create_symlink(const unsigned char *data_start, uint64_t data_size, const s
 
 void create_file(const localheader &lh,
                  const centralheader &ch,
-                 const unsigned char *data_start,
-                 uint64_t data_size,
-                 const std::string &outname) {
+                 InputRange &data,
+                 const std::string &outname,
+                 bool drop_cache,
+                 TaskControl *tc) {
     decltype(unstore_to_file) *f;
     if(ch.compression_method == ZIP_NO_COMPRESSION) {
         f = unstore_to_file;
@@ -217,30 +374,13 @@ void create_file(const localheader &lh,
     } else {
         throw std::runtime_error("Unsupported compression format.");
     }
-    if(exists_on_fs(outname)) {
-        throw std::runtime_error("Already exists, will not overwrite.");
-    }
-    create_dirs_for_file(outname);
-    std::string extraction_name = outname + "$ZIPTMP";
-    File ofile(extraction_name.c_str(), "w+b");
-    uint32_t crc32;
-    try {
-        crc32 = (*f)(data_start, data_size, ofile.get());
-    } catch(...) {
-        unlink(extraction_name.c_str());
-        throw;
-    }
-
-    uint32_t original = lh.gp_bitflag&(1<<2) ? ch.crc32 : lh.crc32;
-    if(crc32 != original) {
-        unlink(extraction_name.c_str());
-        throw std::runtime_error("CRC32 checksum is invalid.");
-    }
-    ofile.close();
-    if(rename(extraction_name.c_str(), outname.c_str()) != 0) {
-        unlink(extraction_name.c_str());
-        throw_system("Could not rename tmp file to target file:");
-    }
+    write_new_file(outname, drop_cache, [&](FILE *ofile) {
+        const uint32_t crc32 = (*f)(data, ofile, tc);
+        const uint32_t original = lh.gp_bitflag&FLAG_DATA_DESCRIPTOR ? ch.crc32 : lh.crc32;
+        if(crc32 != original) {
+            throw std::runtime_error("CRC32 checksum is invalid.");
+        }
+    });
 }
 
 void create_device(const localheader &lh, const std::string &outname) {
@@ -254,9 +394,13 @@ void create_device(const localheader &lh, const std::string &outname) {
         msg += ".";
         throw std::runtime_error(msg);
     }
-    create_dirs_for_file(outname);
+    {
+        STATS_TIME(PHASE_MKDIR);
+        create_dirs_for_file(outname);
+    }
     uint32_t major_id = le32toh(*reinterpret_cast<const uint32_t*>(&d[0]));
     uint32_t minor_id = le32toh(*reinterpret_cast<const uint32_t*>(&d[4]));
+    STATS_COUNT(COUNT_MKNOD, 1);
     if(mknod(outname.c_str(), S_IFCHR, makedev(major_id, minor_id)) != 0) {
         std::string msg("Could not create device node, major ");
         msg += std::to_string(major_id);
@@ -268,6 +412,8 @@ void create_device(const localheader &lh, const std::string &outname) {
 #endif
 }
 
+}
+
 filetype detect_filetype(const localheader &lh, const centralheader &ch) {
 #ifndef _WIN32
     if(ch.version_made_by>>8 == MADE_BY_UNIX) {
@@ -295,17 +441,28 @@ filetype detect_filetype(const localheader &lh, const centralheader &ch) {
     return FILE_ENTRY;
 }
 
+namespace {
+
 filetype do_unpack(const localheader &lh,
                const centralheader &ch,
-               const unsigned char *data_start,
-               uint64_t data_size,
-               const std::string &outname) {
+               InputRange &data,
+               const std::string &outname,
+               bool drop_cache,
+               TaskControl *tc) {
     auto ftype = detect_filetype(lh, ch);
     switch(ftype) {
-    case DIRECTORY_ENTRY : mkdirp(outname); break;
-    case SYMLINK_ENTRY : create_symlink(data_start, data_size, outname); break;
+    case DIRECTORY_ENTRY : {
+        STATS_TIME(PHASE_MKDIR);
+        mkdirp(outname);
+        break;
+    }
+    case SYMLINK_ENTRY : {
+        const std::string target = read_link_target(data);
+        create_symlink(reinterpret_cast<const unsigned char*>(target.data()), target.size(), outname);
+        break;
+    }
     case CHARDEV_ENTRY : create_device(lh, outname); break;
-    case FILE_ENTRY : create_file(lh, ch, data_start, data_size, outname); break;
+    case FILE_ENTRY : create_file(lh, ch, data, outname, drop_cache, tc); break;
     default : throw std::runtime_error("Unknown file type.");
     }
     return ftype;
@@ -315,6 +472,8 @@ void set_unix_permissions(const localheader &lh, const centralheader &ch, const
 #ifndef _WIN32
     // This part of the zip spec is poorly documented. :(
     // https://trac.edgewall.org/attachment/ticket/8919/ZipDownload.patch
+    STATS_TIME(PHASE_METADATA);
+    STATS_COUNT(COUNT_CHMOD, 1);
     if(chmod(fname.c_str(), (ch.external_file_attributes >> 16)&0777) != 0) {
         throw_system("Could not change ownership: ");
     }
@@ -326,8 +485,10 @@ void set_unix_permissions(const localheader &lh, const centralheader &ch, const
         struct utimbuf tb;
         tb.actime = lh.unix.atime;
         tb.modtime = lh.unix.mtime;
+        STATS_COUNT(COUNT_UTIME, 1);
         utime(fname.c_str(), &tb);
     }
+    STATS_COUNT(COUNT_CHOWN, 1);
     chown(fname.c_str(), lh.unix.uid, lh.unix.gid);
 #endif
 }
@@ -337,26 +498,87 @@ void set_unix_permissions(const localheader &lh, const centralheader &ch, const
 UnpackResult unpack_entry(const std::string &prefix, const localheader &lh,
         const centralheader &ch,
         const unsigned char *data_start,
-        uint64_t data_size) {
+        uint64_t data_size,
+        bool drop_cache,
+        TaskControl *tc) {
+    InputRange data(data_start, data_size);
+    return unpack_entry(prefix, lh, ch, data, drop_cache, tc);
+}
+
+UnpackResult unpack_entry(const std::string &prefix, const localheader &lh,
+        const centralheader &ch,
+        InputRange &data,
+        bool drop_cache,
+        TaskControl *tc) {
+#ifdef ZIP_STATS
+    TraceSpan span("unpack_entry");
+    if(span.recording()) {
+        TraceArgs args;
+        args.entry = lh.fname;
+        args.method = ch.compression_method;
+        args.compressed_size = lh.compressed_size;
+        args.uncompressed_size = lh.uncompressed_size;
+        span.set_args(std::move(args));
+    }
+#endif
     try {
-        std::string ofname;
-        if(prefix.empty()) {
-            ofname = lh.fname;
-        } else {
-            if(prefix.back() != '/') {
-                ofname = prefix + '/' + lh.fname;
-            } else {
-                ofname = prefix + lh.fname;
+        const std::string ofname = entry_path(prefix, lh.fname);
+        auto ftype = do_unpack(lh, ch, data, ofname, drop_cache, tc);
+        if(ch.version_made_by>>8 == MADE_BY_UNIX && ftype != SYMLINK_ENTRY) {
+            set_unix_permissions(lh, ch, ofname);
+        }
+        return UnpackResult{true, std::string()};
+    } catch(const std::exception &e) {
+        return UnpackResult{false, e.what()};
+    } catch(...) {
+    }
+    return UnpackResult{false, "unknown error"};
+}
+
+UnpackResult finish_streamed_entry(const std::string &prefix, const localheader &lh, const centralheader &ch) {
+    try {
+        const std::string ofname = entry_path(prefix, lh.fname);
+        auto ftype = detect_filetype(lh, ch);
+        switch(ftype) {
+        case FILE_ENTRY:
+            break;
+        case DIRECTORY_ENTRY:
+            if(!is_dir(ofname)) {
+                STATS_COUNT(COUNT_UNLINK, 1);
+                unlink(ofname.c_str());
+                STATS_TIME(PHASE_MKDIR);
+                mkdirp(ofname);
+            }
+            break;
+        case SYMLINK_ENTRY: {
+            // The target was written out as the file's contents.
+            std::string target;
+            {
+                File f(ofname, "rb");
+                target = f.read(f.size());
             }
+            STATS_COUNT(COUNT_UNLINK, 1);
+            unlink(ofname.c_str());
+            create_symlink(reinterpret_cast<const unsigned char*>(target.data()), target.size(), ofname);
+            break;
+        }
+        case CHARDEV_ENTRY:
+            STATS_COUNT(COUNT_UNLINK, 1);
+            unlink(ofname.c_str());
+            create_device(lh, ofname);
+            break;
+        default:
+            STATS_COUNT(COUNT_UNLINK, 1);
+            unlink(ofname.c_str());
+            throw std::runtime_error("Unknown file type.");
         }
-        auto ftype = do_unpack(lh, ch, data_start, data_size, ofname);
         if(ch.version_made_by>>8 == MADE_BY_UNIX && ftype != SYMLINK_ENTRY) {
             set_unix_permissions(lh, ch, ofname);
         }
-        return UnpackResult{true, "OK: " + lh.fname};
+        return UnpackResult{true, std::string()};
     } catch(const std::exception &e) {
-        return UnpackResult{false, "FAIL: " + lh.fname + "\n" + e.what()};
+        return UnpackResult{false, e.what()};
     } catch(...) {
     }
-    return UnpackResult{false, "FAIL: " + lh.fname + "  unknown error"};
+    return UnpackResult{false, "unknown error"};
 }
@@ -18,17 +18,57 @@
 #pragma once
 
 #include"zipdefs.h"
+#include"inputsource.h"
 #include<string>
+#include<cstdio>
+#include<functional>
 
 class TaskControl;
 
 struct UnpackResult {
     bool success;
-    std::string msg;
+    std::string error; // Only set on failure.
 };
 
 UnpackResult unpack_entry(const std::string &prefix,
         const localheader &lh,
         const centralheader &ch,
         const unsigned char *data_start,
-        uint64_t data_size);
+        uint64_t data_size,
+        bool drop_cache=false,
+        TaskControl *tc=nullptr);
+UnpackResult unpack_entry(const std::string &prefix,
+        const localheader &lh,
+        const centralheader &ch,
+        InputRange &data,
+        bool drop_cache=false,
+        TaskControl *tc=nullptr);
+
+/* For entries whose data was written before their central directory
+ * record was seen, see streamunzip.h. The data is in the output file
+ * already. This turns it into the kind of entry the central header says
+ * it is, such as a symbolic link, and sets its permissions. */
+UnpackResult finish_streamed_entry(const std::string &prefix, const localheader &lh, const centralheader &ch);
+
+/* Where an entry is extracted to. */
+std::string entry_path(const std::string &prefix, const std::string &fname);
+
+/* Creates a regular file through a temporary name that is renamed into
+ * place once write returns. Fails if the file exists already. If write
+ * throws the temporary file is removed. */
+void write_new_file(const std::string &outname, bool drop_cache, const std::function<void(FILE*)> &write);
+
+/* A symbolic link's target, which is its stored contents. */
+std::string read_link_target(InputRange &data);
+
+/* Throws if the entry is of a kind that is not supported. */
+filetype detect_filetype(const localheader &lh, const centralheader &ch);
+
+/* Decode one entry's data into an open file. These return the CRC32 of
+ * the decoded data and throw on failure. They are exposed mostly so
+ * that the benchmarks can time them in isolation. If tc is set, progress
+ * is added to it and cancellation is checked after every chunk.
+ */
+uint32_t inflate_to_file(InputRange &in, FILE *ofile, TaskControl *tc);
+uint32_t lzma_to_file(InputRange &in, FILE *ofile, TaskControl *tc);
+uint32_t unstore_to_file(InputRange &in, FILE *ofile, TaskControl *tc);
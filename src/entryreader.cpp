@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"entryreader.h"
+#include"zipdefs.h"
+#include"stats.h"
+
+#include"portable_endian.h"
+#include<zlib.h>
+#ifndef _WIN32
+#include<lzma.h>
+#endif
+
+#include<algorithm>
+#include<cstring>
+#include<stdexcept>
+
+/* Decodes one entry front to back, a piece at a time. Unlike the
+ * decoders in decompress.cpp these outlive a single call, so they use
+ * the default allocators instead of the thread's arena. */
+class StreamDecoder {
+public:
+    StreamDecoder(uint64_t uncompressed_size, uint32_t crc) noexcept :
+        expected_size(uncompressed_size), expected_crc(crc), crcvalue(crc32(0, Z_NULL, 0)) {}
+    virtual ~StreamDecoder() = default;
+
+    uint64_t position() const noexcept { return pos; }
+
+    /* Fills out with exactly size bytes or throws. */
+    void read(unsigned char *out, size_t size) {
+        size_t done = 0;
+        while(done < size) {
+            STATS_TIME(PHASE_DECODE);
+            const size_t n = decode(out + done, size - done);
+            if(n == 0) {
+                throw std::runtime_error("Entry data ends before its uncompressed size.");
+            }
+            done += n;
+        }
+        consume(out, size);
+    }
+
+    /* Returns the next size bytes where they are in the archive, or
+     * nullptr if the data is compressed and has to be read instead. */
+    const unsigned char* read_in_place(size_t size) {
+        const unsigned char *p = in_place(size);
+        if(p) {
+            consume(p, size);
+        }
+        return p;
+    }
+
+    /* Checks that the data ends with the contents and that the CRC
+     * matches. For an empty entry nothing has been read before this, so
+     * this is the only check it gets. */
+    void finish() {
+        unsigned char extra;
+        if(decode(&extra, 1) != 0) {
+            throw std::runtime_error("Entry data is longer than its uncompressed size.");
+        }
+        if(!stream_ended()) {
+            throw std::runtime_error("Entry data ends before its compressed stream does.");
+        }
+        if(crcvalue != expected_crc) {
+            throw std::runtime_error("CRC32 checksum is invalid.");
+        }
+    }
+
+protected:
+    /* Returns the number of bytes produced, 0 at the end of the stream. */
+    virtual size_t decode(unsigned char *out, size_t size) = 0;
+    virtual const unsigned char* in_place(size_t) { return nullptr; }
+    /* False if the format marks its end and that has not been seen. */
+    virtual bool stream_ended() const noexcept { return true; }
+
+private:
+    void consume(const unsigned char *out, size_t size) {
+        crcvalue = crc32_range(crcvalue, out, size);
+        pos += size;
+        STATS_COUNT(COUNT_BYTES_OUT, size);
+        if(pos == expected_size && crcvalue != expected_crc) {
+            throw std::runtime_error("CRC32 checksum is invalid.");
+        }
+    }
+
+    static uint32_t crc32_range(uint32_t crc, const unsigned char *buf, size_t size) noexcept {
+        STATS_TIME(PHASE_CRC);
+        while(size > 0) {
+            const uInt n = (uInt)std::min<size_t>(size, 1024*1024*1024);
+            crc = crc32(crc, buf, n);
+            buf += n;
+            size -= n;
+        }
+        return crc;
+    }
+
+    uint64_t pos = 0;
+    uint64_t expected_size;
+    uint32_t expected_crc;
+    uint32_t crcvalue;
+};
+
+namespace {
+
+class StoredDecoder final : public StreamDecoder {
+public:
+    StoredDecoder(const unsigned char *data, uint64_t size, uint32_t crc) noexcept :
+        StreamDecoder(size, crc), next(data), remaining(size) {
+        STATS_COUNT(COUNT_BYTES_IN, size);
+    }
+
+protected:
+    size_t decode(unsigned char *out, size_t size) override {
+        const size_t n = (size_t)std::min<uint64_t>(size, remaining);
+        memcpy(out, next, n);
+        next += n;
+        remaining -= n;
+        return n;
+    }
+
+    const unsigned char* in_place(size_t size) override {
+        if(size > remaining) {
+            throw std::runtime_error("Entry data ends before its uncompressed size.");
+        }
+        const unsigned char *p = next;
+        next += size;
+        remaining -= size;
+        return p;
+    }
+
+private:
+    const unsigned char *next;
+    uint64_t remaining;
+};
+
+// Zlib counts input in 32 bits, so it is fed this much at a time.
+const constexpr uint64_t MAX_FEED = 1024*1024*1024;
+
+class InflateDecoder final : public StreamDecoder {
+public:
+    InflateDecoder(const unsigned char *data, uint64_t data_size, uint64_t uncompressed_size, uint32_t crc) :
+        StreamDecoder(uncompressed_size, crc), next(data), remaining(data_size) {
+        memset(&strm, 0, sizeof(strm));
+        if(inflateInit2(&strm, -15) != Z_OK) {
+            throw std::runtime_error("Could not init zlib.");
+        }
+        STATS_COUNT(COUNT_BYTES_IN, data_size);
+    }
+
+    ~InflateDecoder() {
+        inflateEnd(&strm);
+    }
+
+protected:
+    size_t decode(unsigned char *out, size_t size) override {
+        if(finished) {
+            return 0;
+        }
+        strm.next_out = out;
+        strm.avail_out = (uInt)std::min<uint64_t>(size, MAX_FEED);
+        while(strm.avail_out > 0) {
+            if(strm.avail_in == 0 && remaining > 0) {
+                const uInt n = (uInt)std::min(remaining, MAX_FEED);
+                strm.next_in = const_cast<unsigned char*>(next); // zlib header is const-broken
+                strm.avail_in = n;
+                next += n;
+                remaining -= n;
+            }
+            // Inflate may still hold output after it has taken all the
+            // input, so it is called until it says it can do no more.
+            const int ret = inflate(&strm, Z_NO_FLUSH);
+            if(ret == Z_STREAM_END) {
+                finished = true;
+                break;
+            }
+            if(ret == Z_BUF_ERROR) {
+                // No progress was possible.
+                if(strm.avail_in == 0 && remaining == 0) {
+                    break;
+                }
+            } else if(ret != Z_OK) {
+                throw std::runtime_error(strm.msg ? strm.msg : "Decompression failed.");
+            }
+        }
+        return (size_t)(strm.next_out - out);
+    }
+
+    bool stream_ended() const noexcept override { return finished; }
+
+private:
+    z_stream strm;
+    const unsigned char *next;
+    uint64_t remaining;
+    bool finished = false;
+};
+
+#ifndef _WIN32
+class LzmaDecoder final : public StreamDecoder {
+public:
+    LzmaDecoder(const unsigned char *data, uint64_t data_size, uint64_t uncompressed_size, uint32_t crc) :
+        StreamDecoder(uncompressed_size, crc) {
+        // Two bytes of version, the size of the properties and the properties.
+        if(data_size < 4) {
+            throw std::runtime_error("LZMA header is truncated.");
+        }
+        const uint16_t properties_size = le16toh(*reinterpret_cast<const uint16_t*>(data + 2));
+        if(data_size < 4u + properties_size) {
+            throw std::runtime_error("LZMA header is truncated.");
+        }
+        lzma_filter filter[2];
+        filter[0].id = LZMA_FILTER_LZMA1;
+        filter[1].id = LZMA_VLI_UNKNOWN;
+        if(lzma_properties_decode(&filter[0], nullptr, data + 4, properties_size) != LZMA_OK) {
+            throw std::runtime_error("Could not decode LZMA properties.");
+        }
+        const lzma_ret ret = lzma_raw_decoder(&strm, &filter[0]);
+        free(filter[0].options);
+        if(ret != LZMA_OK) {
+            throw std::runtime_error("Could not initialize LZMA decoder.");
+        }
+        strm.next_in = data + 4 + properties_size;
+        strm.avail_in = (size_t)(data_size - 4 - properties_size);
+        STATS_COUNT(COUNT_BYTES_IN, data_size);
+    }
+
+    ~LzmaDecoder() {
+        lzma_end(&strm);
+    }
+
+protected:
+    size_t decode(unsigned char *out, size_t size) override {
+        if(finished) {
+            return 0;
+        }
+        strm.next_out = out;
+        strm.avail_out = size;
+        // As with inflate, output may still be pending after the last
+        // input has been taken.
+        while(strm.avail_out > 0) {
+            const size_t avail_out = strm.avail_out;
+            const lzma_ret ret = lzma_code(&strm, LZMA_RUN);
+            if(ret == LZMA_STREAM_END) {
+                finished = true;
+                break;
+            }
+            if(ret == LZMA_BUF_ERROR) {
+                break;
+            }
+            if(ret != LZMA_OK) {
+                throw std::runtime_error("Decompression failed.");
+            }
+            if(strm.avail_in == 0 && strm.avail_out == avail_out) {
+                break;
+            }
+        }
+        return size - strm.avail_out;
+    }
+
+private:
+    lzma_stream strm = LZMA_STREAM_INIT;
+    bool finished = false;
+};
+#endif
+
+}
+
+EntryReader::EntryReader(const RawEntry &e, size_t chunk_size) : entry(e), chunk_size(std::max<size_t>(chunk_size, 1)) {
+    switch(e.compression) {
+    case ZIP_NO_COMPRESSION:
+        if(e.data.size != e.uncompressed_size) {
+            throw std::runtime_error("Stored entry has different compressed and uncompressed sizes.");
+        }
+        decoder.reset(new StoredDecoder(e.data.data, e.data.size, e.crc32));
+        break;
+    case ZIP_DEFLATE:
+        decoder.reset(new InflateDecoder(e.data.data, e.data.size, e.uncompressed_size, e.crc32));
+        break;
+    case ZIP_LZMA:
+#ifdef _WIN32
+        throw std::runtime_error("LZMA not supported on Windows.");
+#else
+        decoder.reset(new LzmaDecoder(e.data.data, e.data.size, e.uncompressed_size, e.crc32));
+        break;
+#endif
+    default:
+        throw std::runtime_error("Unsupported compression format.");
+    }
+}
+
+EntryReader::EntryReader(EntryReader &&other) noexcept = default;
+EntryReader& EntryReader::operator=(EntryReader &&other) noexcept = default;
+EntryReader::~EntryReader() = default;
+
+uint64_t EntryReader::position() const noexcept {
+    return decoder->position();
+}
+
+bool EntryReader::next(ZipSpan &chunk) {
+    const uint64_t pos = decoder->position();
+    if(pos == entry.uncompressed_size) {
+        if(!verified) {
+            decoder->finish();
+            verified = true;
+        }
+        return false;
+    }
+    const size_t n = (size_t)std::min<uint64_t>(chunk_size, entry.uncompressed_size - pos);
+    if(const unsigned char *p = decoder->read_in_place(n)) {
+        chunk = ZipSpan{p, n};
+        return true;
+    }
+    if(buf.empty()) {
+        buf.resize(chunk_size);
+    }
+    decoder->read(buf.data(), n);
+    chunk = ZipSpan{buf.data(), n};
+    return true;
+}
+
+void EntryReader::read(unsigned char *out, size_t size) {
+    if(size > entry.uncompressed_size - decoder->position()) {
+        throw std::runtime_error("Read past the end of the entry.");
+    }
+    decoder->read(out, size);
+}
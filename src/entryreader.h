@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<cstddef>
+#include<cstdint>
+#include<memory>
+#include<vector>
+
+/* A piece of the memory mapped archive. Valid as long as the mapping. */
+struct ZipSpan {
+    const unsigned char *data;
+    uint64_t size;
+};
+
+/* An entry's data exactly as it is stored in the archive, along with
+ * what is needed to check or decode it elsewhere. */
+struct RawEntry {
+    uint16_t compression;
+    uint32_t crc32;
+    uint64_t uncompressed_size;
+    ZipSpan data;
+};
+
+class StreamDecoder;
+
+/* Decodes one entry front to back a chunk at a time, for hashing,
+ * parsing or forwarding its contents without writing them anywhere.
+ * The decoder state is kept between calls, so a reader uses the same
+ * amount of memory however big the entry is: the decoder's own state
+ * and one chunk. Readers are independent of each other and thousands
+ * can be open at once, but each one may only be used by one thread at
+ * a time. The archive must stay mapped while the reader is in use.
+ *
+ * The CRC is checked when the last byte has been produced, the call
+ * that produces it throws if it does not match. Before next first
+ * returns false it checks that the data ends there as well, which is
+ * how an empty entry gets checked. */
+class EntryReader final {
+public:
+    static const constexpr size_t DEFAULT_CHUNK_SIZE = 64*1024;
+
+    /* Throws if the compression method is not supported. */
+    explicit EntryReader(const RawEntry &e, size_t chunk_size=DEFAULT_CHUNK_SIZE);
+    EntryReader(EntryReader &&other) noexcept;
+    EntryReader& operator=(EntryReader &&other) noexcept;
+    ~EntryReader();
+
+    uint64_t size() const noexcept { return entry.uncompressed_size; }
+    /* Number of bytes produced so far. */
+    uint64_t position() const noexcept;
+
+    /* Points chunk at the next at most chunk_size bytes of the contents
+     * and returns true, or returns false once everything has been read.
+     * The chunk stays valid until the next call. Stored entries are
+     * returned straight from the archive without a copy. */
+    bool next(ZipSpan &chunk);
+
+    /* Fills out with exactly size bytes or throws. */
+    void read(unsigned char *out, size_t size);
+
+private:
+    RawEntry entry;
+    size_t chunk_size;
+    std::unique_ptr<StreamDecoder> decoder;
+    // Allocated on the first call to next.
+    std::vector<unsigned char> buf;
+    // The end of the entry has been checked.
+    bool verified = false;
+};
@@ -15,30 +15,444 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include<algorithm>
+#include<chrono>
+#include<csignal>
 #include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<memory>
+#include<set>
+#include<stdexcept>
+#include<string>
 #include<thread>
+#include<vector>
 
 #ifdef _WIN32
 #include<WinSock2.h>
 #include<Windows.h>
+#include<io.h>
+#include<fcntl.h>
 #endif
 
 #include"zipfile.h"
+#include"batch.h"
+#include"salvage.h"
+#include"zipfs.h"
+#include"streamunzip.h"
+#include"file.h"
+#include"stats.h"
+#include"trace.h"
+
+namespace {
+
+enum StatsMode {
+    STATS_NONE,
+    STATS_TABLE,
+    STATS_JSON,
+};
+
+volatile sig_atomic_t interrupted = 0;
+
+void on_interrupt(int) {
+    interrupted = 1;
+}
+
+/* Nonzero if any entry failed, in every mode that reports entries. */
+int exit_status(const UnzipSummary &s) {
+    return s.failed == 0 ? 0 : 1;
+}
+
+/* Extracts in the background, printing progress to stderr until done.
+ * Ctrl-C cancels the extraction instead of killing the process, so no
+ * partial files are left behind. */
+UnzipSummary unzip_with_progress(const ZipFile &f, const UnzipOptions &opts) {
+    signal(SIGINT, on_interrupt);
+    auto task = f.unzip_async("", opts);
+    bool finished = false;
+    while(!finished) {
+        finished = task.wait_for(std::chrono::milliseconds(200));
+        if(interrupted) {
+            task.cancel();
+        }
+        auto p = task.progress();
+        fprintf(stderr, "\r%llu/%llu entries, %.1f MB read, %.1f MB written",
+                (unsigned long long)p.entries, (unsigned long long)p.total_entries,
+                p.bytes_in/1e6, p.bytes_out/1e6);
+    }
+    fprintf(stderr, "\n");
+    return task.get();
+}
+
+void usage(const char *prog) {
+    printf("%s [--quiet|--summary|--jsonl] [--input auto|mmap|pread] [--map-window MiB] [--drop-cache] [--prefetch MiB] [--huge-pages] [--decoder-memory MiB] [--tar out.tar|-] [--progress] [--in-memory] [--inner <path>]... [--stats[=json]] [--trace out.json] <zip file>\n", prog);
+    printf("%s --cat <path> [--gzip]|--ls <dir> <zip file>\n", prog);
+    printf("%s --test [--in-memory] [--inner <path>]... [--quiet|--summary|--jsonl] [--stats[=json]] [--trace out.json] <zip file>\n", prog);
+    printf("%s --stream [--quiet|--summary|--jsonl] [--drop-cache] [--stats[=json]] [--trace out.json] <zip file>|-\n", prog);
+    printf("%s --salvage [--threads N] [--quiet|--summary|--jsonl] [--stats[=json]] [--trace out.json] <zip file>\n", prog);
+    printf("%s --batch [--threads N] [--quiet|--summary|--jsonl] [--stats[=json]] [--trace out.json] [zip files]\n", prog);
+}
+
+/* Every archive goes to a directory named after it. Without arguments
+ * the archives are read from stdin, one per line. */
+int unzip_batch_mode(std::vector<std::string> names, const BatchOptions &opts) {
+    if(names.empty()) {
+        char line[4096];
+        while(fgets(line, sizeof(line), stdin)) {
+            std::string name(line);
+            while(!name.empty() && (name.back() == '\n' || name.back() == '\r')) {
+                name.pop_back();
+            }
+            if(!name.empty()) {
+                names.push_back(name);
+            }
+        }
+    }
+    std::vector<BatchJob> jobs;
+    std::set<std::string> prefixes;
+    for(const auto &n : names) {
+        auto prefix = batch_prefix(n);
+        if(!prefixes.insert(prefix).second) {
+            printf("More than one archive would be extracted to %s.\n", prefix.c_str());
+            return 1;
+        }
+        jobs.push_back(BatchJob{n, prefix});
+    }
+    return exit_status(unzip_batch(jobs, opts));
+}
+
+void write_stdout(const unsigned char *data, uint64_t size) {
+    while(size > 0) {
+        const size_t n = (size_t)std::min<uint64_t>(size, 1024*1024*1024);
+        if(fwrite(data, 1, n, stdout) != n) {
+            throw std::runtime_error("Could not write to stdout.");
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+/* Writes one file of the archive to stdout without extracting anything.
+ * Stored files are written straight from the mapping. With gzip a
+ * deflated file is written as a gzip member without decoding it. */
+void cat_file(const char *zipname, const std::string &path, bool gzip) {
+    ZipFS fs(zipname);
+    if(gzip) {
+        const RawEntry e = fs.raw(path);
+        const GzipFrame g = gzip_frame(e);
+        write_stdout(g.header, sizeof(g.header));
+        write_stdout(e.data.data, e.data.size);
+        write_stdout(g.trailer, sizeof(g.trailer));
+        return;
+    }
+    if(fs.stat(path).compression == ZIP_NO_COMPRESSION) {
+        const ZipSpan data = fs.view(path);
+        write_stdout(data.data, data.size);
+        return;
+    }
+    auto f = fs.open(path);
+    std::vector<unsigned char> buf(1024*1024);
+    uint64_t offset = 0;
+    while(size_t n = f.pread(buf.data(), buf.size(), offset)) {
+        write_stdout(buf.data(), n);
+        offset += n;
+    }
+}
+
+/* Extracts while reading the archive front to back, "-" reads stdin. */
+UnzipSummary unzip_streamed(const char *zipname, const UnzipOptions &opts) {
+    if(strcmp(zipname, "-") == 0) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        return unzip_stream(fileno(stdin), "", opts);
+    }
+    File f(zipname, "rb");
+    return unzip_stream(f.fileno(), "", opts);
+}
+
+/* Opens the archive to extract, reading it into memory first if asked
+ * to, and then each archive in inner from the one before it. */
+std::unique_ptr<ZipFile> open_archive(const char *zipname, bool in_memory,
+                                      const std::vector<std::string> &inner) {
+    std::unique_ptr<ZipFile> zf;
+    if(in_memory) {
+        File f(zipname, "rb");
+        auto data = std::make_shared<std::string>(f.read(f.size()));
+        zf.reset(new ZipFile(reinterpret_cast<const unsigned char*>(data->data()), data->size(), data));
+    } else {
+        zf.reset(new ZipFile(zipname));
+    }
+    for(const auto &name : inner) {
+        // The last entry of the name wins, the same as when extracting.
+        size_t found = zf->size();
+        for(size_t i=0; i<zf->size(); i++) {
+            if(zf->header(i).fname == name) {
+                found = i;
+            }
+        }
+        if(found == zf->size()) {
+            throw std::runtime_error("No such file in archive: " + name);
+        }
+        zf = zf->open_nested(found);
+    }
+    return zf;
+}
+
+/* Decodes every entry and checks its CRC without writing anything. */
+int test_archive(const ZipFile &zf, const UnzipOptions &opts) {
+    MMapper mapping = zf.map();
+    ResultChannel results(opts.report, opts.out);
+    for(size_t i=0; i<zf.size(); i++) {
+        EntryResult r{&zf.header(i), true, std::string()};
+        try {
+            EntryReader reader(zf.raw(i, mapping));
+            ZipSpan chunk;
+            while(reader.next(chunk)) {
+            }
+        } catch(const std::exception &e) {
+            r.success = false;
+            r.error = e.what();
+        }
+        results.push(std::move(r));
+    }
+    return exit_status(results.finish());
+}
+
+/* Lists a directory of the archive, directories with a trailing slash. */
+void list_dir(const char *zipname, const std::string &path) {
+    ZipFS fs(zipname);
+    for(const auto &name : fs.readdir(path)) {
+        const bool is_dir = fs.stat(path + "/" + name).type == DIRECTORY_ENTRY;
+        printf("%s%s\n", name.c_str(), is_dir ? "/" : "");
+    }
+}
+
+}
 
 int main(int argc, char **argv) {
-    if(argc != 2 ) {
-        printf("%s <zip file>\n", argv[0]);
+    StatsMode stats = STATS_NONE;
+    const char *zipname = nullptr;
+    const char *tracename = nullptr;
+    const char *tarname = nullptr;
+    const char *catname = nullptr;
+    const char *lsname = nullptr;
+    bool gzip = false;
+    bool test = false;
+    bool in_memory = false;
+    std::vector<std::string> inner;
+    UnzipOptions opts;
+    bool progress = false;
+    bool stream = false;
+    bool batch = false;
+    bool salvage = false;
+    bool single_only = false; // Options batch mode does not support.
+    unsigned threads = 0;
+    std::vector<std::string> names;
+    for(int i=1; i<argc; i++) {
+        if(strcmp(argv[i], "--quiet") == 0) {
+            opts.report = REPORT_QUIET;
+        } else if(strcmp(argv[i], "--summary") == 0) {
+            opts.report = REPORT_SUMMARY;
+        } else if(strcmp(argv[i], "--jsonl") == 0) {
+            opts.report = REPORT_JSONL;
+        } else if(strcmp(argv[i], "--batch") == 0) {
+            batch = true;
+        } else if(strcmp(argv[i], "--salvage") == 0) {
+            salvage = true;
+        } else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--input") == 0 && i+1 < argc) {
+            single_only = true;
+            const char *backend = argv[++i];
+            if(strcmp(backend, "auto") == 0) {
+                opts.input = INPUT_AUTO;
+            } else if(strcmp(backend, "mmap") == 0) {
+                opts.input = INPUT_MMAP;
+            } else if(strcmp(backend, "pread") == 0) {
+                opts.input = INPUT_PREAD;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--map-window") == 0 && i+1 < argc) {
+            single_only = true;
+            opts.map_window = strtoull(argv[++i], nullptr, 10)*1024*1024;
+            if(opts.map_window == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--prefetch") == 0 && i+1 < argc) {
+            single_only = true;
+            opts.prefetch = strtoull(argv[++i], nullptr, 10)*1024*1024;
+            if(opts.prefetch == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--progress") == 0) {
+            single_only = true;
+            progress = true;
+        } else if(strcmp(argv[i], "--huge-pages") == 0) {
+            single_only = true;
+            opts.huge_pages = true;
+        } else if(strcmp(argv[i], "--decoder-memory") == 0 && i+1 < argc) {
+            single_only = true;
+            opts.decoder_memory = strtoull(argv[++i], nullptr, 10)*1024*1024;
+            if(opts.decoder_memory == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--drop-cache") == 0) {
+            single_only = true;
+            opts.drop_cache = true;
+        } else if(strcmp(argv[i], "--tar") == 0 && i+1 < argc) {
+            single_only = true;
+            tarname = argv[++i];
+        } else if(strcmp(argv[i], "--cat") == 0 && i+1 < argc) {
+            single_only = true;
+            catname = argv[++i];
+        } else if(strcmp(argv[i], "--in-memory") == 0) {
+            single_only = true;
+            in_memory = true;
+        } else if(strcmp(argv[i], "--inner") == 0 && i+1 < argc) {
+            single_only = true;
+            inner.push_back(argv[++i]);
+        } else if(strcmp(argv[i], "--test") == 0) {
+            single_only = true;
+            test = true;
+        } else if(strcmp(argv[i], "--gzip") == 0) {
+            single_only = true;
+            gzip = true;
+        } else if(strcmp(argv[i], "--ls") == 0 && i+1 < argc) {
+            single_only = true;
+            lsname = argv[++i];
+        } else if(strcmp(argv[i], "--stream") == 0) {
+            single_only = true;
+            stream = true;
+        } else if(strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+            tracename = argv[++i];
+        } else if(strcmp(argv[i], "--stats") == 0) {
+            stats = STATS_TABLE;
+        } else if(strcmp(argv[i], "--stats=json") == 0) {
+            stats = STATS_JSON;
+        } else if(argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
+            names.push_back(argv[i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(batch ? single_only || salvage : names.size() != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(salvage && single_only) {
+        usage(argv[0]);
+        return 1;
+    }
+    if((in_memory || !inner.empty()) && (stream || catname || lsname)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(test && (tarname || catname || lsname || stream || progress)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(gzip && !catname) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(stream && (tarname || catname || lsname || progress || opts.map_window || opts.prefetch)) {
+        usage(argv[0]);
         return 1;
     }
+    if(!batch) {
+        zipname = names.front().c_str();
+    }
+    if(catname) {
+        // Errors must not end up in the middle of the file's contents.
+        opts.out = stderr;
+    }
+    std::unique_ptr<FILE, int(*)(FILE*)> tarfile(nullptr, fclose);
+    if(tarname) {
+        if(strcmp(tarname, "-") == 0) {
+            // The reports must not end up in the middle of the tar stream.
+            opts.out = stderr;
+            opts.tar_fd = fileno(stdout);
+        } else {
+            tarfile.reset(fopen(tarname, "wb"));
+            if(!tarfile) {
+                printf("Could not open %s for writing.\n", tarname);
+                return 1;
+            }
+            opts.tar_fd = fileno(tarfile.get());
+        }
+    }
+    if(tracename) {
+        if(!stats_enabled()) {
+            printf("Tracing was disabled at build time.\n");
+            return 1;
+        }
+        trace_start();
+    }
+    auto start = std::chrono::steady_clock::now();
+    int rc = 0;
     try {
-        ZipFile f(argv[1]);
-        f.unzip("");
+        if(batch) {
+            BatchOptions bopts;
+            bopts.report = opts.report;
+            bopts.out = opts.out;
+            bopts.threads = threads;
+            rc = unzip_batch_mode(names, bopts);
+        } else if(salvage) {
+            SalvageOptions sopts;
+            sopts.report = opts.report;
+            sopts.out = opts.out;
+            sopts.threads = threads;
+            rc = exit_status(salvage_archive(zipname, "", sopts));
+        } else if(test) {
+            rc = test_archive(*open_archive(zipname, in_memory, inner), opts);
+        } else if(catname) {
+            cat_file(zipname, catname, gzip);
+        } else if(lsname) {
+            list_dir(zipname, lsname);
+        } else if(stream) {
+            rc = exit_status(unzip_streamed(zipname, opts));
+        } else if(progress) {
+            auto f = open_archive(zipname, in_memory, inner);
+            const auto summary = unzip_with_progress(*f, opts);
+            if(summary.cancelled) {
+                fprintf(opts.out, "Unzipping cancelled.\n");
+                rc = 1;
+            } else {
+                rc = exit_status(summary);
+            }
+        } else {
+            rc = exit_status(open_archive(zipname, in_memory, inner)->unzip("", opts));
+        }
     } catch(std::exception &e) {
-        printf("Unzipping failed: %s\n", e.what());
-        return 1;
+        fprintf(opts.out, "Unzipping failed: %s\n", e.what());
+        rc = 1;
     } catch(...) {
-        printf("Unzipping failed due to an unknown reason.");
-        return 1;
+        fprintf(opts.out, "Unzipping failed due to an unknown reason.");
+        rc = 1;
+    }
+    if(tracename) {
+        try {
+            trace_write(tracename);
+        } catch(std::exception &e) {
+            fprintf(opts.out, "Writing trace failed: %s\n", e.what());
+            rc = 1;
+        }
+    }
+    if(stats != STATS_NONE) {
+        // Stderr so the report does not get mixed with the per-entry output.
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+        if(stats == STATS_JSON) {
+            stats_print_json(stderr, stats_snapshot(), wall.count());
+        } else {
+            stats_print_table(stderr, stats_snapshot(), wall.count());
+        }
     }
-    return 0;
+    return rc;
 }
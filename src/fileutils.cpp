@@ -17,6 +17,7 @@
 
 #include"fileutils.h"
 #include"utils.h"
+#include"stats.h"
 
 #ifdef _WIN32
 #include<WinSock2.h>
@@ -24,8 +25,10 @@
 #include<direct.h>
 #else
 #include<dirent.h>
+#include<fcntl.h>
 #include<sys/stat.h>
 #include<sys/types.h>
+#include<unistd.h>
 #endif
 #include<memory>
 #include<array>
@@ -142,6 +145,7 @@ std::vector<fileinfo> expand_entry(const std::string &fname) {
 }
 
 bool is_dir(const std::string &s) noexcept {
+    STATS_COUNT(COUNT_STAT, 1);
     struct stat sbuf;
     if(stat(s.c_str(), &sbuf) < 0) {
         return false;
@@ -170,6 +174,7 @@ bool is_symlink(const fileinfo &f) noexcept {
 }
 
 bool exists_on_fs(const std::string &s) noexcept {
+    STATS_COUNT(COUNT_STAT, 1);
     struct stat sbuf;
     return stat(s.c_str(), &sbuf) == 0;
 }
@@ -190,6 +195,7 @@ void mkdirp(const std::string &s) {
 #ifdef _WIN32
             _mkdir(curdir.c_str());
 #else
+            STATS_COUNT(COUNT_MKDIR, 1);
             mkdir(curdir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
 #endif
             if(!is_dir(curdir)) {
@@ -231,3 +237,34 @@ std::vector<fileinfo> expand_files(const std::vector<std::string> &originals) {
     });
 }
 
+
+uint64_t page_size() noexcept {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+void drop_cached_range(int fd, uint64_t offset, uint64_t length) noexcept {
+#if defined(POSIX_FADV_DONTNEED)
+    STATS_COUNT(COUNT_FADVISE, 1);
+    posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+#endif
+}
+
+void write_back_and_drop(int fd) noexcept {
+#if defined(__linux__)
+    // Only dirty pages that have reached the disk can be dropped.
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#elif !defined(_WIN32)
+    fsync(fd);
+#endif
+    drop_cached_range(fd, 0, 0);
+}
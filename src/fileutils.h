@@ -35,6 +35,14 @@ void create_dirs_for_file(const std::string &s);
 
 std::vector<fileinfo> expand_files(const std::vector<std::string> &originals);
 
+uint64_t page_size() noexcept;
+
+/* Page cache hints for bulk extraction. They are best effort and do
+ * nothing on platforms that lack the calls. */
+void drop_cached_range(int fd, uint64_t offset, uint64_t length) noexcept;
+// Writes out the file and then drops it from the cache.
+void write_back_and_drop(int fd) noexcept;
+
 #if defined _WIN32
 #if !defined S_ISDIR
 #define S_ISDIR(m) (((m) & _S_IFDIR) == _S_IFDIR)
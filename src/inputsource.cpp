@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"inputsource.h"
+#include"mmapper.h"
+#include"file.h"
+#include"utils.h"
+
+#if defined(_WIN32)
+#include<winsock2.h>
+#include<windows.h>
+#include<io.h>
+#else
+#include<unistd.h>
+#include<cerrno>
+#endif
+#if defined(__linux__)
+#include<sys/vfs.h>
+#endif
+
+#include<algorithm>
+#include<cstring>
+#include<stdexcept>
+
+namespace {
+
+// Reads start at a multiple of this.
+const constexpr uint64_t READ_ALIGNMENT = 4096;
+
+#if defined(__linux__)
+// From linux/magic.h, which not every system has.
+const constexpr unsigned long REMOTE_FILE_SYSTEMS[] = {
+    0x6969,     // NFS
+    0x65735546, // FUSE
+    0x517B,     // SMB
+    0xFF534D42, // CIFS
+    0xFE534D42, // SMB2
+    0x00C36400, // Ceph
+    0x5346414F, // AFS
+    0x01021997, // 9P
+};
+#endif
+
+class MappedInput final : public InputSource {
+public:
+    MappedInput(MMapper m, bool of_file) : mapping(std::move(m)), of_file(of_file) {}
+
+    ZipSpan get(uint64_t offset, uint64_t length) override {
+        if(offset > mapping.size() || length > mapping.size() - offset) {
+            throw std::runtime_error("Entry data extends past the end of the file.");
+        }
+        return ZipSpan{static_cast<unsigned char*>(mapping) + offset, length};
+    }
+
+    void release(uint64_t offset, uint64_t length) noexcept override {
+        mapping.release(offset, length);
+    }
+
+    bool file_mapping() const noexcept override {
+        return of_file;
+    }
+
+private:
+    MMapper mapping;
+    // Memory archives are ordinary heap memory.
+    bool of_file;
+};
+
+class WindowedInput final : public InputSource {
+public:
+    WindowedInput(const File &f, uint64_t window_size, bool huge_pages) : mapper(f, window_size) {
+        mapper.set_huge_pages(huge_pages);
+    }
+
+    ZipSpan get(uint64_t offset, uint64_t length) override {
+        return ZipSpan{mapper.map(offset, length), length};
+    }
+
+    void release(uint64_t offset, uint64_t length) noexcept override {
+        mapper.release(offset, length);
+    }
+
+    bool file_mapping() const noexcept override {
+        return true;
+    }
+
+private:
+    WindowedMapper mapper;
+};
+
+}
+
+ZipSpan InputRange::next(uint64_t max) {
+    const uint64_t n = std::min(max, total - pos);
+    if(n == 0) {
+        return ZipSpan{nullptr, 0};
+    }
+    ZipSpan piece = data ? ZipSpan{data + pos, n} : source->get(offset + pos, n);
+    pos += piece.size;
+    return piece;
+}
+
+void InputRange::read(unsigned char *out, uint64_t size) {
+    while(size > 0) {
+        const ZipSpan piece = next(size);
+        if(piece.size == 0) {
+            throw std::runtime_error("Entry data is truncated.");
+        }
+        memcpy(out, piece.data, (size_t)piece.size);
+        out += piece.size;
+        size -= piece.size;
+    }
+}
+
+PreadReader::PreadReader(const File &file, uint64_t block_size) :
+    fd(file.fileno()), file_size(file.size()), block_size(std::max(block_size, READ_ALIGNMENT)) {
+    if((size_t)this->block_size != this->block_size) {
+        throw std::runtime_error("Read block size does not fit in memory.");
+    }
+}
+
+ZipSpan PreadReader::get(uint64_t offset, uint64_t length) {
+    if(offset > file_size || length > file_size - offset) {
+        throw std::runtime_error("Entry data extends past the end of the file.");
+    }
+    if(length == 0) {
+        return ZipSpan{nullptr, 0};
+    }
+    if(offset < start || offset - start >= size) {
+        // The block starts less than one alignment before the offset and
+        // the block size is at least that, so the read covers offset.
+        const uint64_t first = offset - offset % READ_ALIGNMENT;
+        const uint64_t n = std::min(block_size, file_size - first);
+        if(!buf) {
+            buf.reset(new unsigned char[(size_t)block_size]);
+        }
+        size = 0;
+        read_at(buf.get(), first, n);
+        start = first;
+        size = n;
+    }
+    return ZipSpan{buf.get() + (offset - start), std::min(length, size - (offset - start))};
+}
+
+void PreadReader::read_at(unsigned char *out, uint64_t offset, uint64_t length) {
+    uint64_t done = 0;
+    while(done < length) {
+#if defined(_WIN32)
+        // Positioned reads through OVERLAPPED. On a synchronous handle
+        // ReadFile still moves the file pointer past the data, but every
+        // other reader of the archive seeks before reading, so nothing
+        // relies on where it is.
+        OVERLAPPED o = {};
+        o.Offset = (DWORD)(offset + done);
+        o.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD r = 0;
+        const DWORD chunk = (DWORD)std::min<uint64_t>(length - done, 1u << 30);
+        if(!ReadFile((HANDLE)_get_osfhandle(fd), out + done, chunk, &r, &o) && GetLastError() != ERROR_HANDLE_EOF) {
+            throw std::runtime_error("Could not read archive.");
+        }
+#else
+        const ssize_t r = pread(fd, out + done, (size_t)(length - done), (off_t)(offset + done));
+        if(r < 0 && errno == EINTR) {
+            continue;
+        }
+        if(r < 0) {
+            throw_system("Could not read archive:");
+        }
+#endif
+        if(r == 0) {
+            throw std::runtime_error("Archive is shorter than when it was opened.");
+        }
+        done += r;
+    }
+}
+
+InputBackend detect_input_backend(const File &file) noexcept {
+#if defined(__linux__)
+    struct statfs buf;
+    if(fstatfs(file.fileno(), &buf) == 0) {
+        for(const auto magic : REMOTE_FILE_SYSTEMS) {
+            if((unsigned long)buf.f_type == magic) {
+                return INPUT_PREAD;
+            }
+        }
+    }
+#else
+    (void)file;
+#endif
+    return INPUT_MMAP;
+}
+
+std::unique_ptr<InputSource> open_input(const File &file, InputBackend backend, uint64_t map_window,
+                                        bool huge_pages, bool sequential) {
+    if(backend == INPUT_AUTO) {
+        backend = detect_input_backend(file);
+    }
+    if(backend == INPUT_PREAD) {
+        return std::unique_ptr<InputSource>(new PreadReader(file));
+    }
+    if(map_window != 0) {
+        return std::unique_ptr<InputSource>(new WindowedInput(file, map_window, huge_pages));
+    }
+    MMapper mapping(file);
+    if(sequential) {
+        mapping.advise_sequential();
+    }
+    if(huge_pages) {
+        mapping.advise_huge_pages();
+    }
+    return std::unique_ptr<InputSource>(new MappedInput(std::move(mapping), true));
+}
+
+std::unique_ptr<InputSource> memory_input(const unsigned char *data, uint64_t size) {
+    return std::unique_ptr<InputSource>(new MappedInput(MMapper(data, size), false));
+}
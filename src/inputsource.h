@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include"entryreader.h"
+
+#include<cstdint>
+#include<memory>
+
+class File;
+
+enum InputBackend {
+    INPUT_AUTO,  // Pread on network and FUSE file systems, mmap elsewhere.
+    INPUT_MMAP,  // Map the archive, see MMapper and WindowedMapper.
+    INPUT_PREAD, // Read it with pread, see PreadReader.
+};
+
+/* Where the decoders get an entry's compressed data from. */
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+
+    /* Returns the start of the given range of the archive, at least one
+     * byte of it if the range is not empty. Mappings return all of it.
+     * The bytes stay valid until the next call. Throws if they can not
+     * be read. */
+    virtual ZipSpan get(uint64_t offset, uint64_t length) = 0;
+
+    /* The range is no longer needed and its memory can be given back. */
+    virtual void release(uint64_t offset, uint64_t length) noexcept = 0;
+
+    /* True if the bytes are a read only mapping of the file, which
+     * nothing in this process writes to or frees while it is open. */
+    virtual bool file_mapping() const noexcept { return false; }
+};
+
+/* An entry's compressed data, handed out a piece at a time so that a
+ * big entry never has to be in memory all at once. Either all of it is
+ * in memory already or it comes from an input source as it is needed. */
+class InputRange final {
+public:
+    InputRange(const unsigned char *data, uint64_t size) noexcept :
+        data(data), source(nullptr), offset(0), total(size) {}
+    InputRange(InputSource &source, uint64_t offset, uint64_t size) noexcept :
+        data(nullptr), source(&source), offset(offset), total(size) {}
+
+    uint64_t size() const noexcept { return total; }
+    /* Number of bytes handed out so far. */
+    uint64_t position() const noexcept { return pos; }
+    bool file_mapping() const noexcept { return source && source->file_mapping(); }
+
+    /* The next at most max bytes, empty once the range is used up. They
+     * stay valid until the next call. */
+    ZipSpan next(uint64_t max);
+
+    /* Copies the next size bytes to out. Throws if the range ends first. */
+    void read(unsigned char *out, uint64_t size);
+
+private:
+    const unsigned char *data;
+    InputSource *source;
+    uint64_t offset;
+    uint64_t total;
+    uint64_t pos = 0;
+};
+
+/* Reads the archive with positioned reads into a buffer of its own.
+ * Page faults on a mapping are slow on FUSE and network file systems
+ * where large reads are not, and reading past the end of a file that
+ * was truncated under us is an error rather than SIGBUS.
+ *
+ * Reads are one block long and start at a page boundary. The last one
+ * stays in the buffer, so a run of small entries costs one read per
+ * block. Bigger entries are handed out a block at a time, so the buffer
+ * never grows past one block. Nothing is shared between readers but the
+ * descriptor, which is never seeked, so any number of them can read the
+ * same file from different threads. */
+class PreadReader final : public InputSource {
+public:
+    static const constexpr uint64_t DEFAULT_BLOCK_SIZE = 1024*1024;
+
+    explicit PreadReader(const File &file, uint64_t block_size=DEFAULT_BLOCK_SIZE);
+    PreadReader(const PreadReader &) = delete;
+    PreadReader& operator=(const PreadReader &) = delete;
+
+    ZipSpan get(uint64_t offset, uint64_t length) override;
+
+    /* The buffer is only one block, so it is kept. */
+    void release(uint64_t, uint64_t) noexcept override {}
+
+private:
+    void read_at(unsigned char *out, uint64_t offset, uint64_t length);
+
+    int fd;
+    uint64_t file_size;
+    uint64_t block_size;
+    // Allocated on the first read.
+    std::unique_ptr<unsigned char[]> buf;
+    // The part of the file in the buffer.
+    uint64_t start = 0;
+    uint64_t size = 0;
+};
+
+/* The backend INPUT_AUTO picks for the file. */
+InputBackend detect_input_backend(const File &file) noexcept;
+
+/* Opens the archive with the given backend. A map window of zero maps
+ * the whole file. Huge pages and sequential access are only hints to
+ * the mapping backends. */
+std::unique_ptr<InputSource> open_input(const File &file, InputBackend backend, uint64_t map_window,
+                                        bool huge_pages, bool sequential);
+
+/* An archive that is already in memory. */
+std::unique_ptr<InputSource> memory_input(const unsigned char *data, uint64_t size);
@@ -22,11 +22,45 @@
 #else
 #include<sys/mman.h>
 #include<fcntl.h>
+#include<unistd.h>
 #endif
 
+#include<algorithm>
+#include<stdexcept>
+
 #include"mmapper.h"
 #include"file.h"
 #include"utils.h"
+#include"stats.h"
+#include"fileutils.h"
+
+namespace {
+
+/* Releases the part of [offset, offset+length) that falls inside a
+ * mapping of [map_offset, map_offset+map_size). Fault-around maps
+ * neighbouring pages that were never read, so the whole range is
+ * released rather than just the bytes the caller touched. */
+void release_pages(void *addr, uint64_t map_offset, uint64_t map_size,
+                   uint64_t offset, uint64_t length) noexcept {
+#if defined(_WIN32)
+    (void)addr;
+    (void)map_offset;
+    (void)map_size;
+    (void)offset;
+    (void)length;
+#else
+    const uint64_t page = page_size();
+    uint64_t first = std::max(offset, map_offset) - map_offset;
+    uint64_t last = std::min(offset + length, map_offset + map_size) - map_offset;
+    if(!addr || first >= last) {
+        return;
+    }
+    first -= first % page;
+    madvise(static_cast<unsigned char*>(addr) + first, last - first, MADV_DONTNEED);
+#endif
+}
+
+}
 
 #if defined(_WIN32)
 MMapper::MMapper(const File &f) {
@@ -42,6 +76,7 @@ MMapper::MMapper(const File &f) {
     if(map_size == 0) {
         addr = nullptr;
     } else {
+        STATS_COUNT(COUNT_MMAP, 1);
         addr = ::mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fdnum, 0);
         if(addr == MAP_FAILED) {
             throw_system("Could not mmap file:");
@@ -50,31 +85,198 @@ MMapper::MMapper(const File &f) {
 }
 #endif
 
-MMapper::MMapper(MMapper && other) {
-    if(&other == this) {
-        return;
-    }
-    this->addr = other.addr;
-    this->map_size = other.map_size;
+MMapper::MMapper(const unsigned char *data, uint64_t size) noexcept :
+    addr(const_cast<unsigned char*>(data)), map_size(size), borrowed(true) {
+#if defined(_WIN32)
+    h = nullptr;
+#endif
+}
+
+MMapper::MMapper(MMapper && other) :
+    addr(other.addr), map_size(other.map_size), borrowed(other.borrowed) {
     other.addr = nullptr;
+#if defined(_WIN32)
+    h = other.h;
+    other.h = nullptr;
+#endif
 }
 
 MMapper& MMapper::operator=(MMapper &&other) {
     if(&other != this) {
+        unmap();
         this->addr = other.addr;
         this->map_size = other.map_size;
+        this->borrowed = other.borrowed;
         other.addr = nullptr;
+#if defined(_WIN32)
+        this->h = other.h;
+        other.h = nullptr;
+#endif
     }
     return *this;
 }
 
+void MMapper::release(uint64_t offset, uint64_t length) noexcept {
+    if(!borrowed) {
+        release_pages(addr, 0, map_size, offset, length);
+    }
+}
+
+void MMapper::advise_sequential() noexcept {
+#if !defined(_WIN32)
+    if(addr && !borrowed) {
+        madvise(addr, map_size, MADV_SEQUENTIAL);
+    }
+#endif
+}
+
+void MMapper::advise_huge_pages() noexcept {
+#if defined(MADV_HUGEPAGE)
+    if(addr && !borrowed) {
+        madvise(addr, map_size, MADV_HUGEPAGE);
+    }
+#endif
+}
+
 MMapper::~MMapper() {
+    unmap();
+}
+
+void MMapper::unmap() noexcept {
+    if(borrowed) {
+        return;
+    }
 #if defined(_WIN32)
-    UnmapViewOfFile(addr);
-    CloseHandle(h);
+    if(addr) {
+        UnmapViewOfFile(addr);
+    }
+    if(h) {
+        CloseHandle(h);
+    }
 #else
-  if(addr) {
+    if(addr) {
         munmap(addr, map_size);
     }
 #endif
 }
+
+namespace {
+
+// Enough for a run of small entries plus one that straddles windows.
+const constexpr size_t MAX_WINDOWS = 4;
+const constexpr uint64_t HUGE_PAGE_SIZE = 2*1024*1024;
+
+uint64_t round_up(uint64_t value, uint64_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+}
+
+#if defined(_WIN32)
+WindowedMapper::WindowedMapper(const File &f, uint64_t window_size) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    granularity = info.dwAllocationGranularity;
+    file_size = f.size();
+    this->window_size = round_up(std::max<uint64_t>(window_size, 1), granularity);
+    h = CreateFileMapping((HANDLE)_get_osfhandle(f.fileno()), nullptr, PAGE_READONLY, 0, 0, nullptr);
+}
+#else
+WindowedMapper::WindowedMapper(const File &f, uint64_t window_size) {
+    granularity = sysconf(_SC_PAGESIZE);
+    file_size = f.size();
+    this->window_size = round_up(std::max<uint64_t>(window_size, 1), granularity);
+    fd = f.fileno();
+}
+#endif
+
+WindowedMapper::~WindowedMapper() {
+    for(const auto &w : windows) {
+        unmap(w);
+    }
+#if defined(_WIN32)
+    CloseHandle(h);
+#endif
+}
+
+void WindowedMapper::release(uint64_t offset, uint64_t length) noexcept {
+    for(const auto &w : windows) {
+        release_pages(w.addr, w.offset, w.size, offset, length);
+    }
+}
+
+void WindowedMapper::set_huge_pages(bool enabled) noexcept {
+    huge = enabled;
+    if(huge) {
+        window_size = round_up(window_size, HUGE_PAGE_SIZE);
+    }
+}
+
+void WindowedMapper::unmap(const Window &w) noexcept {
+#if defined(_WIN32)
+    UnmapViewOfFile(w.addr);
+#else
+    munmap(w.addr, w.size);
+#endif
+}
+
+const unsigned char* WindowedMapper::map(uint64_t offset, uint64_t length) {
+    if(offset > file_size || length > file_size - offset) {
+        throw std::runtime_error("Entry data extends past the end of the file.");
+    }
+    clock++;
+    auto hit = std::find_if(windows.begin(), windows.end(), [=](const Window &w) {
+        return offset >= w.offset && offset + length <= w.offset + w.size;
+    });
+    if(hit == windows.end()) {
+        if(windows.size() >= MAX_WINDOWS) {
+            auto lru = std::min_element(windows.begin(), windows.end(), [](const Window &a, const Window &b) {
+                return a.last_used < b.last_used;
+            });
+            unmap(*lru);
+            windows.erase(lru);
+        }
+        Window w;
+        w.offset = offset - offset % window_size;
+        const uint64_t end = std::min(std::max(w.offset + window_size, round_up(offset + length, granularity)),
+                                      file_size);
+        w.size = end - w.offset;
+        if(w.size == 0) {
+            // Nothing to map for an empty entry at the very end.
+            static const unsigned char empty = 0;
+            return &empty;
+        }
+        STATS_COUNT(COUNT_MMAP, 1);
+#if defined(_WIN32)
+        w.addr = MapViewOfFile(h, FILE_MAP_READ, (DWORD)(w.offset >> 32), (DWORD)w.offset, (SIZE_T)w.size);
+        if(!w.addr) {
+            throw std::runtime_error("Could not map archive window.");
+        }
+#else
+        w.addr = ::mmap(nullptr, w.size, PROT_READ, MAP_PRIVATE, fd, w.offset);
+        if(w.addr == MAP_FAILED) {
+            throw_system("Could not mmap archive window:");
+        }
+        // Entries are decoded front to back.
+        madvise(w.addr, w.size, MADV_SEQUENTIAL);
+#if defined(MADV_HUGEPAGE)
+        if(huge) {
+            madvise(w.addr, w.size, MADV_HUGEPAGE);
+        }
+#endif
+#endif
+        windows.push_back(w);
+        hit = windows.end() - 1;
+    }
+    hit->last_used = clock;
+    unsigned char *start = static_cast<unsigned char*>(hit->addr) + (offset - hit->offset);
+#if !defined(_WIN32)
+    if(length > 0) {
+        // Start reading the entry in before the decoder gets to it.
+        const uint64_t page_start = (offset - hit->offset) / granularity * granularity;
+        madvise(static_cast<unsigned char*>(hit->addr) + page_start,
+                offset + length - hit->offset - page_start, MADV_WILLNEED);
+    }
+#endif
+    return start;
+}
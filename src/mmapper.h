@@ -22,12 +22,17 @@
 #include<windows.h>
 #endif
 #include<cstdint>
+#include<vector>
 
 class File;
 
 class MMapper final {
 public:
     explicit MMapper(const File &file);
+    /* Stands for memory that is already there, such as an archive that
+     * was received into memory. Nothing is unmapped, released or advised,
+     * the caller keeps the memory alive. */
+    MMapper(const unsigned char *data, uint64_t size) noexcept;
     MMapper(const MMapper&) = delete;
     MMapper(MMapper && other);
     MMapper& operator=(const MMapper &) = delete;
@@ -36,12 +41,77 @@ public:
 
     uint64_t size() const noexcept { return map_size; }
 
+    /* Unmaps the pages holding the given file range from this process so
+     * that the page cache can drop them. They read back in if touched
+     * again. Does nothing on Windows. */
+    void release(uint64_t offset, uint64_t length) noexcept;
+
+    /* Tells the kernel to read ahead only, not around the faulting page,
+     * so that released pages behind the reader do not come back. */
+    void advise_sequential() noexcept;
+
+    /* Asks for the mapping to be backed by 2 MB pages. For file mappings
+     * the kernel needs read-only THP support for the file system, and
+     * otherwise ignores this. */
+    void advise_huge_pages() noexcept;
+
     operator unsigned char*() noexcept { return reinterpret_cast<unsigned char*>(addr); }
 
 private:
+    void unmap() noexcept;
+
     void *addr;
     uint64_t map_size;
+    bool borrowed = false;
+#if defined(_WIN32)
+    HANDLE h;
+#endif
+};
+
+/* Maps an archive a piece at a time so that the address space in use
+ * depends on the window size rather than the size of the file. Windows
+ * start at multiples of the window size and grow when an entry does not
+ * fit. The few most recently used ones are kept mapped so that runs of
+ * small entries do not remap for every entry. */
+class WindowedMapper final {
+public:
+    WindowedMapper(const File &file, uint64_t window_size);
+    WindowedMapper(const WindowedMapper&) = delete;
+    WindowedMapper& operator=(const WindowedMapper &) = delete;
+    ~WindowedMapper();
+
+    uint64_t size() const noexcept { return file_size; }
+
+    /* Returns a pointer to the given byte range. It stays valid until
+     * the next call. */
+    const unsigned char* map(uint64_t offset, uint64_t length);
+
+    /* Same as MMapper::release for whichever windows overlap the range. */
+    void release(uint64_t offset, uint64_t length) noexcept;
+
+    /* Windows mapped from now on are aligned to and advised for 2 MB
+     * pages, see MMapper::advise_huge_pages. */
+    void set_huge_pages(bool enabled) noexcept;
+
+private:
+    struct Window {
+        void *addr;
+        uint64_t offset;
+        uint64_t size;
+        uint64_t last_used;
+    };
+
+    void unmap(const Window &w) noexcept;
+
+    uint64_t file_size;
+    uint64_t window_size;
+    uint64_t granularity;
+    uint64_t clock = 0;
+    bool huge = false;
+    std::vector<Window> windows;
 #if defined(_WIN32)
     HANDLE h;
+#else
+    int fd;
 #endif
 };
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"prefetch.h"
+#include"stats.h"
+#include"trace.h"
+
+#ifndef _WIN32
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
+#include<algorithm>
+
+namespace {
+
+// Largest single hint. Small neighbouring ranges are merged up to this.
+const constexpr uint64_t MAX_FETCH = 1024*1024;
+// Neighbouring ranges closer than this are fetched as one, headers and all.
+const constexpr uint64_t MAX_GAP = 64*1024;
+// Stalls shorter than this are not worth more read-ahead.
+const constexpr auto STALL_THRESHOLD = std::chrono::microseconds(100);
+
+}
+
+Prefetcher::Prefetcher(int fd, std::vector<PrefetchRange> ranges_, uint64_t depth, uint64_t max_depth) :
+        fd(fd), ranges(std::move(ranges_)), cur_depth(depth), max_depth(std::max(depth, max_depth)) {
+    starts.reserve(ranges.size() + 1);
+    uint64_t total = 0;
+    for(const auto &r : ranges) {
+        starts.push_back(total);
+        total += r.length;
+    }
+    starts.push_back(total);
+    STATS_MAX(GAUGE_PREFETCH_DEPTH, cur_depth);
+    t = std::thread(&Prefetcher::run, this);
+}
+
+Prefetcher::~Prefetcher() {
+    {
+        std::lock_guard<std::mutex> l(m);
+        stop = true;
+    }
+    wake.notify_one();
+    t.join();
+}
+
+void Prefetcher::advance(size_t i) {
+    {
+        std::lock_guard<std::mutex> l(m);
+        decoder = i;
+        if(fetch_range < i) {
+            // Reading behind the decoder would be of no use.
+            fetch_range = i;
+            fetch_offset = 0;
+        }
+        if(i < ranges.size() && fetched() < starts[i + 1] && !stalled) {
+            STATS_COUNT(COUNT_PREFETCH_STALLS, 1);
+            stalled = true;
+            stall_range = i;
+            stall_start = std::chrono::steady_clock::now();
+        }
+    }
+    wake.notify_one();
+}
+
+uint64_t Prefetcher::depth() const {
+    std::lock_guard<std::mutex> l(m);
+    return cur_depth;
+}
+
+void Prefetcher::run() {
+    std::unique_lock<std::mutex> l(m);
+    while(true) {
+        wake.wait(l, [this]() {
+            return stop || (fetch_range < ranges.size() && fetched() < starts[decoder] + cur_depth);
+        });
+        if(stop) {
+            return;
+        }
+        // Collect one hint's worth of neighbouring ranges.
+        size_t r = fetch_range;
+        uint64_t off = fetch_offset;
+        const uint64_t begin = ranges[r].offset + off;
+        uint64_t end = begin;
+        while(r < ranges.size() && end - begin < MAX_FETCH) {
+            const auto &cur = ranges[r];
+            const uint64_t pos = cur.offset + off;
+            if(end != begin && (pos < end || pos - end > MAX_GAP)) {
+                break;
+            }
+            const uint64_t take = std::min(cur.length - off, MAX_FETCH - (end - begin));
+            end = pos + take;
+            off += take;
+            if(off == cur.length) {
+                r++;
+                off = 0;
+            }
+        }
+        l.unlock();
+        fetch(begin, end - begin);
+        l.lock();
+        if(fetch_range < r || (fetch_range == r && fetch_offset < off)) {
+            fetch_range = r;
+            fetch_offset = off;
+        }
+        if(stalled && fetched() >= starts[stall_range + 1]) {
+            const auto now = std::chrono::steady_clock::now();
+#ifdef ZIP_STATS
+            if(trace_active()) {
+                trace_span("prefetch_stall", stall_start, now);
+            }
+#endif
+            if(now - stall_start >= STALL_THRESHOLD && cur_depth < max_depth) {
+                cur_depth = std::min(2*cur_depth, max_depth);
+                STATS_MAX(GAUGE_PREFETCH_DEPTH, cur_depth);
+            }
+            stalled = false;
+        }
+    }
+}
+
+void Prefetcher::fetch(uint64_t offset, uint64_t length) noexcept {
+    if(length == 0) {
+        return;
+    }
+    STATS_COUNT(COUNT_PREFETCH_BYTES, length);
+#if defined(POSIX_FADV_WILLNEED)
+    // Starts reading the whole range without waiting for it.
+    posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+    // Reading the last byte waits until the read has got that far, which
+    // keeps the distance to the decoder honest.
+    char c;
+    if(pread(fd, &c, 1, offset + length - 1) < 0) {
+        return;
+    }
+#else
+    (void)offset;
+#endif
+}
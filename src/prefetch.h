@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<chrono>
+#include<condition_variable>
+#include<cstdint>
+#include<mutex>
+#include<thread>
+#include<vector>
+
+struct PrefetchRange {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/* Reads the compressed data of upcoming entries into the page cache
+ * from a background thread so that the decoder does not stall on page
+ * faults. It stays a set number of bytes ahead of the decoder, counted
+ * over the ranges in extraction order. Whenever the decoder gets to an
+ * entry that has not been read in yet the stall is timed, and if it was
+ * long enough to matter the distance is doubled, up to max_depth.
+ *
+ * The hints are only advisory. Where the platform has no way to give
+ * them the thread does nothing. */
+class Prefetcher final {
+public:
+    Prefetcher(int fd, std::vector<PrefetchRange> ranges, uint64_t depth, uint64_t max_depth);
+    Prefetcher(const Prefetcher &) = delete;
+    Prefetcher& operator=(const Prefetcher &) = delete;
+    ~Prefetcher();
+
+    /* Called by the decoder when it starts on range i. */
+    void advance(size_t i);
+
+    uint64_t depth() const;
+
+private:
+    void run();
+    void fetch(uint64_t offset, uint64_t length) noexcept;
+    // How far the prefetcher has got. Must hold the lock.
+    uint64_t fetched() const noexcept { return starts[fetch_range] + fetch_offset; }
+
+    int fd;
+    std::vector<PrefetchRange> ranges;
+    // starts[i] is the total length of the ranges before i.
+    std::vector<uint64_t> starts;
+    uint64_t cur_depth;
+    uint64_t max_depth;
+
+    mutable std::mutex m;
+    std::condition_variable wake;
+    size_t decoder = 0;
+    size_t fetch_range = 0;
+    uint64_t fetch_offset = 0; // Within fetch_range.
+    bool stalled = false;
+    size_t stall_range = 0;
+    std::chrono::steady_clock::time_point stall_start;
+    bool stop = false;
+    std::thread t;
+};
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"report.h"
+#include"utils.h"
+
+namespace {
+
+void append_name(const EntryResult &r, std::string &buf) {
+    if(r.prefix) {
+        buf += *r.prefix;
+        if(r.header) {
+            buf += '/';
+        }
+    }
+    if(r.header) {
+        buf += r.header->fname;
+    }
+}
+
+}
+
+ResultChannel::ResultChannel(ReportMode mode, FILE *out, size_t capacity) :
+    mode(mode), out(out), ring(capacity) {
+    reporter = std::thread(&ResultChannel::report_loop, this);
+}
+
+ResultChannel::~ResultChannel() {
+    if(reporter.joinable()) {
+        finish();
+    }
+}
+
+void ResultChannel::push(EntryResult &&r) {
+    std::unique_lock<std::mutex> l(m);
+    not_full.wait(l, [this]() { return count < ring.size(); });
+    ring[head] = std::move(r);
+    head = (head + 1) % ring.size();
+    const bool was_empty = count++ == 0;
+    l.unlock();
+    if(was_empty) {
+        not_empty.notify_one();
+    }
+}
+
+UnzipSummary ResultChannel::finish() {
+    {
+        std::lock_guard<std::mutex> l(m);
+        closed = true;
+    }
+    not_empty.notify_one();
+    reporter.join();
+    if(mode == REPORT_SUMMARY) {
+        fprintf(out, "%llu entries, %llu ok, %llu failed, %llu bytes\n",
+                (unsigned long long)summary.entries,
+                (unsigned long long)(summary.entries - summary.failed),
+                (unsigned long long)summary.failed,
+                (unsigned long long)summary.uncompressed_bytes);
+    }
+    fflush(out);
+    return summary;
+}
+
+void ResultChannel::report_loop() {
+    std::vector<EntryResult> batch;
+    batch.reserve(ring.size());
+    std::string buf;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> l(m);
+            not_empty.wait(l, [this]() { return count > 0 || closed; });
+            if(count == 0) {
+                return;
+            }
+            size_t tail = (head + ring.size() - count) % ring.size();
+            for(size_t i=0; i<count; i++) {
+                batch.push_back(std::move(ring[tail]));
+                tail = (tail + 1) % ring.size();
+            }
+            count = 0;
+        }
+        not_full.notify_all();
+        buf.clear();
+        for(const auto &r : batch) {
+            summary.entries++;
+            if(r.success && r.header) {
+                summary.uncompressed_bytes += r.header->uncompressed_size;
+            } else {
+                summary.failed++;
+            }
+            format(r, buf);
+        }
+        batch.clear();
+        if(!buf.empty()) {
+            fwrite(buf.data(), 1, buf.size(), out);
+        }
+    }
+}
+
+void ResultChannel::format(const EntryResult &r, std::string &buf) {
+    switch(mode) {
+    case REPORT_DEFAULT:
+        buf += r.success ? "OK: " : "FAIL: ";
+        append_name(r, buf);
+        if(!r.success) {
+            buf += '\n';
+            buf += r.error;
+        }
+        buf += '\n';
+        break;
+    case REPORT_QUIET:
+        if(!r.success) {
+            buf += "FAIL: ";
+            append_name(r, buf);
+            buf += '\n';
+            buf += r.error;
+            buf += '\n';
+        }
+        break;
+    case REPORT_SUMMARY:
+        break;
+    case REPORT_JSONL: {
+        char sizes[128];
+        snprintf(sizes, sizeof(sizes), "\", \"compressed_size\": %llu, \"uncompressed_size\": %llu, \"ok\": %s",
+                 (unsigned long long)(r.header ? r.header->compressed_size : 0),
+                 (unsigned long long)(r.header ? r.header->uncompressed_size : 0),
+                 r.success ? "true" : "false");
+        buf += "{\"name\": \"";
+        if(r.prefix) {
+            std::string name;
+            append_name(r, name);
+            buf += json_escape(name);
+        } else {
+            buf += json_escape(r.header->fname);
+        }
+        buf += sizes;
+        if(!r.success) {
+            buf += ", \"error\": \"";
+            buf += json_escape(r.error);
+            buf += '"';
+        }
+        buf += "}\n";
+        break;
+    }
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include"zipdefs.h"
+
+#include<condition_variable>
+#include<cstdio>
+#include<mutex>
+#include<string>
+#include<thread>
+#include<vector>
+
+enum ReportMode {
+    REPORT_DEFAULT, // "OK: name" or "FAIL: name" and the reason for every entry.
+    REPORT_QUIET,   // Failures only.
+    REPORT_SUMMARY, // One line of totals at the end.
+    REPORT_JSONL,   // One JSON object per entry.
+};
+
+struct UnzipSummary {
+    uint64_t entries = 0;
+    uint64_t failed = 0;
+    uint64_t uncompressed_bytes = 0;
+    // Stopped early, the totals only cover the entries done before that.
+    bool cancelled = false;
+};
+
+/* The outcome of unpacking one entry. The header must stay alive until
+ * the channel is finished. Error is empty on success so successful
+ * entries do not allocate anything.
+ *
+ * In batch mode the prefix is the entry's output directory, printed in
+ * front of its name. A result without a header is about the archive in
+ * prefix as a whole, such as one that could not be opened. */
+struct EntryResult {
+    const localheader *header;
+    bool success;
+    std::string error;
+    const std::string *prefix = nullptr;
+};
+
+/* Passes entry results from the unpacking threads to a reporter thread
+ * through a ring of preallocated records. The reporter takes all
+ * pending records at once and writes them with a single call, so the
+ * output costs one write per batch rather than per entry. */
+class ResultChannel final {
+public:
+    ResultChannel(ReportMode mode, FILE *out, size_t capacity=1024);
+    ResultChannel(const ResultChannel &) = delete;
+    ResultChannel& operator=(const ResultChannel &) = delete;
+    ~ResultChannel();
+
+    /* Blocks if the reporter has fallen a full ring behind. */
+    void push(EntryResult &&r);
+
+    /* Waits until everything has been written and returns the totals. */
+    UnzipSummary finish();
+
+private:
+    void report_loop();
+    void format(const EntryResult &r, std::string &buf);
+
+    ReportMode mode;
+    FILE *out;
+    std::vector<EntryResult> ring;
+    size_t head = 0;  // Next slot to write.
+    size_t count = 0; // Records waiting.
+    bool closed = false;
+    std::mutex m;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    UnzipSummary summary;
+    std::thread reporter;
+};
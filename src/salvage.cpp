@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"salvage.h"
+#include"zipfile.h"
+#include"decompress.h"
+#include"arena.h"
+#include"mmapper.h"
+#include"workerpool.h"
+#include"stats.h"
+#include"trace.h"
+
+#include"portable_endian.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SALVAGE_SSE2
+#include<emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include<intrin.h>
+#endif
+
+#include<algorithm>
+#include<condition_variable>
+#include<cstring>
+#include<iterator>
+#include<memory>
+#include<mutex>
+#include<thread>
+#include<unordered_map>
+
+namespace {
+
+// Scanning is split into this many pieces per thread so that they even out.
+const constexpr size_t PIECES_PER_THREAD = 4;
+const constexpr uint64_t MIN_PIECE = 1024*1024;
+const constexpr uint32_t DESCRIPTOR_SIG = 0x08074b50;
+// No real writer produces longer names, so longer ones are noise.
+const constexpr uint16_t MAX_NAME_LENGTH = 4096;
+// Headers to look behind for the data descriptor of an entry.
+const constexpr size_t MAX_DESCRIPTOR_TRIES = 1024;
+
+uint32_t load32le(const unsigned char *p) noexcept {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+uint64_t load64le(const unsigned char *p) noexcept {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+#ifdef SALVAGE_SSE2
+unsigned lowest_bit(unsigned mask) noexcept {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+#endif
+
+struct LocalCandidate {
+    uint64_t offset;
+    uint64_t data_start;
+    localheader lh;
+};
+
+struct CentralCandidate {
+    uint64_t offset;
+    centralheader ch;
+};
+
+/* Parses a header at a signature, or returns false if it is not
+ * believable as one. */
+bool parse_local(const unsigned char *file, uint64_t size, uint64_t offset, LocalCandidate &c) {
+    if(size - offset < 4 + LOCAL_HEADER_SIZE) {
+        return false;
+    }
+    const unsigned char *fixed = file + offset + 4;
+    const uint16_t version = fixed[0];
+    const uint16_t method = le16toh(*reinterpret_cast<const uint16_t*>(fixed + 4));
+    const uint16_t name_size = le16toh(*reinterpret_cast<const uint16_t*>(fixed + 22));
+    const uint16_t extra_size = le16toh(*reinterpret_cast<const uint16_t*>(fixed + 24));
+    if(version > 63 || name_size == 0 || name_size > MAX_NAME_LENGTH ||
+       (method != ZIP_NO_COMPRESSION && method != ZIP_DEFLATE && method != ZIP_LZMA)) {
+        return false;
+    }
+    const uint64_t data_start = offset + 4 + LOCAL_HEADER_SIZE + name_size + extra_size;
+    if(data_start > size) {
+        return false;
+    }
+    const char *name = reinterpret_cast<const char*>(fixed + LOCAL_HEADER_SIZE);
+    if(memchr(name, '\0', name_size)) {
+        return false;
+    }
+    try {
+        c.lh = decode_local_entry(fixed, std::string(name, name_size),
+                                  std::string(name + name_size, extra_size));
+    } catch(const std::exception &) {
+        return false;
+    }
+    c.offset = offset;
+    c.data_start = data_start;
+    return true;
+}
+
+bool parse_central(const unsigned char *file, uint64_t size, uint64_t offset, CentralCandidate &c) {
+    if(size - offset < 4 + CENTRAL_HEADER_SIZE) {
+        return false;
+    }
+    const unsigned char *fixed = file + offset + 4;
+    const uint16_t name_size = le16toh(*reinterpret_cast<const uint16_t*>(fixed + 24));
+    const uint16_t extra_size = le16toh(*reinterpret_cast<const uint16_t*>(fixed + 26));
+    const uint16_t comment_size = le16toh(*reinterpret_cast<const uint16_t*>(fixed + 28));
+    if(name_size == 0 || name_size > MAX_NAME_LENGTH ||
+       size - offset - 4 - CENTRAL_HEADER_SIZE < (uint64_t)name_size + extra_size + comment_size) {
+        return false;
+    }
+    const char *name = reinterpret_cast<const char*>(fixed + CENTRAL_HEADER_SIZE);
+    try {
+        c.ch = decode_central_entry(fixed, std::string(name, name_size),
+                                    std::string(name + name_size, extra_size),
+                                    std::string(name + name_size + extra_size, comment_size));
+    } catch(const std::exception &) {
+        return false;
+    }
+    c.offset = offset;
+    return true;
+}
+
+/* For an entry with only its local header left, a central record that
+ * says no more than the local header does. */
+centralheader central_from_local(const localheader &lh, uint64_t offset) {
+    centralheader ch;
+    ch.version_made_by = 0;
+    ch.version_needed = lh.needed_version;
+    ch.bit_flag = lh.gp_bitflag;
+    ch.compression_method = lh.compression;
+    ch.last_mod_time = lh.last_mod_time;
+    ch.last_mod_date = lh.last_mod_date;
+    ch.crc32 = lh.crc32;
+    ch.compressed_size = lh.compressed_size;
+    ch.uncompressed_size = lh.uncompressed_size;
+    ch.disk_number_start = 0;
+    ch.internal_file_attributes = 0;
+    ch.external_file_attributes = 0;
+    ch.local_header_rel_offset = offset;
+    ch.fname = lh.fname;
+    return ch;
+}
+
+/* Looks for a data descriptor that ends at bound and whose compressed
+ * size matches the distance from the data start. Fills in lh. */
+bool find_descriptor(const unsigned char *file, uint64_t data_start, uint64_t bound, localheader &lh) {
+    for(bool signature : {true, false}) {
+        for(bool zip64 : {false, true}) {
+            const uint64_t length = (signature ? 4 : 0) + 4 + (zip64 ? 16 : 8);
+            if(bound - data_start < length) {
+                continue;
+            }
+            const uint64_t pos = bound - length;
+            const unsigned char *p = file + pos;
+            if(signature) {
+                if(load32le(p) != DESCRIPTOR_SIG) {
+                    continue;
+                }
+                p += 4;
+            }
+            const uint64_t compressed = zip64 ? load64le(p + 4) : load32le(p + 4);
+            if(compressed != pos - data_start) {
+                continue;
+            }
+            lh.crc32 = load32le(p);
+            lh.compressed_size = compressed;
+            lh.uncompressed_size = zip64 ? load64le(p + 12) : load32le(p + 8);
+            return true;
+        }
+    }
+    return false;
+}
+
+struct Recovered {
+    localheader lh;
+    centralheader ch;
+    uint64_t data_start;
+    std::string error; // Set if the entry is known to be unusable.
+};
+
+class Salvage final {
+public:
+    Salvage(const char *fname, const SalvageOptions &opts) :
+            zipfile(fname, "rb"),
+            size(zipfile.size()),
+            results(opts.report, opts.out),
+            pool(opts.threads ? opts.threads : std::thread::hardware_concurrency()) {
+    }
+
+    UnzipSummary run(const std::string &prefix) {
+        if(size == 0) {
+            return results.finish();
+        }
+        {
+            STATS_TIME(PHASE_OPEN);
+            map.reset(new MMapper(zipfile));
+            map->advise_sequential();
+        }
+        scan();
+        select();
+        run_all([this, &prefix](size_t i) { unpack(i, prefix); }, entries.size());
+        return results.finish();
+    }
+
+private:
+    /* Runs f(0) ... f(count-1) on the pool and waits for them all. */
+    template<typename F>
+    void run_all(F f, size_t count) {
+        std::mutex m;
+        std::condition_variable done;
+        size_t remaining = count;
+        for(size_t i=0; i<count; i++) {
+            pool.submit([&, i]() {
+                f(i);
+                std::lock_guard<std::mutex> l(m);
+                if(--remaining == 0) {
+                    done.notify_one();
+                }
+            });
+        }
+        std::unique_lock<std::mutex> l(m);
+        done.wait(l, [&remaining]() { return remaining == 0; });
+    }
+
+    void scan() {
+        TRACE_SPAN(span, "salvage_scan");
+        const unsigned char *file = *map;
+        const uint64_t piece = std::max(MIN_PIECE, size/(PIECES_PER_THREAD*pool.size()) + 1);
+        const size_t num_pieces = (size_t)((size + piece - 1)/piece);
+        std::vector<std::vector<LocalCandidate>> locals(num_pieces);
+        std::vector<std::vector<CentralCandidate>> centrals_found(num_pieces);
+        run_all([&](size_t i) {
+            STATS_TIME(PHASE_PARSE_LOCAL);
+            const uint64_t begin = i*piece;
+            // A signature may straddle the end of the piece.
+            const uint64_t end = std::min(size, begin + piece + 3);
+            std::vector<uint64_t> local_sigs, central_sigs;
+            find_records(file + begin, end - begin, local_sigs, central_sigs);
+            for(auto o : local_sigs) {
+                LocalCandidate c;
+                if(parse_local(file, size, begin + o, c)) {
+                    locals[i].push_back(std::move(c));
+                }
+            }
+            for(auto o : central_sigs) {
+                CentralCandidate c;
+                if(parse_central(file, size, begin + o, c)) {
+                    centrals_found[i].push_back(std::move(c));
+                }
+            }
+        }, num_pieces);
+        for(auto &v : locals) {
+            std::move(v.begin(), v.end(), std::back_inserter(candidates));
+        }
+        for(auto &v : centrals_found) {
+            for(auto &c : v) {
+                header_offsets.push_back(c.offset);
+                by_offset.emplace(c.ch.local_header_rel_offset, std::move(c.ch));
+            }
+        }
+        for(const auto &c : candidates) {
+            header_offsets.push_back(c.offset);
+        }
+        std::sort(header_offsets.begin(), header_offsets.end());
+    }
+
+    /* Picks the real entries among the candidates, in file order. */
+    void select() {
+        uint64_t next_free = 0;
+        for(size_t i=0; i<candidates.size(); i++) {
+            auto &c = candidates[i];
+            if(c.offset < next_free) {
+                // Inside the data of the previous entry, a stored archive perhaps.
+                continue;
+            }
+            Recovered r;
+            r.lh = std::move(c.lh);
+            r.data_start = c.data_start;
+            auto central = by_offset.find(c.offset);
+            const bool has_central = central != by_offset.end() && central->second.fname == r.lh.fname;
+            r.ch = has_central ? central->second : central_from_local(r.lh, c.offset);
+            const bool last = i + 1 == candidates.size();
+            if(r.lh.gp_bitflag & FLAG_DATA_DESCRIPTOR) {
+                if(has_central) {
+                    r.lh.crc32 = r.ch.crc32;
+                    r.lh.compressed_size = r.ch.compressed_size;
+                    r.lh.uncompressed_size = r.ch.uncompressed_size;
+                } else if(!find_descriptor_before_header(r)) {
+                    if(!last) {
+                        continue;
+                    }
+                    r.error = "Entry is truncated, its data descriptor is missing.";
+                    r.lh.compressed_size = 0;
+                }
+            }
+            if(r.error.empty() && r.lh.compressed_size > size - r.data_start) {
+                if(!last) {
+                    continue;
+                }
+                r.error = "Entry is truncated.";
+                r.lh.compressed_size = size - r.data_start;
+            }
+            r.ch.compressed_size = r.lh.compressed_size;
+            r.ch.uncompressed_size = r.lh.uncompressed_size;
+            r.ch.crc32 = r.lh.crc32;
+            next_free = r.data_start + r.lh.compressed_size;
+            entries.push_back(std::move(r));
+        }
+        candidates.clear();
+    }
+
+    /* The data and its descriptor end where the next header of any kind
+     * begins, or the file ends. A stored entry may have headers of its
+     * own inside, so later ones are tried too. */
+    bool find_descriptor_before_header(Recovered &r) {
+        auto next = std::upper_bound(header_offsets.begin(), header_offsets.end(), r.data_start);
+        for(size_t tries=0; tries<MAX_DESCRIPTOR_TRIES; tries++, next++) {
+            const uint64_t bound = next == header_offsets.end() ? size : *next;
+            if(find_descriptor(*map, r.data_start, bound, r.lh)) {
+                return true;
+            }
+            if(next == header_offsets.end()) {
+                break;
+            }
+        }
+        return false;
+    }
+
+    void unpack(size_t i, const std::string &prefix) {
+        auto &r = entries[i];
+        UnpackResult result{false, r.error};
+        if(r.error.empty()) {
+            // Entries go to whichever worker is free, so each is its own unit.
+            ArenaScope arena(false, 0);
+            result = unpack_entry(prefix, r.lh, r.ch, static_cast<const unsigned char*>(*map) + r.data_start,
+                                  r.lh.compressed_size);
+        }
+        STATS_COUNT(COUNT_ENTRIES, 1);
+        if(!result.success) {
+            STATS_COUNT(COUNT_FAILED, 1);
+        }
+        results.push(EntryResult{&r.lh, result.success, std::move(result.error)});
+    }
+
+    File zipfile;
+    uint64_t size;
+    std::unique_ptr<MMapper> map;
+    std::vector<LocalCandidate> candidates;
+    std::unordered_map<uint64_t, centralheader> by_offset;
+    std::vector<uint64_t> header_offsets;
+    // The results point here, so it must not change once extraction starts.
+    std::vector<Recovered> entries;
+    ResultChannel results;
+    // Last, so that the workers are gone before anything they use.
+    WorkerPool pool;
+};
+
+}
+
+void find_records(const unsigned char *data, size_t size,
+                  std::vector<uint64_t> &local, std::vector<uint64_t> &central) {
+    auto check = [&](size_t i) {
+        const uint32_t sig = load32le(data + i);
+        if(sig == LOCAL_SIG) {
+            local.push_back(i);
+        } else if(sig == CENTRAL_SIG) {
+            central.push_back(i);
+        }
+    };
+    if(size < 4) {
+        return;
+    }
+    size_t i = 0;
+#ifdef SALVAGE_SSE2
+    // Both signatures begin with "PK". Compares that for 16 positions at a
+    // time and looks at the rest only where it matches, which in
+    // compressed data is about once in 64 kB.
+    const __m128i p = _mm_set1_epi8('P');
+    const __m128i k = _mm_set1_epi8('K');
+    for(; i + 16 + 3 <= size; i += 16) {
+        const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, p),
+                                                                  _mm_cmpeq_epi8(second, k)));
+        while(mask) {
+            check(i + lowest_bit(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while(i + 4 <= size) {
+        auto hit = static_cast<const unsigned char*>(memchr(data + i, 'P', size - 3 - i));
+        if(!hit) {
+            break;
+        }
+        i = hit - data;
+        check(i);
+        i++;
+    }
+}
+
+UnzipSummary salvage_archive(const char *fname, const std::string &prefix, const SalvageOptions &opts) {
+    TRACE_SPAN(span, "salvage");
+    Salvage s(fname, opts);
+    return s.run(prefix);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include"report.h"
+
+#include<cstdio>
+#include<string>
+#include<vector>
+
+struct SalvageOptions {
+    ReportMode report = REPORT_DEFAULT;
+    FILE *out = stdout;
+    unsigned threads = 0; // Zero for one per CPU.
+};
+
+/* Recovers what it can from an archive whose end record or central
+ * directory is missing or broken, such as a partial download. Instead of
+ * trusting the directory it scans the whole file for local headers. A
+ * candidate header must be plausible and its data must fit in the file
+ * to count as an entry. Candidates inside the data of an earlier entry
+ * are skipped.
+ *
+ * Whatever is left of the central directory is used for permissions and
+ * entry types, and for the sizes of entries with data descriptors. For
+ * entries without a central record the data descriptor is looked for
+ * right before the next header. Entries without a central record are
+ * extracted as plain files and directories.
+ *
+ * Scanning and extraction run on a worker pool. Every entry is checked
+ * against its CRC as usual. Entries are reported as they finish, so not
+ * in archive order. */
+UnzipSummary salvage_archive(const char *fname, const std::string &prefix, const SalvageOptions &opts=SalvageOptions());
+
+/* Appends the offsets of every local and central header signature in the
+ * buffer, in order. Exposed for the benchmarks. */
+void find_records(const unsigned char *data, size_t size,
+                  std::vector<uint64_t> &local, std::vector<uint64_t> &central);
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"stats.h"
+#include"trace.h"
+
+#include<algorithm>
+#include<atomic>
+#include<cstring>
+#include<mutex>
+#include<vector>
+
+namespace {
+
+const char *phase_names[NUM_PHASES] = {
+    "open",
+    "parse_local",
+    "parse_central",
+    "mkdir",
+    "decode",
+    "crc",
+    "write",
+    "rename",
+    "metadata",
+};
+
+const char *counter_names[NUM_COUNTERS] = {
+    "entries",
+    "failed",
+    "bytes_in",
+    "bytes_out",
+    "stat",
+    "mkdir",
+    "open",
+    "fwrite",
+    "rename",
+    "unlink",
+    "chmod",
+    "chown",
+    "utime",
+    "symlink",
+    "mknod",
+    "decoder_allocs",
+    "decoder_bytes",
+    "mmap",
+    "fadvise",
+    "prefetch_bytes",
+    "prefetch_stalls",
+    "cache_hits",
+    "cache_misses",
+};
+
+const char *gauge_names[NUM_GAUGES] = {
+    "decoder_peak_bytes",
+    "prefetch_depth",
+};
+
+/* Only the owning thread writes these, so plain loads and stores are
+ * enough. They are atomic only so that reports can read them while the
+ * owner is still running. */
+struct ThreadStats {
+    std::atomic<uint64_t> phase_ns[NUM_PHASES];
+    std::atomic<uint64_t> phase_calls[NUM_PHASES];
+    std::atomic<uint64_t> counters[NUM_COUNTERS];
+    std::atomic<uint64_t> gauges[NUM_GAUGES];
+
+    ThreadStats() noexcept {
+        clear();
+    }
+
+    void clear() noexcept {
+        for(auto &i : phase_ns) i.store(0, std::memory_order_relaxed);
+        for(auto &i : phase_calls) i.store(0, std::memory_order_relaxed);
+        for(auto &i : counters) i.store(0, std::memory_order_relaxed);
+        for(auto &i : gauges) i.store(0, std::memory_order_relaxed);
+    }
+
+    void add_to(StatsSnapshot &s) const noexcept {
+        for(int i=0; i<NUM_PHASES; i++) {
+            s.phase_ns[i] += phase_ns[i].load(std::memory_order_relaxed);
+            s.phase_calls[i] += phase_calls[i].load(std::memory_order_relaxed);
+        }
+        for(int i=0; i<NUM_COUNTERS; i++) {
+            s.counters[i] += counters[i].load(std::memory_order_relaxed);
+        }
+        for(int i=0; i<NUM_GAUGES; i++) {
+            s.gauges[i] = std::max(s.gauges[i], gauges[i].load(std::memory_order_relaxed));
+        }
+    }
+};
+
+void bump(std::atomic<uint64_t> &a, uint64_t amount) noexcept {
+    a.store(a.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+class Registry final {
+public:
+    void attach(ThreadStats *t) {
+        std::lock_guard<std::mutex> l(m);
+        live.push_back(t);
+    }
+
+    void detach(ThreadStats *t) noexcept {
+        std::lock_guard<std::mutex> l(m);
+        t->add_to(retired);
+        live.erase(std::remove(live.begin(), live.end(), t), live.end());
+    }
+
+    StatsSnapshot snapshot() noexcept {
+        std::lock_guard<std::mutex> l(m);
+        StatsSnapshot s = retired;
+        for(const auto *t : live) {
+            t->add_to(s);
+        }
+        return s;
+    }
+
+    void reset() noexcept {
+        std::lock_guard<std::mutex> l(m);
+        memset(&retired, 0, sizeof(retired));
+        for(auto *t : live) {
+            t->clear();
+        }
+    }
+
+private:
+    std::mutex m;
+    std::vector<ThreadStats*> live;
+    StatsSnapshot retired{};
+};
+
+Registry& registry() {
+    // Leaked on purpose so threads exiting after main can still detach.
+    static Registry *r = new Registry();
+    return *r;
+}
+
+struct ThreadSlot {
+    ThreadStats stats;
+    ThreadSlot() { registry().attach(&stats); }
+    ~ThreadSlot() { registry().detach(&stats); }
+};
+
+ThreadStats& local() noexcept {
+    static thread_local ThreadSlot slot;
+    return slot.stats;
+}
+
+double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+}
+
+bool stats_enabled() noexcept {
+#ifdef ZIP_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void stats_add(StatCounter c, uint64_t amount) noexcept {
+    bump(local().counters[c], amount);
+}
+
+void stats_max(StatGauge g, uint64_t value) noexcept {
+    auto &a = local().gauges[g];
+    if(value > a.load(std::memory_order_relaxed)) {
+        a.store(value, std::memory_order_relaxed);
+    }
+}
+
+void stats_end_phase(StatPhase p,
+        std::chrono::steady_clock::time_point start,
+        std::chrono::steady_clock::time_point end) {
+    auto &t = local();
+    bump(t.phase_ns[p], std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    bump(t.phase_calls[p], 1);
+    if(trace_active()) {
+        trace_span(phase_names[p], start, end);
+    }
+}
+
+StatsSnapshot stats_snapshot() noexcept {
+    return registry().snapshot();
+}
+
+void stats_reset() noexcept {
+    registry().reset();
+}
+
+void stats_print_table(FILE *out, const StatsSnapshot &s, double wall_seconds) {
+    if(!stats_enabled()) {
+        fprintf(out, "Statistics were disabled at build time.\n");
+        return;
+    }
+    const double wall_ms = wall_seconds*1000;
+    fprintf(out, "%-20s %12s %12s %8s\n", "phase", "calls", "ms", "% wall");
+    for(int i=0; i<NUM_PHASES; i++) {
+        fprintf(out, "%-20s %12llu %12.2f %8.1f\n", phase_names[i],
+                (unsigned long long)s.phase_calls[i], ms(s.phase_ns[i]),
+                wall_ms > 0 ? 100*ms(s.phase_ns[i])/wall_ms : 0.0);
+    }
+    fprintf(out, "%-20s %12s %12.2f\n\n", "wall", "", wall_ms);
+    fprintf(out, "%-20s %12s\n", "counter", "value");
+    for(int i=0; i<NUM_COUNTERS; i++) {
+        fprintf(out, "%-20s %12llu\n", counter_names[i], (unsigned long long)s.counters[i]);
+    }
+    for(int i=0; i<NUM_GAUGES; i++) {
+        fprintf(out, "%-20s %12llu\n", gauge_names[i], (unsigned long long)s.gauges[i]);
+    }
+}
+
+void stats_print_json(FILE *out, const StatsSnapshot &s, double wall_seconds) {
+    fprintf(out, "{\n  \"enabled\": %s,\n  \"wall_ns\": %.0f,\n  \"phases\": {",
+            stats_enabled() ? "true" : "false", wall_seconds*1e9);
+    for(int i=0; i<NUM_PHASES; i++) {
+        fprintf(out, "%s\n    \"%s\": {\"calls\": %llu, \"ns\": %llu}", i == 0 ? "" : ",",
+                phase_names[i], (unsigned long long)s.phase_calls[i], (unsigned long long)s.phase_ns[i]);
+    }
+    fprintf(out, "\n  },\n  \"counters\": {");
+    for(int i=0; i<NUM_COUNTERS; i++) {
+        fprintf(out, "%s\n    \"%s\": %llu", i == 0 ? "" : ",",
+                counter_names[i], (unsigned long long)s.counters[i]);
+    }
+    fprintf(out, "\n  },\n  \"gauges\": {");
+    for(int i=0; i<NUM_GAUGES; i++) {
+        fprintf(out, "%s\n    \"%s\": %llu", i == 0 ? "" : ",",
+                gauge_names[i], (unsigned long long)s.gauges[i]);
+    }
+    fprintf(out, "\n  }\n}\n");
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Counters and cumulative timers for the phases of extraction.
+ *
+ * Every thread gets its own set of counters so updating them does not
+ * need locking or atomic read-modify-write operations. They are summed
+ * when a report is made. Instrumentation points use the STATS_ macros,
+ * which expand to nothing unless the library is built with ZIP_STATS
+ * defined (meson option 'stats'). */
+
+#include<chrono>
+#include<cstdint>
+#include<cstdio>
+
+enum StatPhase {
+    PHASE_OPEN,
+    PHASE_PARSE_LOCAL,
+    PHASE_PARSE_CENTRAL,
+    PHASE_MKDIR,
+    PHASE_DECODE,
+    PHASE_CRC,
+    PHASE_WRITE,
+    PHASE_RENAME,
+    PHASE_METADATA,
+    NUM_PHASES,
+};
+
+enum StatCounter {
+    COUNT_ENTRIES,
+    COUNT_FAILED,
+    COUNT_BYTES_IN,
+    COUNT_BYTES_OUT,
+    COUNT_STAT,
+    COUNT_MKDIR,
+    COUNT_OPEN,
+    COUNT_FWRITE,
+    COUNT_RENAME,
+    COUNT_UNLINK,
+    COUNT_CHMOD,
+    COUNT_CHOWN,
+    COUNT_UTIME,
+    COUNT_SYMLINK,
+    COUNT_MKNOD,
+    COUNT_DECODER_ALLOCS,
+    COUNT_DECODER_BYTES,
+    COUNT_MMAP,
+    COUNT_FADVISE,
+    COUNT_PREFETCH_BYTES,
+    COUNT_PREFETCH_STALLS,
+    COUNT_CACHE_HITS,
+    COUNT_CACHE_MISSES,
+    NUM_COUNTERS,
+};
+
+/* Values where the report shows the maximum instead of the sum. */
+enum StatGauge {
+    GAUGE_DECODER_PEAK,
+    GAUGE_PREFETCH_DEPTH,
+    NUM_GAUGES,
+};
+
+struct StatsSnapshot {
+    uint64_t phase_ns[NUM_PHASES];
+    uint64_t phase_calls[NUM_PHASES];
+    uint64_t counters[NUM_COUNTERS];
+    uint64_t gauges[NUM_GAUGES];
+};
+
+/* False if the library was built without instrumentation, in which case
+ * all numbers stay at zero. */
+bool stats_enabled() noexcept;
+
+void stats_add(StatCounter c, uint64_t amount) noexcept;
+void stats_max(StatGauge g, uint64_t value) noexcept;
+/* Also records a trace span if tracing is active. */
+void stats_end_phase(StatPhase p,
+        std::chrono::steady_clock::time_point start,
+        std::chrono::steady_clock::time_point end);
+
+/* Totals over all threads, including ones that have already exited. */
+StatsSnapshot stats_snapshot() noexcept;
+void stats_reset() noexcept;
+
+void stats_print_table(FILE *out, const StatsSnapshot &s, double wall_seconds);
+void stats_print_json(FILE *out, const StatsSnapshot &s, double wall_seconds);
+
+class PhaseTimer final {
+public:
+    explicit PhaseTimer(StatPhase p) noexcept : phase(p), start(std::chrono::steady_clock::now()) {}
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer& operator=(const PhaseTimer &) = delete;
+    ~PhaseTimer() {
+        stats_end_phase(phase, start, std::chrono::steady_clock::now());
+    }
+
+private:
+    StatPhase phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define STATS_CONCAT_(a, b) a ## b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+
+#ifdef ZIP_STATS
+#define STATS_COUNT(counter, amount) stats_add(counter, amount)
+#define STATS_MAX(gauge, value) stats_max(gauge, value)
+#define STATS_TIME(phase) PhaseTimer STATS_CONCAT(stats_timer_, __LINE__)(phase)
+#else
+#define STATS_COUNT(counter, amount) do {} while(0)
+#define STATS_MAX(gauge, value) do {} while(0)
+#define STATS_TIME(phase) do {} while(0)
+#endif
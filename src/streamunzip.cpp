@@ -0,0 +1,519 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"streamunzip.h"
+#include"decompress.h"
+#include"fileutils.h"
+#include"utils.h"
+#include"arena.h"
+#include"stats.h"
+#include"trace.h"
+
+#include"portable_endian.h"
+#include<zlib.h>
+
+#ifdef _WIN32
+#include<io.h>
+#else
+#include<lzma.h>
+#include<unistd.h>
+#endif
+
+#include<algorithm>
+#include<cerrno>
+#include<cstring>
+#include<memory>
+#include<stdexcept>
+#include<unordered_map>
+#include<vector>
+
+namespace {
+
+const constexpr size_t READ_SIZE = 1024*1024;
+const constexpr size_t CHUNK = 1024*1024;
+const constexpr uint64_t UNKNOWN_SIZE = (uint64_t)-1;
+const constexpr uint32_t DESCRIPTOR_SIG = 0x08074b50;
+// LZMA data ends with an end of stream marker.
+const constexpr uint16_t FLAG_LZMA_EOS = 1<<1;
+
+/* Buffered forward-only reading from a file descriptor. */
+class InputStream final {
+public:
+    explicit InputStream(int fd) : fd(fd), buf(READ_SIZE) {}
+
+    /* Points p to the buffered bytes, reading more if there are none.
+     * Returns 0 only at the end of the input. */
+    size_t available(const unsigned char *&p) {
+        if(pos == end) {
+            fill();
+        }
+        p = buf.data() + pos;
+        return end - pos;
+    }
+
+    void consume(size_t n) noexcept {
+        pos += n;
+        consumed += n;
+    }
+
+    /* Bytes consumed since the start, the offset in the archive. */
+    uint64_t offset() const noexcept { return consumed; }
+
+    void read(void *out, size_t n) {
+        unsigned char *o = static_cast<unsigned char*>(out);
+        while(n > 0) {
+            const unsigned char *p;
+            const size_t have = std::min(available(p), n);
+            if(have == 0) {
+                throw std::runtime_error("Archive ends unexpectedly.");
+            }
+            memcpy(o, p, have);
+            consume(have);
+            o += have;
+            n -= have;
+        }
+    }
+
+    std::string read_string(size_t n) {
+        std::string s(n, '\0');
+        read(&s[0], n);
+        return s;
+    }
+
+    uint32_t read32le() {
+        uint32_t v;
+        read(&v, sizeof(v));
+        return le32toh(v);
+    }
+
+    uint64_t read64le() {
+        uint64_t v;
+        read(&v, sizeof(v));
+        return le64toh(v);
+    }
+
+    void skip(uint64_t n) {
+        while(n > 0) {
+            const unsigned char *p;
+            const size_t have = (size_t)std::min<uint64_t>(available(p), n);
+            if(have == 0) {
+                throw std::runtime_error("Archive ends unexpectedly.");
+            }
+            consume(have);
+            n -= have;
+        }
+    }
+
+    /* Reads until the end so that the writer does not get a broken pipe. */
+    void drain() {
+        const unsigned char *p;
+        while(size_t have = available(p)) {
+            consume(have);
+        }
+    }
+
+private:
+    void fill() {
+        pos = end = 0;
+        while(true) {
+#ifdef _WIN32
+            const int r = ::_read(fd, buf.data(), (unsigned)buf.size());
+#else
+            const ssize_t r = ::read(fd, buf.data(), buf.size());
+#endif
+            if(r < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                throw_system("Could not read archive:");
+            }
+            end = (size_t)r;
+            return;
+        }
+    }
+
+    int fd;
+    std::vector<unsigned char> buf;
+    size_t pos = 0;
+    size_t end = 0;
+    uint64_t consumed = 0;
+};
+
+/* How far one entry's data has got. */
+struct DataProgress {
+    bool started = false;
+    bool finished = false; // Data and descriptor have been read.
+    uint64_t compressed = 0;
+    uint64_t uncompressed = 0;
+    uint32_t crc = crc32(0, Z_NULL, 0);
+};
+
+void emit(DataProgress &prog, const unsigned char *data, size_t size, FILE *out) {
+    if(size == 0) {
+        return;
+    }
+    {
+        STATS_TIME(PHASE_CRC);
+        prog.crc = crc32(prog.crc, data, (uInt)size);
+    }
+    prog.uncompressed += size;
+    if(out) {
+        STATS_TIME(PHASE_WRITE);
+        STATS_COUNT(COUNT_FWRITE, 1);
+        STATS_COUNT(COUNT_BYTES_OUT, size);
+        if(fwrite(data, 1, size, out) != size) {
+            throw_system("Could not write to file:");
+        }
+    }
+}
+
+/* Gives the decoder as much input as there is, up to the limit. */
+size_t next_input(InputStream &in, const DataProgress &prog, uint64_t limit, const unsigned char *&p) {
+    const size_t have = in.available(p);
+    if(have == 0) {
+        throw std::runtime_error("Archive ends in the middle of an entry.");
+    }
+    return (size_t)std::min<uint64_t>(have, limit - prog.compressed);
+}
+
+void copy_stored(InputStream &in, uint64_t limit, FILE *out, DataProgress &prog) {
+    while(prog.compressed < limit) {
+        const unsigned char *p;
+        const size_t n = next_input(in, prog, limit, p);
+        emit(prog, p, n, out);
+        in.consume(n);
+        prog.compressed += n;
+    }
+}
+
+void copy_deflated(InputStream &in, uint64_t limit, FILE *out, DataProgress &prog) {
+    DecoderArena &arena = thread_arena();
+    arena.begin_entry();
+    unsigned char *buf = static_cast<unsigned char*>(arena.allocate(CHUNK));
+    if(!buf) {
+        throw std::runtime_error("Out of decoder memory.");
+    }
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    strm.zalloc = DecoderArena::zalloc;
+    strm.zfree = DecoderArena::zfree;
+    strm.opaque = &arena;
+    if(inflateInit2(&strm, -15) != Z_OK) {
+        throw std::runtime_error("Could not init zlib.");
+    }
+    std::unique_ptr<z_stream, int (*)(z_stream_s*)> zcloser(&strm, inflateEnd);
+    while(true) {
+        if(strm.avail_in == 0) {
+            if(prog.compressed == limit) {
+                throw std::runtime_error("Compressed data ends before the deflate stream does.");
+            }
+            const unsigned char *p;
+            const size_t n = std::min<size_t>(next_input(in, prog, limit, p), 1024*1024*1024);
+            strm.next_in = const_cast<unsigned char*>(p); // zlib header is const-broken
+            strm.avail_in = (uInt)n;
+        }
+        const uInt before = strm.avail_in;
+        strm.next_out = buf;
+        strm.avail_out = CHUNK;
+        int ret;
+        {
+            STATS_TIME(PHASE_DECODE);
+            ret = inflate(&strm, Z_NO_FLUSH);
+        }
+        in.consume(before - strm.avail_in);
+        prog.compressed += before - strm.avail_in;
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            throw std::runtime_error(strm.msg ? strm.msg : "Decompression failed.");
+        }
+        emit(prog, buf, CHUNK - strm.avail_out, out);
+        if(ret == Z_STREAM_END) {
+            return;
+        }
+    }
+}
+
+#ifdef _WIN32
+void copy_lzma(InputStream &, uint64_t, FILE *, DataProgress &) {
+    throw std::runtime_error("LZMA not supported on Windows.");
+}
+#else
+void copy_lzma(InputStream &in, uint64_t limit, FILE *out, DataProgress &prog) {
+    DecoderArena &arena = thread_arena();
+    arena.begin_entry();
+    unsigned char *buf = static_cast<unsigned char*>(arena.allocate(CHUNK));
+    if(!buf) {
+        throw std::runtime_error("Out of decoder memory.");
+    }
+    const lzma_allocator allocator = {DecoderArena::lzma_alloc, DecoderArena::lzma_free, &arena};
+    // Two bytes of version, the size of the properties and the properties.
+    unsigned char header[4];
+    if(limit < sizeof(header)) {
+        throw std::runtime_error("LZMA header is truncated.");
+    }
+    in.read(header, sizeof(header));
+    prog.compressed += sizeof(header);
+    const uint16_t properties_size = le16toh(*reinterpret_cast<const uint16_t*>(header + 2));
+    if(limit - prog.compressed < properties_size) {
+        throw std::runtime_error("LZMA header is truncated.");
+    }
+    const std::string properties = in.read_string(properties_size);
+    prog.compressed += properties_size;
+    lzma_filter filter[2];
+    filter[0].id = LZMA_FILTER_LZMA1;
+    filter[1].id = LZMA_VLI_UNKNOWN;
+    if(lzma_properties_decode(&filter[0], &allocator,
+                              reinterpret_cast<const uint8_t*>(properties.data()), properties_size) != LZMA_OK) {
+        throw std::runtime_error("Could not decode LZMA properties.");
+    }
+    lzma_stream strm = LZMA_STREAM_INIT;
+    strm.allocator = &allocator;
+    lzma_ret ret = lzma_raw_decoder(&strm, &filter[0]);
+    arena.deallocate(filter[0].options);
+    if(ret != LZMA_OK) {
+        throw std::runtime_error("Could not initialize LZMA decoder.");
+    }
+    std::unique_ptr<lzma_stream, void(*)(lzma_stream*)> lcloser(&strm, lzma_end);
+    while(true) {
+        if(strm.avail_in == 0) {
+            if(prog.compressed == limit) {
+                // Without an end marker the data simply runs out.
+                return;
+            }
+            const unsigned char *p;
+            strm.avail_in = next_input(in, prog, limit, p);
+            strm.next_in = p;
+        }
+        const size_t before = strm.avail_in;
+        strm.next_out = buf;
+        strm.avail_out = CHUNK;
+        {
+            STATS_TIME(PHASE_DECODE);
+            ret = lzma_code(&strm, LZMA_RUN);
+        }
+        in.consume(before - strm.avail_in);
+        prog.compressed += before - strm.avail_in;
+        if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
+            throw std::runtime_error("Decompression failed.");
+        }
+        emit(prog, buf, CHUNK - strm.avail_out, out);
+        if(ret == LZMA_STREAM_END) {
+            return;
+        }
+    }
+}
+#endif
+
+bool has_zip64_extra(const std::string &extra) noexcept {
+    size_t pos = 0;
+    while(pos + 4 <= extra.size()) {
+        const uint16_t id = le16toh(*reinterpret_cast<const uint16_t*>(&extra[pos]));
+        const uint16_t size = le16toh(*reinterpret_cast<const uint16_t*>(&extra[pos+2]));
+        if(id == ZIP_EXTRA_ZIP64) {
+            return true;
+        }
+        pos += 4 + size;
+    }
+    return false;
+}
+
+/* Reads the entry's data and data descriptor, if it has one, checks the
+ * CRC and fills in the sizes and CRC of lh from the descriptor. */
+void read_entry_data(InputStream &in, localheader &lh, FILE *out, DataProgress &prog) {
+    const bool descriptor = lh.gp_bitflag & FLAG_DATA_DESCRIPTOR;
+    const uint64_t limit = descriptor ? UNKNOWN_SIZE : lh.compressed_size;
+    STATS_COUNT(COUNT_BYTES_IN, descriptor ? 0 : limit);
+    prog.started = true;
+    switch(lh.compression) {
+    case ZIP_NO_COMPRESSION: copy_stored(in, limit, out, prog); break;
+    case ZIP_DEFLATE: copy_deflated(in, limit, out, prog); break;
+    case ZIP_LZMA: copy_lzma(in, limit, out, prog); break;
+    default: throw std::runtime_error("Unsupported compression format.");
+    }
+    if(descriptor) {
+        STATS_COUNT(COUNT_BYTES_IN, prog.compressed);
+        uint32_t crc = in.read32le();
+        if(crc == DESCRIPTOR_SIG) {
+            // The signature is optional.
+            crc = in.read32le();
+        }
+        lh.crc32 = crc;
+        if(has_zip64_extra(lh.extra)) {
+            lh.compressed_size = in.read64le();
+            lh.uncompressed_size = in.read64le();
+        } else {
+            lh.compressed_size = in.read32le();
+            lh.uncompressed_size = in.read32le();
+        }
+        if(lh.compressed_size != prog.compressed) {
+            throw std::runtime_error("Data descriptor does not match the data.");
+        }
+    } else if(prog.compressed != limit) {
+        throw std::runtime_error("Compressed data is longer than the compressed stream.");
+    }
+    prog.finished = true;
+    if(prog.crc != lh.crc32) {
+        throw std::runtime_error("CRC32 checksum is invalid.");
+    }
+    if(prog.uncompressed != lh.uncompressed_size) {
+        throw std::runtime_error("Uncompressed size does not match the header.");
+    }
+}
+
+struct StreamedEntry {
+    localheader lh;
+    uint64_t offset;
+    std::string error; // Empty if the data was extracted.
+};
+
+StreamedEntry extract_entry(InputStream &in, uint64_t offset, const std::string &prefix, const UnzipOptions &opts) {
+    unsigned char fixed[LOCAL_HEADER_SIZE];
+    StreamedEntry e;
+    e.offset = offset;
+    {
+        STATS_TIME(PHASE_PARSE_LOCAL);
+        in.read(fixed, sizeof(fixed));
+        auto fname = in.read_string(le16toh(*reinterpret_cast<const uint16_t*>(fixed + 22)));
+        auto extra = in.read_string(le16toh(*reinterpret_cast<const uint16_t*>(fixed + 24)));
+        e.lh = decode_local_entry(fixed, std::move(fname), std::move(extra));
+    }
+    localheader &lh = e.lh;
+    TRACE_SPAN(span, "stream_entry");
+    const bool descriptor = lh.gp_bitflag & FLAG_DATA_DESCRIPTOR;
+    if(descriptor && (lh.gp_bitflag & FLAG_ENCRYPTED || lh.compression == ZIP_NO_COMPRESSION ||
+                      (lh.compression == ZIP_LZMA && !(lh.gp_bitflag & FLAG_LZMA_EOS)))) {
+        throw std::runtime_error("Can not find where the data of " + lh.fname +
+                                 " ends without its size, archive can not be streamed.");
+    }
+    DataProgress prog;
+    try {
+        if(lh.gp_bitflag & FLAG_ENCRYPTED) {
+            throw std::runtime_error("This file is encrypted. Encrypted ZIP archives are not supported.");
+        }
+        const std::string ofname = entry_path(prefix, lh.fname);
+        if(lh.fname.back() == '/') {
+            {
+                STATS_TIME(PHASE_MKDIR);
+                mkdirp(ofname);
+            }
+            read_entry_data(in, lh, nullptr, prog);
+        } else {
+            write_new_file(ofname, opts.drop_cache, [&](FILE *f) {
+                read_entry_data(in, lh, f, prog);
+            });
+        }
+    } catch(const std::exception &err) {
+        e.error = err.what();
+    }
+    if(!prog.finished) {
+        // Get to the next entry.
+        if(!descriptor) {
+            in.skip(lh.compressed_size - prog.compressed);
+        } else if(!prog.started) {
+            try {
+                read_entry_data(in, lh, nullptr, prog);
+            } catch(const std::exception &err) {
+                if(!prog.finished) {
+                    throw std::runtime_error("Lost track of the data of " + lh.fname + ": " + err.what());
+                }
+                // The next entry is found, only this one is bad.
+                e.error += std::string(" ") + err.what();
+            }
+        } else {
+            throw std::runtime_error("Lost track of the data of " + lh.fname + ": " + e.error);
+        }
+    }
+    return e;
+}
+
+}
+
+UnzipSummary unzip_stream(int fd, const std::string &prefix, const UnzipOptions &opts) {
+    TRACE_SPAN(span, "unzip_stream");
+    ArenaScope arena(opts.huge_pages, opts.decoder_memory);
+    InputStream in(fd);
+    std::vector<StreamedEntry> entries;
+    std::vector<centralheader> centrals;
+    while(true) {
+        const uint64_t offset = in.offset();
+        const unsigned char *p;
+        if(in.available(p) == 0) {
+            throw std::runtime_error("Archive ends before its central directory.");
+        }
+        const uint32_t sig = in.read32le();
+        if(sig == LOCAL_SIG) {
+            entries.push_back(extract_entry(in, offset, prefix, opts));
+        } else if(sig == CENTRAL_SIG) {
+            STATS_TIME(PHASE_PARSE_CENTRAL);
+            unsigned char fixed[CENTRAL_HEADER_SIZE];
+            in.read(fixed, sizeof(fixed));
+            auto fname = in.read_string(le16toh(*reinterpret_cast<const uint16_t*>(fixed + 24)));
+            auto extra = in.read_string(le16toh(*reinterpret_cast<const uint16_t*>(fixed + 26)));
+            auto comment = in.read_string(le16toh(*reinterpret_cast<const uint16_t*>(fixed + 28)));
+            centrals.push_back(decode_central_entry(fixed, std::move(fname), std::move(extra), std::move(comment)));
+        } else if(sig == ZIP64_CENTRAL_END_SIG || sig == CENTRAL_END_SIG) {
+            // Nothing in the end records is needed any more.
+            in.drain();
+            break;
+        } else {
+            throw std::runtime_error("Zip file broken, unexpected data between entries.");
+        }
+    }
+
+    std::unordered_map<uint64_t, size_t> by_offset;
+    for(size_t i=0; i<entries.size(); i++) {
+        by_offset[entries[i].offset] = i;
+    }
+    std::vector<bool> seen(entries.size(), false);
+    ResultChannel results(opts.report, opts.out);
+    auto push = [&results](const localheader &lh, UnpackResult &&r) {
+        STATS_COUNT(COUNT_ENTRIES, 1);
+        if(!r.success) {
+            STATS_COUNT(COUNT_FAILED, 1);
+        }
+        results.push(EntryResult{&lh, r.success, std::move(r.error)});
+    };
+    auto remove_output = [&prefix](const StreamedEntry &e) {
+        if(e.error.empty() && e.lh.fname.back() != '/') {
+            STATS_COUNT(COUNT_UNLINK, 1);
+            unlink(entry_path(prefix, e.lh.fname).c_str());
+        }
+    };
+    for(const auto &ch : centrals) {
+        auto it = by_offset.find(ch.local_header_rel_offset);
+        if(it == by_offset.end() || seen[it->second]) {
+            throw std::runtime_error("Zip file broken, central directory has an entry that was not in the archive: " + ch.fname);
+        }
+        seen[it->second] = true;
+        const StreamedEntry &e = entries[it->second];
+        if(!e.error.empty()) {
+            push(e.lh, UnpackResult{false, e.error});
+        } else if(ch.crc32 != e.lh.crc32 || ch.compressed_size != e.lh.compressed_size ||
+                  ch.uncompressed_size != e.lh.uncompressed_size || ch.fname != e.lh.fname) {
+            remove_output(e);
+            push(e.lh, UnpackResult{false, "Entry does not match its central directory record."});
+        } else {
+            push(e.lh, finish_streamed_entry(prefix, e.lh, ch));
+        }
+    }
+    for(size_t i=0; i<entries.size(); i++) {
+        if(!seen[i]) {
+            remove_output(entries[i]);
+            push(entries[i].lh, UnpackResult{false, "Entry is not in the central directory."});
+        }
+    }
+    return results.finish();
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include"zipfile.h"
+
+#include<string>
+
+/* Extracts an archive while reading it front to back from a file
+ * descriptor, such as a pipe or stdin, without seeking or mapping it.
+ * Entries are written out as their data arrives, so extracting overlaps
+ * with downloading.
+ *
+ * Local headers do not say what kind of entry they are. Every entry is
+ * first written out as a regular file, or as a directory if its name
+ * ends in a slash. Once the central directory at the end has arrived,
+ * each entry is checked against its record there. Then it is turned
+ * into a symbolic link or a device if that is what it is, and given its
+ * permissions. Results are reported at that point.
+ *
+ * Entries with their sizes in a data descriptor after the data are
+ * decoded until their compressed stream ends. Stored entries, and LZMA
+ * without an end marker, have no such end. They stop the extraction, as
+ * does any other damage that loses track of where the next entry starts.
+ * Entries extracted before that are left in place.
+ *
+ * Of the options only report, out and drop_cache apply. */
+UnzipSummary unzip_stream(int fd, const std::string &prefix, const UnzipOptions &opts=UnzipOptions());
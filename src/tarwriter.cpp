@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"tarwriter.h"
+#include"utils.h"
+#include"stats.h"
+#include<portable_endian.h>
+#include<zlib.h>
+
+#ifndef _WIN32
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<sys/uio.h>
+#include<unistd.h>
+#endif
+
+#include<algorithm>
+#include<cerrno>
+#include<cstdio>
+#include<cstring>
+#include<exception>
+#include<stdexcept>
+
+namespace {
+
+const constexpr size_t BLOCK = 512;
+const constexpr uint64_t MAX_OCTAL_SIZE = 077777777777ull;
+
+std::string octal(uint64_t value, size_t width) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%0*llo", (int)(width - 1), (unsigned long long)value);
+    return std::string(buf, width - 1);
+}
+
+void put(char *block, size_t offset, const std::string &s, size_t width) {
+    memcpy(block + offset, s.data(), std::min(s.size(), width));
+}
+
+/* One "length key=value\n" record where the length counts itself. */
+void pax_record(std::string &out, const char *key, const std::string &value) {
+    const size_t body = 1 + strlen(key) + 1 + value.size() + 1;
+    size_t len = body + 1;
+    while(std::to_string(len).size() + body != len) {
+        len = std::to_string(len).size() + body;
+    }
+    out += std::to_string(len);
+    out += ' ';
+    out += key;
+    out += '=';
+    out += value;
+    out += '\n';
+}
+
+/* Ustar keeps long names as a prefix and a name split at a slash. */
+bool split_name(const std::string &full, std::string &prefix, std::string &name) {
+    if(full.size() <= 100) {
+        prefix.clear();
+        name = full;
+        return true;
+    }
+    auto slash = full.find('/', full.size() > 101 ? full.size() - 101 : 0);
+    while(slash != std::string::npos) {
+        if(slash <= 155 && full.size() - slash - 1 <= 100 && full.size() - slash - 1 > 0) {
+            prefix = full.substr(0, slash);
+            name = full.substr(slash + 1);
+            return true;
+        }
+        slash = full.find('/', slash + 1);
+    }
+    return false;
+}
+
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define HAVE_COOKIE_STREAMS 1
+
+/* The decoders write to a FILE. This one forwards to the tar stream
+ * and refuses to go past the size in the member's header. */
+struct MemberStream {
+    TarWriter *w;
+    uint64_t remaining;
+    bool overflow;
+    std::exception_ptr write_error;
+};
+
+ssize_t member_write(void *cookie, const char *buf, size_t size) {
+    auto *s = static_cast<MemberStream*>(cookie);
+    if(size > s->remaining) {
+        s->overflow = true;
+        return 0;
+    }
+    // Throwing through stdio is not safe, so write errors are kept
+    // here and rethrown once the stream is closed.
+    try {
+        s->w->write_all(buf, size);
+    } catch(...) {
+        s->write_error = std::current_exception();
+        return 0;
+    }
+    s->remaining -= size;
+    return size;
+}
+
+FILE* open_member_stream(MemberStream *s) {
+#if defined(__GLIBC__)
+    cookie_io_functions_t io = {nullptr, member_write, nullptr, nullptr};
+    return fopencookie(s, "w", io);
+#else
+    return funopen(s, nullptr, [](void *c, const char *buf, int size) {
+        return (int)member_write(c, buf, size);
+    }, nullptr, nullptr);
+#endif
+}
+#endif
+
+}
+
+TarWriter::TarWriter(int fd) : fd(fd) {
+#ifdef _WIN32
+    throw std::runtime_error("Tar output is not supported on Windows.");
+#else
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        throw_system("Could not stat tar output:");
+    }
+    is_pipe = S_ISFIFO(st.st_mode);
+#endif
+}
+
+void TarWriter::write_all(const void *buf, size_t size) {
+#ifndef _WIN32
+    const char *p = static_cast<const char*>(buf);
+    while(size > 0) {
+        auto r = ::write(fd, p, size);
+        if(r < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw_system("Could not write tar stream:");
+        }
+        p += r;
+        size -= r;
+    }
+#endif
+}
+
+void TarWriter::write_zeros(uint64_t size) {
+    static const char zeros[64*1024] = {0};
+    while(size > 0) {
+        const size_t n = (size_t)std::min<uint64_t>(size, sizeof(zeros));
+        write_all(zeros, n);
+        size -= n;
+    }
+}
+
+void TarWriter::write_padding(uint64_t size) {
+    static const char zeros[BLOCK] = {0};
+    const size_t pad = (BLOCK - size % BLOCK) % BLOCK;
+    if(pad > 0) {
+        write_all(zeros, pad);
+    }
+}
+
+void TarWriter::write_header(const Member &m) {
+    std::string prefix, name;
+    std::string pax;
+    if(!split_name(m.name, prefix, name)) {
+        pax_record(pax, "path", m.name);
+        prefix.clear();
+        name = m.name.substr(0, 99);
+    }
+    if(m.linkname.size() > 100) {
+        pax_record(pax, "linkpath", m.linkname);
+    }
+    if(m.size > MAX_OCTAL_SIZE) {
+        pax_record(pax, "size", std::to_string(m.size));
+    }
+    if(!pax.empty()) {
+        Member x = m;
+        x.name = "PaxHeaders/" + name;
+        x.linkname.clear();
+        x.type = 'x';
+        x.size = pax.size();
+        write_header(x);
+        write_all(pax.data(), pax.size());
+        write_padding(pax.size());
+    }
+    char block[BLOCK];
+    memset(block, 0, sizeof(block));
+    put(block, 0, name, 100);
+    put(block, 100, octal(m.mode, 8), 8);
+    put(block, 108, octal(m.uid, 8), 8);
+    put(block, 116, octal(m.gid, 8), 8);
+    put(block, 124, octal(std::min(m.size, MAX_OCTAL_SIZE), 12), 12);
+    put(block, 136, octal(m.mtime > 0 ? m.mtime : 0, 12), 12);
+    memset(block + 148, ' ', 8);
+    block[156] = m.type;
+    put(block, 157, m.linkname, 100);
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    if(m.type == '3' || m.type == '4') {
+        put(block, 329, octal(m.devmajor, 8), 8);
+        put(block, 337, octal(m.devminor, 8), 8);
+    }
+    put(block, 345, prefix, 155);
+    unsigned sum = 0;
+    for(size_t i=0; i<BLOCK; i++) {
+        sum += (unsigned char)block[i];
+    }
+    snprintf(block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+    write_all(block, sizeof(block));
+}
+
+uint32_t TarWriter::write_stored(InputRange &data, std::string &read_error) {
+    uint32_t crc = crc32(0, Z_NULL, 0);
+#if defined(__linux__)
+    // A file mapping is never written to, so the pipe can refer to its
+    // pages instead of getting a copy. Anything else, such as the read
+    // buffer or an archive in memory, may be reused or freed before the
+    // reader gets to it.
+    const bool splice = is_pipe && data.file_mapping();
+#endif
+    while(true) {
+        ZipSpan piece;
+        try {
+            piece = data.next(1024*1024);
+        } catch(const std::exception &e) {
+            // Keep the framing, as with data that fails to decode.
+            read_error = e.what();
+            write_zeros(data.size() - data.position());
+            break;
+        }
+        if(piece.size == 0) {
+            break;
+        }
+        {
+            STATS_TIME(PHASE_WRITE);
+#if defined(__linux__)
+            if(splice) {
+                const unsigned char *p = piece.data;
+                size_t size = (size_t)piece.size;
+                while(size > 0) {
+                    struct iovec iov;
+                    iov.iov_base = const_cast<unsigned char*>(p);
+                    iov.iov_len = size;
+                    auto r = vmsplice(fd, &iov, 1, 0);
+                    if(r < 0) {
+                        if(errno == EINTR) {
+                            continue;
+                        }
+                        throw_system("Could not splice into tar stream:");
+                    }
+                    p += r;
+                    size -= r;
+                }
+            } else
+#endif
+            write_all(piece.data, (size_t)piece.size);
+            STATS_COUNT(COUNT_BYTES_OUT, piece.size);
+        }
+        STATS_TIME(PHASE_CRC);
+        crc = crc32(crc, piece.data, (uInt)piece.size);
+    }
+    return crc;
+}
+
+uint32_t TarWriter::write_decoded(uint16_t method, InputRange &data, uint64_t size, bool &size_ok) {
+#ifdef HAVE_COOKIE_STREAMS
+    decltype(inflate_to_file) *f = method == ZIP_DEFLATE ? inflate_to_file : lzma_to_file;
+    MemberStream s{this, size, false, nullptr};
+    FILE *stream = open_member_stream(&s);
+    if(!stream) {
+        throw_system("Could not create tar member stream:");
+    }
+    uint32_t crc = 0;
+    bool decoded = true;
+    try {
+        crc = f(data, stream, nullptr);
+    } catch(const std::exception &) {
+        decoded = false;
+    }
+    const bool flushed = fclose(stream) == 0;
+    if(s.write_error) {
+        std::rethrow_exception(s.write_error);
+    }
+    // Keep the framing: the member is exactly as long as its header says.
+    size_ok = decoded && flushed && !s.overflow && s.remaining == 0;
+    write_zeros(s.remaining);
+    return crc;
+#else
+    (void)method;
+    (void)data;
+    (void)size;
+    (void)size_ok;
+    throw std::runtime_error("Tar output is not supported on this platform.");
+#endif
+}
+
+UnpackResult TarWriter::add(const localheader &lh, const centralheader &ch, InputRange &data) {
+    Member m;
+    filetype ftype;
+    try {
+        ftype = detect_filetype(lh, ch);
+    } catch(const std::exception &e) {
+        return UnpackResult{false, e.what()};
+    }
+    const bool unix = ch.version_made_by>>8 == MADE_BY_UNIX;
+    m.name = lh.fname;
+    m.mode = unix ? (ch.external_file_attributes >> 16) & 07777 : 0;
+    if(lh.unix.atime != 0) {
+        m.uid = lh.unix.uid;
+        m.gid = lh.unix.gid;
+        m.mtime = lh.unix.mtime;
+    } else {
+        m.uid = m.gid = 0;
+        m.mtime = dos_to_unix_time(lh.last_mod_date, lh.last_mod_time);
+    }
+    m.size = 0;
+    m.devmajor = m.devminor = 0;
+    switch(ftype) {
+    case DIRECTORY_ENTRY:
+        m.type = '5';
+        if(m.name.back() != '/') {
+            m.name += '/';
+        }
+        if(!unix) {
+            m.mode = 0755;
+        }
+        write_header(m);
+        return UnpackResult{true, std::string()};
+    case SYMLINK_ENTRY:
+        m.type = '2';
+        try {
+            m.linkname = read_link_target(data);
+        } catch(const std::exception &e) {
+            return UnpackResult{false, e.what()};
+        }
+        write_header(m);
+        return UnpackResult{true, std::string()};
+    case CHARDEV_ENTRY: {
+        const std::string &d = lh.unix.data;
+        if(d.size() != 8) {
+            return UnpackResult{false, "Incorrect extra data for character device."};
+        }
+        m.type = '3';
+        m.devmajor = le32toh(*reinterpret_cast<const uint32_t*>(&d[0]));
+        m.devminor = le32toh(*reinterpret_cast<const uint32_t*>(&d[4]));
+        write_header(m);
+        return UnpackResult{true, std::string()};
+    }
+    case FILE_ENTRY:
+        break;
+    default:
+        return UnpackResult{false, "Unknown file type."};
+    }
+
+    const uint16_t method = ch.compression_method;
+    if(method != ZIP_NO_COMPRESSION && method != ZIP_DEFLATE && method != ZIP_LZMA) {
+        return UnpackResult{false, "Unsupported compression format."};
+    }
+    if(method == ZIP_NO_COMPRESSION && data.size() != lh.uncompressed_size) {
+        return UnpackResult{false, "Stored entry has different compressed and uncompressed sizes."};
+    }
+    m.type = '0';
+    if(!unix) {
+        m.mode = 0644;
+    }
+    m.size = lh.uncompressed_size;
+    write_header(m);
+    STATS_COUNT(COUNT_BYTES_IN, data.size());
+    uint32_t crc;
+    bool size_ok = true;
+    std::string read_error;
+    if(method == ZIP_NO_COMPRESSION) {
+        crc = write_stored(data, read_error);
+    } else {
+        crc = write_decoded(method, data, m.size, size_ok);
+    }
+    write_padding(m.size);
+    if(!read_error.empty()) {
+        return UnpackResult{false, read_error + " Tar member is damaged."};
+    }
+    if(!size_ok) {
+        return UnpackResult{false, "Decoded data does not match the size in the header, tar member is damaged."};
+    }
+    const uint32_t original = lh.gp_bitflag&FLAG_DATA_DESCRIPTOR ? ch.crc32 : lh.crc32;
+    if(crc != original) {
+        return UnpackResult{false, "CRC32 checksum is invalid, tar member is damaged."};
+    }
+    return UnpackResult{true, std::string()};
+}
+
+void TarWriter::finish() {
+    static const char zeros[2*BLOCK] = {0};
+    write_all(zeros, sizeof(zeros));
+}
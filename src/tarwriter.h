@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include"zipdefs.h"
+#include"decompress.h"
+
+#include<cstdint>
+#include<string>
+
+/* Writes archive entries as a POSIX tar stream (ustar, with pax
+ * extended headers for names, link targets and sizes that do not fit)
+ * to a file descriptor, without touching the file system.
+ *
+ * Every member is exactly as long as its header says. Data that turns
+ * out shorter than declared is padded with zeros and anything past the
+ * declared size is cut off, so one damaged entry can not throw off the
+ * framing of the rest. Such entries are reported as failed. Only
+ * failing to write to the descriptor is fatal, then add throws and the
+ * stream is unusable.
+ *
+ * Stored entries are written straight from the archive. When it is
+ * mapped from a file and the output is a pipe on Linux they are spliced
+ * into it with vmsplice. */
+class TarWriter final {
+public:
+    explicit TarWriter(int fd);
+    TarWriter(const TarWriter &) = delete;
+    TarWriter& operator=(const TarWriter &) = delete;
+
+    UnpackResult add(const localheader &lh, const centralheader &ch, InputRange &data);
+
+    /* Writes the end of archive marker. */
+    void finish();
+
+    /* Used by the stream that decoded data goes through. */
+    void write_all(const void *buf, size_t size);
+
+private:
+    struct Member {
+        std::string name;
+        std::string linkname;
+        char type;
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        int64_t mtime;
+        uint64_t size;
+        uint32_t devmajor;
+        uint32_t devminor;
+    };
+
+    void write_header(const Member &m);
+    void write_padding(uint64_t size);
+    void write_zeros(uint64_t size);
+    uint32_t write_stored(InputRange &data, std::string &read_error);
+    uint32_t write_decoded(uint16_t method, InputRange &data, uint64_t size, bool &size_ok);
+
+    int fd;
+    bool is_pipe = false;
+};
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<atomic>
+#include<cstdint>
+#include<stdexcept>
+
+struct UnzipProgress {
+    uint64_t entries;       // Finished, successfully or not.
+    uint64_t total_entries;
+    uint64_t bytes_in;      // Compressed bytes consumed.
+    uint64_t bytes_out;     // Bytes written.
+};
+
+class TaskCancelled : public std::runtime_error {
+public:
+    TaskCancelled() : std::runtime_error("Extraction was cancelled.") {}
+};
+
+/* Shared between an extraction and whoever started it. The counters
+ * only grow, so they can be read at any time without locking.
+ * Cancelling is cooperative: the extraction checks for it between
+ * decoder chunks and between entries, so a request takes effect within
+ * one chunk and the entry being written at the time is removed. */
+class TaskControl final {
+public:
+    explicit TaskControl(uint64_t total_entries) noexcept : total_entries(total_entries) {}
+    TaskControl(const TaskControl &) = delete;
+    TaskControl& operator=(const TaskControl &) = delete;
+
+    void cancel() noexcept { cancelled.store(true, std::memory_order_relaxed); }
+    bool is_cancelled() const noexcept { return cancelled.load(std::memory_order_relaxed); }
+
+    /* Throws TaskCancelled if the task has been cancelled. */
+    void check() const {
+        if(is_cancelled()) {
+            throw TaskCancelled();
+        }
+    }
+
+    void add_entry() noexcept { entries.fetch_add(1, std::memory_order_relaxed); }
+    void add_bytes(uint64_t in, uint64_t out) noexcept {
+        bytes_in.fetch_add(in, std::memory_order_relaxed);
+        bytes_out.fetch_add(out, std::memory_order_relaxed);
+    }
+
+    UnzipProgress progress() const noexcept {
+        return UnzipProgress{entries.load(std::memory_order_relaxed), total_entries,
+                             bytes_in.load(std::memory_order_relaxed),
+                             bytes_out.load(std::memory_order_relaxed)};
+    }
+
+private:
+    const uint64_t total_entries;
+    std::atomic<bool> cancelled{false};
+    std::atomic<uint64_t> entries{0};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+};
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"trace.h"
+#include"file.h"
+#include"utils.h"
+
+#include<atomic>
+#include<cstdio>
+#include<memory>
+#include<mutex>
+#include<new>
+#include<thread>
+#include<vector>
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    // Index into the buffer's args or -1.
+    int64_t args;
+};
+
+// About 32 MB of events per thread. A long run keeps its beginning.
+const constexpr size_t MAX_EVENTS = 1024*1024;
+
+struct ThreadBuffer {
+    int tid;
+    bool main;
+    std::vector<TraceEvent> events;
+    std::vector<TraceArgs> args;
+    // Spans not recorded because the buffer was full.
+    uint64_t dropped = 0;
+};
+
+/* Set with release order after epoch and main_thread, and read with
+ * acquire order, so a thread that sees tracing active also sees them. */
+std::atomic<bool> active(false);
+std::chrono::steady_clock::time_point epoch;
+// The thread that started tracing.
+std::thread::id main_thread;
+
+/* The mutex is only taken when a thread records its first span. After
+ * that the thread appends to its own buffer. */
+std::mutex buffers_lock;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+ThreadBuffer* register_thread() {
+    std::unique_ptr<ThreadBuffer> b(new ThreadBuffer());
+    b->events.reserve(4096);
+    b->main = std::this_thread::get_id() == main_thread;
+    std::lock_guard<std::mutex> l(buffers_lock);
+    b->tid = (int)buffers.size() + 1;
+    buffers.push_back(std::move(b));
+    return buffers.back().get();
+}
+
+/* Null if the buffer could not be set up, registering is tried again
+ * on the next span then. */
+ThreadBuffer* local_buffer() noexcept {
+    try {
+        static thread_local ThreadBuffer *b = register_thread();
+        return b;
+    } catch(const std::exception &) {
+        return nullptr;
+    }
+}
+
+uint64_t since_epoch(std::chrono::steady_clock::time_point t) {
+    // Spans that were already open when tracing started are clipped.
+    if(t < epoch) {
+        return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t - epoch).count();
+}
+
+void write_event(File &f, const ThreadBuffer &b, const TraceEvent &e) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+             "\"ts\": %.3f, \"dur\": %.3f",
+             e.name, b.tid, e.start_ns/1e3, e.dur_ns/1e3);
+    f.write(buf);
+    if(e.args >= 0) {
+        const auto &a = b.args[e.args];
+        snprintf(buf, sizeof(buf), ", \"args\": {\"method\": %d, \"compressed_size\": %llu, "
+                 "\"uncompressed_size\": %llu, \"entry\": \"",
+                 a.method, (unsigned long long)a.compressed_size, (unsigned long long)a.uncompressed_size);
+        f.write(buf);
+        f.write(json_escape(a.entry));
+        f.write("\"}");
+    }
+    f.write("}");
+}
+
+}
+
+void trace_start() {
+    main_thread = std::this_thread::get_id();
+    epoch = std::chrono::steady_clock::now();
+    active.store(true, std::memory_order_release);
+}
+
+bool trace_active() noexcept {
+    return active.load(std::memory_order_acquire);
+}
+
+void trace_span(const char *name,
+        std::chrono::steady_clock::time_point start,
+        std::chrono::steady_clock::time_point end,
+        const TraceArgs *args) noexcept {
+    auto *b = local_buffer();
+    if(!b) {
+        return;
+    }
+    if(b->events.size() >= MAX_EVENTS) {
+        b->dropped++;
+        return;
+    }
+    const size_t num_args = b->args.size();
+    try {
+        int64_t args_index = -1;
+        if(args) {
+            args_index = num_args;
+            b->args.push_back(*args);
+        }
+        b->events.push_back(TraceEvent{name, since_epoch(start), since_epoch(end) - since_epoch(start), args_index});
+    } catch(const std::bad_alloc &) {
+        // Called from destructors, so the span is lost rather than thrown.
+        b->args.resize(num_args);
+        b->dropped++;
+    }
+}
+
+void trace_write(const std::string &fname) {
+    active.store(false);
+    File f(fname, "wb");
+    f.write("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    bool first = true;
+    uint64_t dropped = 0;
+    std::lock_guard<std::mutex> l(buffers_lock);
+    for(const auto &b : buffers) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                 "\"args\": {\"name\": \"%s %d\"}}",
+                 first ? "" : ",", b->tid, b->main ? "main" : "worker", b->tid);
+        f.write(buf);
+        first = false;
+        for(const auto &e : b->events) {
+            write_event(f, *b, e);
+        }
+        dropped += b->dropped;
+    }
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\n], \"otherData\": {\"dropped_spans\": %llu}}\n", (unsigned long long)dropped);
+    f.write(buf);
+    f.close();
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Timeline of extraction in Chrome trace event format, viewable with
+ * chrome://tracing or Perfetto.
+ *
+ * Recording is off until trace_start is called, the thread that calls
+ * it is labeled main. Each thread appends spans to its own buffer
+ * without locking, and trace_write dumps all buffers at once. It must
+ * only be called when no other thread is recording any more. A thread
+ * records at most about a million spans, the ones after that are only
+ * counted, as dropped_spans in the output. */
+
+#include<chrono>
+#include<cstdint>
+#include<string>
+
+void trace_start();
+bool trace_active() noexcept;
+void trace_write(const std::string &fname);
+
+/* Entry metadata attached to a span. Method is -1 for spans that are
+ * not about a single entry. */
+struct TraceArgs {
+    std::string entry;
+    int method = -1;
+    uint64_t compressed_size = 0;
+    uint64_t uncompressed_size = 0;
+};
+
+/* Never throws. A span that does not fit in memory is dropped and
+ * counted like the ones over the limit. */
+void trace_span(const char *name,
+        std::chrono::steady_clock::time_point start,
+        std::chrono::steady_clock::time_point end,
+        const TraceArgs *args=nullptr) noexcept;
+
+class TraceSpan final {
+public:
+    explicit TraceSpan(const char *name) noexcept : name(name), active(trace_active()) {
+        if(active) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan& operator=(const TraceSpan &) = delete;
+    ~TraceSpan() {
+        if(active) {
+            trace_span(name, start, std::chrono::steady_clock::now(), args.method >= 0 ? &args : nullptr);
+        }
+    }
+
+    bool recording() const noexcept { return active; }
+    void set_args(TraceArgs a) { args = std::move(a); }
+
+private:
+    const char *name;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+    TraceArgs args;
+};
+
+#ifdef ZIP_STATS
+#define TRACE_SPAN(var, name) TraceSpan var(name)
+#else
+#define TRACE_SPAN(var, name) do {} while(0)
+#endif
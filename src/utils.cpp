@@ -28,6 +28,7 @@
 #include<cerrno>
 #include<cassert>
 #include<cstring>
+#include<ctime>
 
 #include<stdexcept>
 #include<string>
@@ -59,3 +60,34 @@ uint32_t CRC32(File &f) {
     MMapper mmap = f.mmap();
     return CRC32(mmap, mmap.size());
 }
+
+int64_t dos_to_unix_time(uint16_t date, uint16_t time) noexcept {
+    struct tm t;
+    memset(&t, 0, sizeof(t));
+    t.tm_year = ((date >> 9) & 0x7f) + 80;
+    t.tm_mon = ((date >> 5) & 0xf) - 1;
+    t.tm_mday = date & 0x1f;
+    t.tm_hour = time >> 11;
+    t.tm_min = (time >> 5) & 0x3f;
+    t.tm_sec = (time & 0x1f)*2;
+    t.tm_isdst = -1;
+    return mktime(&t);
+}
+
+std::string json_escape(const std::string &s) {
+    std::string r;
+    r.reserve(s.size());
+    char tmp[8];
+    for(unsigned char c : s) {
+        if(c == '"' || c == '\\') {
+            r += '\\';
+            r += c;
+        } else if(c < 0x20) {
+            snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+            r += tmp;
+        } else {
+            r += c;
+        }
+    }
+    return r;
+}
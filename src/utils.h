@@ -27,3 +27,10 @@ void throw_system(const char *msg);
 
 uint32_t CRC32(const unsigned char *buf, uint64_t bufsize) noexcept;
 uint32_t CRC32(File &f);
+
+/* Converts an MS-DOS date and time, as stored in zip headers, to seconds
+ * since the epoch. DOS times have no time zone, they are taken as local. */
+int64_t dos_to_unix_time(uint16_t date, uint16_t time) noexcept;
+
+/* Escapes a string so it can be put between quotes in JSON output. */
+std::string json_escape(const std::string &s);
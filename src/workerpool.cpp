@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"workerpool.h"
+
+#include<algorithm>
+
+WorkerPool::WorkerPool(unsigned num_threads) {
+    num_threads = std::max(num_threads, 1u);
+    threads.reserve(num_threads);
+    for(unsigned i=0; i<num_threads; i++) {
+        threads.emplace_back(&WorkerPool::work, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> l(m);
+        stop = true;
+    }
+    wake.notify_all();
+    for(auto &t : threads) {
+        t.join();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> l(m);
+        tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+}
+
+void WorkerPool::work() {
+    std::unique_lock<std::mutex> l(m);
+    while(true) {
+        wake.wait(l, [this]() { return stop || !tasks.empty(); });
+        if(tasks.empty()) {
+            return;
+        }
+        auto task = std::move(tasks.front());
+        tasks.pop_front();
+        l.unlock();
+        task();
+        l.lock();
+    }
+}
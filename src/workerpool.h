@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<condition_variable>
+#include<deque>
+#include<functional>
+#include<mutex>
+#include<thread>
+#include<vector>
+
+/* A fixed set of threads running tasks from a shared FIFO queue. Tasks
+ * must not throw. Since every thread keeps its own decoder arena,
+ * running all work on one pool reuses decoder memory across tasks. */
+class WorkerPool final {
+public:
+    explicit WorkerPool(unsigned num_threads);
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool& operator=(const WorkerPool &) = delete;
+    /* Runs the tasks still queued and then joins the threads. */
+    ~WorkerPool();
+
+    void submit(std::function<void()> task);
+
+    size_t size() const noexcept { return threads.size(); }
+
+private:
+    void work();
+
+    std::mutex m;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> tasks;
+    bool stop = false;
+    std::vector<std::thread> threads;
+};
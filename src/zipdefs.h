@@ -27,6 +27,11 @@
 #define ZIP_EXTRA_ZIP64 1
 #define ZIP_EXTRA_UNIX 0xd
 
+// General purpose flag bits.
+const constexpr uint16_t FLAG_ENCRYPTED = 1<<0;
+// The CRC and sizes are in a data descriptor after the data and zero in the local header.
+const constexpr uint16_t FLAG_DATA_DESCRIPTOR = 1<<3;
+
 const constexpr uint32_t LOCAL_SIG = 0x04034b50;
 const constexpr uint32_t CENTRAL_SIG = 0x02014b50;
 const constexpr uint32_t CENTRAL_END_SIG = 0x06054b50;
@@ -87,15 +92,16 @@ struct centralheader {
     uint16_t last_mod_time;
     uint16_t last_mod_date;
     uint32_t crc32;
-    uint32_t compressed_size;
-    uint32_t uncompressed_size;
+    // 64 bits so the values from the zip64 extra field fit.
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
     //file name length                2 bytes
     //extra field length              2 bytes
     //file comment length             2 bytes
-    uint16_t disk_number_start;
+    uint32_t disk_number_start;
     uint16_t internal_file_attributes;
     uint32_t external_file_attributes;
-    uint32_t local_header_rel_offset;
+    uint64_t local_header_rel_offset;
 
     std::string fname;
     std::string extra_field;
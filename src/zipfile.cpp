@@ -19,7 +19,13 @@
 #include"utils.h"
 #include"fileutils.h"
 #include"mmapper.h"
+#include"prefetch.h"
+#include"arena.h"
+#include"tarwriter.h"
+#include"inputsource.h"
 #include"naturalorder.h"
+#include"stats.h"
+#include"trace.h"
 #include<portable_endian.h>
 #ifdef _WIN32
 #include<winsock2.h>
@@ -36,6 +42,9 @@
 #include<future>
 #include<thread>
 #include<algorithm>
+#include<memory>
+#include<iterator>
+#include<system_error>
 #include "decompress.h"
 
 #ifndef _WIN32
@@ -44,33 +53,65 @@ using std::max;
 
 namespace {
 
-void unpack_zip64_sizes(const std::string &extra_field, uint64_t &compressed_size, uint64_t &uncompressed_size) {
-    size_t offset = 0;
-    while(offset < extra_field.size()) {
-        uint16_t header_id = le16toh(*reinterpret_cast<const uint16_t*>(&extra_field[offset]));
-        offset+=2;
-        uint16_t data_size = le16toh(*reinterpret_cast<const uint16_t*>(&extra_field[offset]));
-        offset+=2;
+// The end record is 22 bytes and may be followed by a comment of up to 64 kB.
+const constexpr uint64_t END_RECORD_SIZE = 22;
+const constexpr uint64_t MAX_END_SEARCH = END_RECORD_SIZE + 0xFFFF;
+const constexpr uint64_t ZIP64_LOCATOR_SIZE = 20;
+const constexpr uint64_t ZIP64_END_SIZE = 56;
+
+/* Replaces the fields whose 32 bit value was all ones with their values
+ * from the zip64 extra field. Only those fields are stored there, in
+ * this order. Null pointers are fields that are not stored. */
+void unpack_zip64_extra(const std::string &extra,
+                        uint64_t *uncompressed_size,
+                        uint64_t *compressed_size,
+                        uint64_t *offset,
+                        uint32_t *disk) {
+    size_t pos = 0;
+    while(pos + 4 <= extra.size()) {
+        uint16_t header_id = le16toh(*reinterpret_cast<const uint16_t*>(&extra[pos]));
+        uint16_t data_size = le16toh(*reinterpret_cast<const uint16_t*>(&extra[pos+2]));
+        pos += 4;
+        if(pos + data_size > extra.size()) {
+            break;
+        }
         if(header_id == ZIP_EXTRA_ZIP64) {
-            uncompressed_size = le64toh(*reinterpret_cast<const uint64_t*>(&extra_field[offset]));
-            offset += 8;
-            compressed_size = le64toh(*reinterpret_cast<const uint64_t*>(&extra_field[offset]));
+            const size_t end = pos + data_size;
+            for(uint64_t *field : {uncompressed_size, compressed_size, offset}) {
+                if(!field) {
+                    continue;
+                }
+                if(pos + 8 > end) {
+                    throw std::runtime_error("ZIP64 extension is too short, file can not be parsed.");
+                }
+                *field = le64toh(*reinterpret_cast<const uint64_t*>(&extra[pos]));
+                pos += 8;
+            }
+            if(disk) {
+                if(pos + 4 > end) {
+                    throw std::runtime_error("ZIP64 extension is too short, file can not be parsed.");
+                }
+                *disk = le32toh(*reinterpret_cast<const uint32_t*>(&extra[pos]));
+            }
             return;
         }
-        offset += data_size;
+        pos += data_size;
     }
     throw std::runtime_error("Entry extra field did not contain ZIP64 extension, file can not be parsed.");
 }
 
 void unpack_unix(const std::string &extra, unixextra &unix) noexcept {
     size_t offset = 0;
-    while(offset < extra.size()) {
+    while(offset + 4 <= extra.size()) {
         uint16_t header_id = le16toh(*reinterpret_cast<const uint16_t*>(&extra[offset]));
         offset+=2;
         uint16_t data_size = le16toh(*reinterpret_cast<const uint16_t*>(&extra[offset]));
         offset+=2;
         auto extra_end = offset + data_size;
-        if(header_id == ZIP_EXTRA_UNIX) {
+        if(extra_end > extra.size()) {
+            break;
+        }
+        if(header_id == ZIP_EXTRA_UNIX && data_size >= 12) {
             unix.atime = le32toh(*reinterpret_cast<const uint32_t*>(&extra[offset]));
             offset += 4;
             unix.mtime = le32toh(*reinterpret_cast<const uint32_t*>(&extra[offset]));
@@ -84,7 +125,8 @@ void unpack_unix(const std::string &extra, unixextra &unix) noexcept {
         }
         offset += data_size;
     }
-    unix.atime = 0;
+    // No owner either, rather than whatever the struct had.
+    unix = unixextra();
 }
 
 void check_filename(const std::string &fname) {
@@ -96,23 +138,215 @@ void check_filename(const std::string &fname) {
     }
 }
 
+}
+
+namespace {
+
+uint16_t get16le(const unsigned char *p) noexcept {
+    return le16toh(*reinterpret_cast<const uint16_t*>(p));
+}
+
+uint32_t get32le(const unsigned char *p) noexcept {
+    return le32toh(*reinterpret_cast<const uint32_t*>(p));
+}
+
+// Smaller pieces of header parsing are not worth a thread.
+const constexpr uint64_t MIN_CENTRAL_CHUNK = 4*1024*1024;
+const constexpr uint64_t MIN_LOCAL_CHUNK = 32*1024;
+// Most local headers are read this many at a time.
+const constexpr uint64_t HEADER_BLOCK = 1024*1024;
+const constexpr uint64_t HEADER_SLACK = 256;
+// Records that must follow a signature for it to start a chunk.
+const constexpr int SYNC_RECORDS = 4;
+
+size_t parse_threads(uint64_t work, uint64_t min_chunk) noexcept {
+    const uint64_t cpus = std::max(1u, std::thread::hardware_concurrency());
+    return (size_t)std::max<uint64_t>(1, std::min(cpus, work/min_chunk));
+}
+
+/* Runs f(0) ... f(n-1) on threads of their own, f(0) on the calling
+ * thread. Rethrows the exception of the lowest numbered call that threw,
+ * so errors come out as they would from a serial loop. */
+template<typename F>
+void run_parallel(size_t n, const F &f) {
+    std::vector<std::exception_ptr> errors(n);
+    auto guarded = [&f, &errors](size_t i) {
+        try {
+            f(i);
+        } catch(...) {
+            errors[i] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    size_t started = 1;
+    try {
+        for(; started<n; started++) {
+            threads.emplace_back(guarded, started);
+        }
+    } catch(const std::system_error &) {
+        // Out of threads, do the rest here.
+    }
+    guarded(0);
+    for(size_t i=threads.size()+1; i<n; i++) {
+        guarded(i);
+    }
+    for(auto &t : threads) {
+        t.join();
+    }
+    for(auto &e : errors) {
+        if(e) {
+            std::rethrow_exception(e);
+        }
+    }
+}
+
+}
+
+/* Reads ranges of the archive into a buffer of its own, so that every
+ * thread can have one. An archive in memory is used where it is. */
+class HeaderReader final {
+public:
+    explicit HeaderReader(File &f) : f(f) {}
+    HeaderReader(File &f, const unsigned char *memory, uint64_t size) : f(f), memory(memory), memory_size(size) {}
+
+    bool has(uint64_t offset, uint64_t length) const noexcept {
+        if(memory) {
+            return offset <= memory_size && length <= memory_size - offset;
+        }
+        return offset >= start && offset - start <= buf.size() && length <= buf.size() - (offset - start);
+    }
+
+    /* Only valid for a range that has() says is there. */
+    const unsigned char* get(uint64_t offset) const noexcept {
+        if(memory) {
+            return memory + offset;
+        }
+        return buf.data() + (offset - start);
+    }
+
+    void fill(uint64_t offset, uint64_t length) {
+        if(memory) {
+            // Everything there is, is already there.
+            throw std::runtime_error("Zip file broken, local header is truncated.");
+        }
+        buf.resize(length);
+        start = offset;
+#ifdef _WIN32
+        f.seek(offset);
+        if(fread(buf.data(), 1, length, f.get()) != length) {
+            throw std::runtime_error("Zip file broken, local header is truncated.");
+        }
+#else
+        uint64_t done = 0;
+        while(done < length) {
+            const ssize_t r = pread(f.fileno(), buf.data() + done, length - done, offset + done);
+            if(r < 0 && errno == EINTR) {
+                continue;
+            }
+            if(r < 0) {
+                throw_system("Could not read local header:");
+            }
+            if(r == 0) {
+                throw std::runtime_error("Zip file broken, local header is truncated.");
+            }
+            done += r;
+        }
+#endif
+    }
+
+private:
+    File &f;
+    const unsigned char *memory = nullptr;
+    uint64_t memory_size = 0;
+    std::vector<unsigned char> buf;
+    uint64_t start = 0;
+};
+
+namespace {
+
+/* Length of the central record at p, or 0 if there is no complete one. */
+uint64_t central_record_size(const unsigned char *p, uint64_t available) noexcept {
+    if(available < 4 + CENTRAL_HEADER_SIZE || get32le(p) != CENTRAL_SIG) {
+        return 0;
+    }
+    const uint64_t size = 4 + CENTRAL_HEADER_SIZE + get16le(p + 4 + 24) + get16le(p + 4 + 26) + get16le(p + 4 + 28);
+    return size <= available ? size : 0;
+}
+
+/* Parses records starting at begin until one starts at or after end.
+ * Returns where the last one ended. */
+uint64_t parse_central_records(const unsigned char *dir, uint64_t dir_size, uint64_t begin, uint64_t end,
+                               std::vector<centralheader> &out) {
+    uint64_t pos = begin;
+    while(pos < end) {
+        const uint64_t size = central_record_size(dir + pos, dir_size - pos);
+        if(size == 0) {
+            throw std::runtime_error("Zip file broken, bad entry in central directory.");
+        }
+        const unsigned char *fixed = dir + pos + 4;
+        const char *name = reinterpret_cast<const char*>(fixed + CENTRAL_HEADER_SIZE);
+        const uint16_t name_size = get16le(fixed + 24);
+        const uint16_t extra_size = get16le(fixed + 26);
+        const uint16_t comment_size = get16le(fixed + 28);
+        out.push_back(decode_central_entry(fixed, std::string(name, name_size),
+                                           std::string(name + name_size, extra_size),
+                                           std::string(name + name_size + extra_size, comment_size)));
+        pos += size;
+    }
+    return pos;
+}
+
+/* The first offset at or after from where a run of records begins. A
+ * signature inside a name or comment is rarely followed by more of them. */
+uint64_t find_central_record(const unsigned char *dir, uint64_t dir_size, uint64_t from) noexcept {
+    for(uint64_t p = from; p + 4 <= dir_size; p++) {
+        auto hit = static_cast<const unsigned char*>(memchr(dir + p, 'P', dir_size - 3 - p));
+        if(!hit) {
+            break;
+        }
+        p = hit - dir;
+        uint64_t q = p;
+        int found = 0;
+        while(found < SYNC_RECORDS && q < dir_size) {
+            const uint64_t size = central_record_size(dir + q, dir_size - q);
+            if(size == 0) {
+                break;
+            }
+            q += size;
+            found++;
+        }
+        if(found == SYNC_RECORDS || (found > 0 && q == dir_size)) {
+            return p;
+        }
+    }
+    return dir_size;
+}
+
+}
+
 localheader read_local_entry(File &f) {
+    const std::string fixed = f.read(LOCAL_HEADER_SIZE);
+    auto p = reinterpret_cast<const unsigned char*>(fixed.data());
+    auto fname = f.read(get16le(p + 22));
+    auto extra = f.read(get16le(p + 24));
+    return decode_local_entry(p, std::move(fname), std::move(extra));
+}
+
+localheader decode_local_entry(const unsigned char *p, std::string fname, std::string extra) {
     localheader h;
-    uint16_t fname_length, extra_length;
-    h.needed_version = f.read16le();
-    h.gp_bitflag = f.read16le();
-    h.compression = f.read16le();
-    h.last_mod_time = f.read16le();
-    h.last_mod_date = f.read16le();
-    h.crc32 = f.read32le();
-    h.compressed_size = f.read32le();
-    h.uncompressed_size = f.read32le();
-    fname_length = f.read16le();
-    extra_length = f.read16le();
-    h.fname = f.read(fname_length);
-    h.extra = f.read(extra_length);
+    h.needed_version = get16le(p);
+    h.gp_bitflag = get16le(p + 2);
+    h.compression = get16le(p + 4);
+    h.last_mod_time = get16le(p + 6);
+    h.last_mod_date = get16le(p + 8);
+    h.crc32 = get32le(p + 10);
+    h.compressed_size = get32le(p + 14);
+    h.uncompressed_size = get32le(p + 18);
+    h.fname = std::move(fname);
+    h.extra = std::move(extra);
     if(h.compressed_size == 0xFFFFFFFF || h.uncompressed_size == 0xFFFFFFFF) {
-        unpack_zip64_sizes(h.extra, h.compressed_size, h.uncompressed_size);
+        // Local headers always have both sizes.
+        unpack_zip64_extra(h.extra, &h.uncompressed_size, &h.compressed_size, nullptr, nullptr);
     }
     unpack_unix(h.extra, h.unix);
     check_filename(h.fname);
@@ -120,102 +354,151 @@ localheader read_local_entry(File &f) {
 }
 
 centralheader read_central_entry(File &f) {
+    const std::string fixed = f.read(CENTRAL_HEADER_SIZE);
+    auto p = reinterpret_cast<const unsigned char*>(fixed.data());
+    auto fname = f.read(get16le(p + 24));
+    auto extra = f.read(get16le(p + 26));
+    auto comment = f.read(get16le(p + 28));
+    return decode_central_entry(p, std::move(fname), std::move(extra), std::move(comment));
+}
+
+centralheader decode_central_entry(const unsigned char *p, std::string fname, std::string extra, std::string comment) {
     centralheader c;
-    uint16_t fname_length, extra_length, comment_length;
-    c.version_made_by = f.read16le();
-    c.version_needed = f.read16le();
-    c.bit_flag = f.read16le();
-    c.compression_method = f.read16le();
-    c.last_mod_time = f.read16le();
-    c.last_mod_date = f.read16le();
-    c.crc32 = f.read32le();
-    c.compressed_size = f.read32le();
-    c.uncompressed_size = f.read32le();
-    fname_length = f.read16le();
-    extra_length = f.read16le();
-    comment_length = f.read16le();
-    c.disk_number_start = f.read16le();
-    c.internal_file_attributes = f.read16le();
-    c.external_file_attributes = f.read32le();
-    c.local_header_rel_offset = f.read32le();
-
-    c.fname = f.read(fname_length);
-    c.extra_field = f.read(extra_length);
-    c.comment = f.read(comment_length);
+    c.version_made_by = get16le(p);
+    c.version_needed = get16le(p + 2);
+    c.bit_flag = get16le(p + 4);
+    c.compression_method = get16le(p + 6);
+    c.last_mod_time = get16le(p + 8);
+    c.last_mod_date = get16le(p + 10);
+    c.crc32 = get32le(p + 12);
+    c.compressed_size = get32le(p + 16);
+    c.uncompressed_size = get32le(p + 20);
+    c.disk_number_start = get16le(p + 30);
+    c.internal_file_attributes = get16le(p + 32);
+    c.external_file_attributes = get32le(p + 34);
+    c.local_header_rel_offset = get32le(p + 38);
+    c.fname = std::move(fname);
+    c.extra_field = std::move(extra);
+    c.comment = std::move(comment);
+    const bool big_uncompressed = c.uncompressed_size == 0xFFFFFFFF;
+    const bool big_compressed = c.compressed_size == 0xFFFFFFFF;
+    const bool big_offset = c.local_header_rel_offset == 0xFFFFFFFF;
+    const bool big_disk = c.disk_number_start == 0xFFFF;
+    if(big_uncompressed || big_compressed || big_offset || big_disk) {
+        unpack_zip64_extra(c.extra_field,
+                           big_uncompressed ? &c.uncompressed_size : nullptr,
+                           big_compressed ? &c.compressed_size : nullptr,
+                           big_offset ? &c.local_header_rel_offset : nullptr,
+                           big_disk ? &c.disk_number_start : nullptr);
+    }
     return c;
 }
 
-zip64endrecord read_z64_central_end(File &f) {
+namespace {
+
+/* Reads little endian fields from a buffer, throwing at its end. */
+class ByteCursor final {
+public:
+    ByteCursor(const std::string &buf, size_t offset) noexcept :
+        p(reinterpret_cast<const unsigned char*>(buf.data()) + offset), end(p + (buf.size() - offset)) {}
+
+    uint16_t read16le() {
+        return get16le(take(2));
+    }
+
+    uint32_t read32le() {
+        return get32le(take(4));
+    }
+
+    uint64_t read64le() {
+        return le64toh(*reinterpret_cast<const uint64_t*>(take(8)));
+    }
+
+    std::string read(uint64_t size) {
+        const char *start = reinterpret_cast<const char*>(take(size));
+        return std::string(start, start + size);
+    }
+
+private:
+    const unsigned char* take(uint64_t size) {
+        if(size > (uint64_t)(end - p)) {
+            throw std::runtime_error("Zip file broken, end of central directory is truncated.");
+        }
+        const unsigned char *start = p;
+        p += size;
+        return start;
+    }
+
+    const unsigned char *p;
+    const unsigned char *end;
+};
+
+zip64endrecord read_z64_central_end(ByteCursor &c) {
     zip64endrecord er;
-    er.recordsize = f.read64le();
-    er.version_made_by = f.read16le();
-    er.version_needed = f.read16le();
-    er.disk_number = f.read32le();
-    er.dir_start_disk_number = f.read32le();
-    er.this_disk_num_entries = f.read64le();
-    er.total_entries = f.read64le();
-    er.dir_size = f.read64le();
-    er.dir_offset = f.read64le();
-    auto ext_size = er.recordsize - 2 - 2 - 4 - 4 - 8 - 8 - 8 - 8;
-    er.extensible = f.read(ext_size);
+    er.recordsize = c.read64le();
+    er.version_made_by = c.read16le();
+    er.version_needed = c.read16le();
+    er.disk_number = c.read32le();
+    er.dir_start_disk_number = c.read32le();
+    er.this_disk_num_entries = c.read64le();
+    er.total_entries = c.read64le();
+    er.dir_size = c.read64le();
+    er.dir_offset = c.read64le();
     return er;
 }
 
-zip64locator read_z64_locator(File &f) {
+zip64locator read_z64_locator(ByteCursor &c) {
     zip64locator loc;
-    loc.central_dir_disk_number = f.read32le();
-    loc.central_dir_offset = f.read64le();
-    loc.num_disks = f.read32le();
+    loc.central_dir_disk_number = c.read32le();
+    loc.central_dir_offset = c.read64le();
+    loc.num_disks = c.read32le();
     return loc;
 }
 
-endrecord read_end_record(File &f) {
+endrecord read_end_record(ByteCursor &c) {
     endrecord el;
-    el.disk_number = f.read16le();
-    el.central_dir_disk_number = f.read16le();
-    el.this_disk_num_entries = f.read16le();
-    el.total_entries = f.read16le();
-    el.dir_size = f.read32le();
-    el.dir_offset_start_disk = f.read32le();
-    auto csize = f.read16le();
-    el.comment = f.read(csize);
+    el.disk_number = c.read16le();
+    el.central_dir_disk_number = c.read16le();
+    el.this_disk_num_entries = c.read16le();
+    el.total_entries = c.read16le();
+    el.dir_size = c.read32le();
+    el.dir_offset_start_disk = c.read32le();
+    auto csize = c.read16le();
+    el.comment = c.read(csize);
     return el;
 }
 
 }
 
-ZipFile::ZipFile(const char *fname) : zipfile(fname, "rb") {
-    readLocalFileHeaders();
-    readCentralDirectory();
-    if(entries.size() != centrals.size()) {
-        std::string msg("Mismatch. File has ");
-        msg += std::to_string(entries.size());
-        msg += " local entries but ";
-        msg += std::to_string(centrals.size());
-        msg += " central entries.";
-        throw std::runtime_error(msg);
-    }
-    auto id = zipfile.read32le();
-    if(id == ZIP64_CENTRAL_END_SIG) {
-        z64end = read_z64_central_end(zipfile);
-        if(z64end.total_entries != entries.size()) {
-            throw std::runtime_error("File is broken, zip64 directory has incorrect number of entries.");
-        }
-        id = zipfile.read32le();
-        if(id == ZIP64_CENTRAL_LOCATOR_SIG) {
-            z64loc = read_z64_locator(zipfile);
-            id = zipfile.read32le();
-        }
-    }
-    if(id != CENTRAL_END_SIG) {
-        throw std::runtime_error("Zip file broken, missing end of central directory.");
+ZipFile::ZipFile(const char *fname) {
+    TRACE_SPAN(span, "open_archive");
+    {
+        STATS_TIME(PHASE_OPEN);
+        STATS_COUNT(COUNT_OPEN, 1);
+        zipfile = File(fname, "rb");
     }
-    endloc = read_end_record(zipfile);
-    if(endloc.total_entries != 0xFFFF && endloc.total_entries != entries.size()) {
-        throw std::runtime_error("Zip file broken, end record has incorrect directory size.");
+    // The end record says where the central directory is, and that has
+    // the authoritative sizes of every entry. Local headers can have
+    // them in a data descriptor after the data instead.
+    {
+        STATS_TIME(PHASE_PARSE_CENTRAL);
+        readEndRecord(zipfile.size());
+        const std::string dir = read_at(dir_start, dir_size);
+        readCentralDirectory(reinterpret_cast<const unsigned char*>(dir.data()));
     }
-    zipfile.seek(0, SEEK_END);
-    fsize = zipfile.tell();
+    readLocalFileHeaders();
+}
+
+ZipFile::ZipFile(const unsigned char *data, uint64_t size, std::shared_ptr<const void> owner) :
+    memory(data), owner(std::move(owner)) {
+    TRACE_SPAN(span, "open_archive");
+    STATS_COUNT(COUNT_OPEN, 1);
+    {
+        STATS_TIME(PHASE_PARSE_CENTRAL);
+        readEndRecord(size);
+        readCentralDirectory(memory + dir_start);
+    }
+    readLocalFileHeaders();
 }
 
 ZipFile::~ZipFile() {
@@ -224,54 +507,409 @@ ZipFile::~ZipFile() {
     }
 }
 
-void ZipFile::readLocalFileHeaders() {
-    while(true) {
-        auto curloc = zipfile.tell();
-        uint32_t head = zipfile.read32le();
-        if(head != LOCAL_SIG) {
-            zipfile.seek(curloc);
+std::string ZipFile::read_at(uint64_t offset, uint64_t size) {
+    if(!memory) {
+        zipfile.seek(offset);
+        return zipfile.read(size);
+    }
+    if(offset > fsize || size > fsize - offset) {
+        throw std::runtime_error("Zip file broken, read past the end of the archive.");
+    }
+    return std::string(reinterpret_cast<const char*>(memory + offset), size);
+}
+
+void ZipFile::readEndRecord(uint64_t size) {
+    fsize = size;
+    if(fsize < END_RECORD_SIZE) {
+        throw std::runtime_error("Zip file broken, missing end of central directory.");
+    }
+    // Search backwards, the comment could contain the signature too.
+    const uint64_t tail_size = std::min(fsize, MAX_END_SEARCH);
+    const uint64_t tail_start = fsize - tail_size;
+    const std::string tail = read_at(tail_start, tail_size);
+    uint64_t end_pos = fsize;
+    for(uint64_t i = tail_size - END_RECORD_SIZE + 1; i-- > 0;) {
+        if(le32toh(*reinterpret_cast<const uint32_t*>(&tail[i])) == CENTRAL_END_SIG &&
+           i + END_RECORD_SIZE + le16toh(*reinterpret_cast<const uint16_t*>(&tail[i+20])) <= tail_size) {
+            end_pos = tail_start + i;
             break;
         }
-        entries.emplace_back(read_local_entry(zipfile));
-        if(entries.back().gp_bitflag & 1) {
-            throw std::runtime_error("This file is encrypted. Encrypted ZIP archives are not supported.");
+    }
+    if(end_pos == fsize) {
+        throw std::runtime_error("Zip file broken, missing end of central directory.");
+    }
+    ByteCursor end_record(tail, end_pos - tail_start + 4);
+    endloc = read_end_record(end_record);
+
+    // Where the central directory actually ends, to detect data in front
+    // of the archive such as in self-extracting executables.
+    uint64_t dir_end = end_pos;
+    bool zip64 = false;
+    if(end_pos >= ZIP64_LOCATOR_SIZE + ZIP64_END_SIZE) {
+        const std::string locator_data = read_at(end_pos - ZIP64_LOCATOR_SIZE, ZIP64_LOCATOR_SIZE);
+        ByteCursor locator(locator_data, 0);
+        if(locator.read32le() == ZIP64_CENTRAL_LOCATOR_SIG) {
+            z64loc = read_z64_locator(locator);
+            // The locator's offset does not account for data in front of
+            // the archive, but the record is nearly always right before it.
+            uint64_t z64_pos = z64loc.central_dir_offset;
+            auto is_z64_end = [this](uint64_t pos) {
+                return get32le(reinterpret_cast<const unsigned char*>(read_at(pos, 4).data())) == ZIP64_CENTRAL_END_SIG;
+            };
+            if(z64_pos >= end_pos || end_pos - z64_pos < ZIP64_END_SIZE || !is_z64_end(z64_pos)) {
+                z64_pos = end_pos - ZIP64_LOCATOR_SIZE - ZIP64_END_SIZE;
+                if(!is_z64_end(z64_pos)) {
+                    throw std::runtime_error("Zip file broken, missing zip64 end of central directory.");
+                }
+            }
+            const std::string record_data = read_at(z64_pos + 4, ZIP64_END_SIZE - 4);
+            ByteCursor record(record_data, 0);
+            z64end = read_z64_central_end(record);
+            // The record size does not count its own field or the signature.
+            const uint64_t fixed_size = ZIP64_END_SIZE - 12;
+            if(z64end.recordsize < fixed_size || z64end.recordsize - fixed_size > end_pos - z64_pos - ZIP64_END_SIZE) {
+                throw std::runtime_error("Zip file broken, zip64 end of central directory is truncated.");
+            }
+            z64end.extensible = read_at(z64_pos + ZIP64_END_SIZE, z64end.recordsize - fixed_size);
+            dir_end = z64_pos;
+            zip64 = true;
         }
-        data_offsets.push_back(zipfile.tell());
-        zipfile.seek(entries.back().compressed_size, SEEK_CUR);
-        if(entries.back().gp_bitflag & (1<<2)) {
-            zipfile.seek(3*4, SEEK_CUR);
+    }
+    if(!zip64 && (endloc.dir_offset_start_disk == 0xFFFFFFFF || endloc.dir_size == 0xFFFFFFFF)) {
+        throw std::runtime_error("Zip file broken, missing zip64 end of central directory.");
+    }
+    if(zip64 ? z64end.disk_number != 0 || z64loc.num_disks > 1
+             : endloc.disk_number != 0 && endloc.disk_number != 0xFFFF) {
+        throw std::runtime_error("Multi-disk archives are not supported.");
+    }
+    const uint64_t dir_offset = zip64 ? z64end.dir_offset : endloc.dir_offset_start_disk;
+    dir_size = zip64 ? z64end.dir_size : endloc.dir_size;
+    num_entries = zip64 ? z64end.total_entries : endloc.total_entries;
+    if(dir_size > dir_end || dir_offset > dir_end - dir_size) {
+        throw std::runtime_error("Zip file broken, central directory is outside the file.");
+    }
+    prefix_size = dir_end - dir_size - dir_offset;
+    dir_start = dir_end - dir_size;
+}
+
+void ZipFile::readCentralDirectory(const unsigned char *d) {
+    const size_t threads = parse_threads(dir_size, MIN_CENTRAL_CHUNK);
+    bool parsed = false;
+    if(threads > 1) {
+        // Each chunk starts at the first record after its nominal start.
+        // A false start is caught by the previous chunk not ending on it.
+        std::vector<uint64_t> starts(threads + 1, dir_size);
+        starts[0] = 0;
+        for(size_t i=1; i<threads; i++) {
+            starts[i] = std::max(starts[i-1], find_central_record(d, dir_size, i*(dir_size/threads)));
+        }
+        std::vector<std::vector<centralheader>> parts(threads);
+        std::vector<uint64_t> stops(threads);
+        try {
+            run_parallel(threads, [&](size_t i) {
+                parts[i].reserve((starts[i+1] - starts[i])/46);
+                stops[i] = parse_central_records(d, dir_size, starts[i], starts[i+1], parts[i]);
+            });
+            parsed = true;
+            for(size_t i=0; i<threads; i++) {
+                parsed = parsed && stops[i] == starts[i+1];
+            }
+        } catch(const std::exception &) {
+            // Reparsed in order below so that the error is about the first broken record.
         }
+        if(parsed) {
+            size_t total = 0;
+            for(const auto &p : parts) {
+                total += p.size();
+            }
+            centrals.reserve(total);
+            for(auto &p : parts) {
+                std::move(p.begin(), p.end(), std::back_inserter(centrals));
+            }
+        }
+    }
+    if(!parsed) {
+        centrals.clear();
+        centrals.reserve(std::min<uint64_t>(num_entries, dir_size/46));
+        parse_central_records(d, dir_size, 0, dir_size, centrals);
+    }
+    // Some writers store only the low 16 bits of the count when they
+    // do not write zip64 records.
+    if(centrals.size() != num_entries && centrals.size() % 0x10000 != num_entries) {
+        throw std::runtime_error("Zip file broken, end record has incorrect directory size.");
     }
 }
 
-void ZipFile::readCentralDirectory() {
-    while(true) {
-        auto curloc = zipfile.tell();
-        uint32_t head = zipfile.read32le();
-        if(head != CENTRAL_SIG) {
-            zipfile.seek(curloc);
-            break;
+void ZipFile::readLocalFileHeaders() {
+    STATS_TIME(PHASE_PARSE_LOCAL);
+    entries.resize(centrals.size());
+    data_offsets.resize(centrals.size());
+#ifdef _WIN32
+    // No positioned reads on a shared descriptor.
+    const size_t threads = memory ? parse_threads(centrals.size(), MIN_LOCAL_CHUNK) : 1;
+#else
+    const size_t threads = parse_threads(centrals.size(), MIN_LOCAL_CHUNK);
+#endif
+    // Each thread does a contiguous run of entries, which are nearly
+    // always in file order, so neighbouring headers come in one read.
+    run_parallel(threads, [this, threads](size_t part) {
+        HeaderReader reader(zipfile, memory, fsize);
+        const size_t begin = part*centrals.size()/threads;
+        const size_t end = (part + 1)*centrals.size()/threads;
+        for(size_t i=begin; i<end; i++) {
+            readLocalFileHeader(reader, i, end);
+        }
+    });
+}
+
+void ZipFile::readLocalFileHeader(HeaderReader &reader, size_t i, size_t end) {
+    const auto &ch = centrals[i];
+    const uint64_t pos = prefix_size + ch.local_header_rel_offset;
+    if(pos >= dir_start || dir_start - pos < 4 + LOCAL_HEADER_SIZE) {
+        throw std::runtime_error("Zip file broken, local header offset points past the entries: " + ch.fname);
+    }
+    if(!reader.has(pos, 4 + LOCAL_HEADER_SIZE)) {
+        // Read as many of the following headers as fit in one block.
+        // Local names are nearly always the same as central ones, the
+        // slack covers extra fields.
+        auto header_end = [this](size_t j) {
+            return prefix_size + centrals[j].local_header_rel_offset + 4 + LOCAL_HEADER_SIZE +
+                centrals[j].fname.size() + HEADER_SLACK;
+        };
+        uint64_t read_end = header_end(i);
+        for(size_t j=i+1; j<end; j++) {
+            const uint64_t next = prefix_size + centrals[j].local_header_rel_offset;
+            if(next < pos || header_end(j) - pos > HEADER_BLOCK) {
+                break;
+            }
+            read_end = std::max(read_end, header_end(j));
         }
-        centrals.push_back(read_central_entry(zipfile));
+        reader.fill(pos, std::min(read_end, dir_start) - pos);
     }
+    const unsigned char *p = reader.get(pos);
+    if(get32le(p) != LOCAL_SIG) {
+        throw std::runtime_error("Zip file broken, local header not found: " + ch.fname);
+    }
+    const uint16_t name_size = get16le(p + 4 + 22);
+    const uint16_t extra_size = get16le(p + 4 + 24);
+    const uint64_t data_start = pos + 4 + LOCAL_HEADER_SIZE + name_size + extra_size;
+    if(data_start > dir_start) {
+        throw std::runtime_error("Zip file broken, local header runs into the central directory: " + ch.fname);
+    }
+    if(!reader.has(pos, data_start - pos)) {
+        reader.fill(pos, data_start - pos);
+    }
+    p = reader.get(pos);
+    const char *name = reinterpret_cast<const char*>(p + 4 + LOCAL_HEADER_SIZE);
+    entries[i] = decode_local_entry(p + 4, std::string(name, name_size),
+                                    std::string(name + name_size, extra_size));
+    auto &lh = entries[i];
+    if(lh.gp_bitflag & FLAG_ENCRYPTED) {
+        throw std::runtime_error("This file is encrypted. Encrypted ZIP archives are not supported.");
+    }
+    // With a data descriptor the local header has zeros instead.
+    lh.compressed_size = ch.compressed_size;
+    lh.uncompressed_size = ch.uncompressed_size;
+    if(lh.gp_bitflag & FLAG_DATA_DESCRIPTOR) {
+        lh.crc32 = ch.crc32;
+    }
+    if(lh.compressed_size > dir_start - data_start) {
+        throw std::runtime_error("Zip file broken, entry data runs into the central directory: " + ch.fname);
+    }
+    data_offsets[i] = data_start;
 }
 
-void ZipFile::unzip(const std::string &prefix) const {
-    int fd = zipfile.fileno();
-    if(fd < 0) {
-        throw_system("Could not open zip file:");
+MMapper ZipFile::map() const {
+    if(memory) {
+        return MMapper(memory, fsize);
     }
+    return zipfile.mmap();
+}
 
-    MMapper map(zipfile);
+UnpackResult ZipFile::unpack(size_t i, const std::string &prefix, const unsigned char *file_start) const {
+    return unpack_entry(prefix, entries[i], centrals[i], file_start + data_offsets[i], entries[i].compressed_size);
+}
 
-    unsigned char *file_start = map;
+RawEntry ZipFile::raw(size_t i, const unsigned char *file_start) const noexcept {
+    const auto &lh = entries[i];
+    return RawEntry{centrals[i].compression_method, lh.crc32, lh.uncompressed_size,
+                    ZipSpan{file_start + data_offsets[i], lh.compressed_size}};
+}
+
+std::unique_ptr<ZipFile> ZipFile::open_nested(size_t i) const {
+    // The parent's data has to outlive the nested archive.
+    std::shared_ptr<const void> keep = owner;
+    const unsigned char *file_start = memory;
+    if(!memory) {
+        auto mapping = std::make_shared<MMapper>(map());
+        file_start = *mapping;
+        keep = std::move(mapping);
+    }
+    const RawEntry e = raw(i, file_start);
+    if(e.compression == ZIP_NO_COMPRESSION) {
+        if(e.data.size != e.uncompressed_size) {
+            throw std::runtime_error("Stored entry has different compressed and uncompressed sizes.");
+        }
+        return std::unique_ptr<ZipFile>(new ZipFile(e.data.data, e.data.size, std::move(keep)));
+    }
+    if((size_t)e.uncompressed_size != e.uncompressed_size) {
+        throw std::runtime_error("Nested archive does not fit in memory.");
+    }
+    // The size in the header is not trusted with an allocation, so the
+    // buffer grows with the data that actually comes out of the decoder.
+    // Reading stops with an error if that ends before the header's size.
+    auto decoded = std::make_shared<std::vector<unsigned char>>();
+    decoded->reserve((size_t)std::min(e.uncompressed_size, 4*e.data.size + EntryReader::DEFAULT_CHUNK_SIZE));
+    EntryReader reader(e);
+    ZipSpan chunk;
+    while(reader.next(chunk)) {
+        decoded->insert(decoded->end(), chunk.data, chunk.data + chunk.size);
+    }
+    return std::unique_ptr<ZipFile>(new ZipFile(decoded->data(), decoded->size(), decoded));
+}
+
+void ZipFile::close() noexcept {
+    zipfile.close();
+}
+
+UnzipTask::UnzipTask(std::shared_ptr<TaskControl> control, std::future<UnzipSummary> result) noexcept :
+    control(std::move(control)), result(std::move(result)) {
+}
+
+bool UnzipTask::wait_for(std::chrono::milliseconds timeout) const {
+    return result.wait_for(timeout) == std::future_status::ready;
+}
+
+UnzipSummary UnzipTask::get() {
+    return result.get();
+}
+
+UnzipSummary ZipFile::unzip(const std::string &prefix, const UnzipOptions &opts) const {
+    return extract(prefix, opts, nullptr);
+}
+
+UnzipTask ZipFile::unzip_async(const std::string &prefix, const UnzipOptions &opts) const {
+    if(t) {
+        // Only one background extraction is tracked at a time.
+        t->join();
+        t.reset();
+    }
+    auto control = std::make_shared<TaskControl>(entries.size());
+    std::promise<UnzipSummary> promise;
+    auto result = promise.get_future();
+    t.reset(new std::thread([this, prefix, opts, control](std::promise<UnzipSummary> p) {
+        try {
+            p.set_value(extract(prefix, opts, control.get()));
+        } catch(...) {
+            p.set_exception(std::current_exception());
+        }
+    }, std::move(promise)));
+    return UnzipTask(std::move(control), std::move(result));
+}
+
+UnzipSummary ZipFile::extract(const std::string &prefix, const UnzipOptions &opts, TaskControl *tc) const {
+    TRACE_SPAN(span, "unzip");
+    // An archive in memory has no file, and nothing to map or read ahead.
+    int fd = -1;
+    if(!memory) {
+        fd = zipfile.fileno();
+        if(fd < 0) {
+            throw_system("Could not open zip file:");
+        }
+    }
+
+    std::unique_ptr<InputSource> input;
+    {
+        STATS_TIME(PHASE_OPEN);
+        input = memory ? memory_input(memory, fsize)
+                       : open_input(zipfile, opts.input, opts.map_window, opts.huge_pages, opts.drop_cache);
+    }
+
+    ArenaScope arena(opts.huge_pages, opts.decoder_memory);
+
+    std::unique_ptr<Prefetcher> prefetcher;
+    if(opts.prefetch != 0 && fd >= 0) {
+        std::vector<PrefetchRange> ranges;
+        ranges.reserve(entries.size());
+        for(size_t i=0; i<entries.size(); i++) {
+            ranges.push_back(PrefetchRange{(uint64_t)data_offsets[i], entries[i].compressed_size});
+        }
+        prefetcher.reset(new Prefetcher(fd, std::move(ranges), opts.prefetch, 64*opts.prefetch));
+    }
+
+    std::unique_ptr<TarWriter> tar;
+    if(opts.tar_fd >= 0) {
+        tar.reset(new TarWriter(opts.tar_fd));
+    }
+
+    ResultChannel results(opts.report, opts.out);
+    // Archive bytes before this have been dropped from the cache.
+    uint64_t released = 0;
+    const uint64_t page = page_size();
+    bool cancelled = false;
     for(size_t i=0; i<entries.size(); i++) {
-        auto r = unpack_entry(prefix, entries[i],
-                centrals[i],
-                file_start + data_offsets[i],
-                entries[i].compressed_size);
-        printf("%s\n", r.msg.c_str());
+        if(tc && tc->is_cancelled()) {
+            cancelled = true;
+            break;
+        }
+        if(prefetcher) {
+            prefetcher->advance(i);
+        }
+        if(data_offsets[i] > fsize || entries[i].compressed_size > fsize - data_offsets[i]) {
+            STATS_COUNT(COUNT_ENTRIES, 1);
+            STATS_COUNT(COUNT_FAILED, 1);
+            results.push(EntryResult{&entries[i], false, "Entry data extends past the end of the file."});
+            if(tc) {
+                tc->add_entry();
+            }
+            continue;
+        }
+        // Handed to the decoder a piece at a time, see InputSource.
+        InputRange data(*input, data_offsets[i], entries[i].compressed_size);
+        auto r = tar ? tar->add(entries[i], centrals[i], data)
+                     : unpack_entry(prefix, entries[i],
+                                    centrals[i],
+                                    data,
+                                    opts.drop_cache,
+                                    tc);
+        if(opts.drop_cache && fd >= 0) {
+            // The kernel only drops whole pages, so the last partial page
+            // is dropped along with the next entry.
+            const uint64_t end = data_offsets[i] + entries[i].compressed_size;
+            // Entries are normally in file order, but nothing requires it.
+            if(end > released) {
+                input->release(released, end - released);
+                drop_cached_range(fd, released, end - released);
+                released = end - end % page;
+            }
+        }
+        if(!r.success && tc && tc->is_cancelled()) {
+            // Interrupted half way, its partial file has been removed.
+            cancelled = true;
+            break;
+        }
+        STATS_COUNT(COUNT_ENTRIES, 1);
+        if(!r.success) {
+            STATS_COUNT(COUNT_FAILED, 1);
+        }
+        results.push(EntryResult{&entries[i], r.success, std::move(r.error)});
+        if(tc) {
+            tc->add_entry();
+        }
+    }
+    if(opts.drop_cache && fd >= 0) {
+        // Read-around may have brought back pages that were already
+        // dropped, so finish with the whole file.
+        input->release(0, fsize);
+        drop_cached_range(fd, 0, 0);
+    }
+    if(tar) {
+        // A cancelled stream is still closed properly, it just has fewer members.
+        tar->finish();
     }
+    auto summary = results.finish();
+    summary.cancelled = cancelled;
+    return summary;
 }
 
 
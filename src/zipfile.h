@@ -19,38 +19,155 @@
 
 #include"zipdefs.h"
 #include"file.h"
+#include"report.h"
+#include"taskcontrol.h"
+#include"mmapper.h"
+#include"decompress.h"
+#include"entryreader.h"
+#include"inputsource.h"
 #include<string>
 #include<vector>
 #include<thread>
+#include<chrono>
+#include<future>
+#include<memory>
+
+class HeaderReader;
+
+/* Parse one header. The file must be positioned just after the
+ * record's signature. */
+localheader read_local_entry(File &f);
+centralheader read_central_entry(File &f);
+
+/* The fixed size parts of the headers, after the signature. */
+const constexpr size_t LOCAL_HEADER_SIZE = 26;
+const constexpr size_t CENTRAL_HEADER_SIZE = 42;
+
+/* Parse a header from its fixed size part and the variable length
+ * fields after it, for when the archive is not read through a File. */
+localheader decode_local_entry(const unsigned char *fixed, std::string fname, std::string extra);
+centralheader decode_central_entry(const unsigned char *fixed, std::string fname, std::string extra, std::string comment);
+
+struct UnzipOptions {
+    ReportMode report = REPORT_DEFAULT;
+    FILE *out = stdout;
+    // How the archive's data is read, see inputsource.h.
+    InputBackend input = INPUT_AUTO;
+    // Map the archive in windows of this many bytes instead of all at once.
+    // Zero maps the whole file.
+    uint64_t map_window = 0;
+    // Drop the archive and the extracted files from the page cache as
+    // they are finished with, so a bulk job does not evict everything else.
+    bool drop_cache = false;
+    // Read this many bytes of compressed data ahead of the decoder in a
+    // background thread. It grows if the decoder still stalls. Zero
+    // disables read-ahead.
+    uint64_t prefetch = 0;
+    // Ask for 2 MB pages for the archive mapping and the decode buffers.
+    bool huge_pages = false;
+    // Fail entries whose decoder needs more than this many bytes at once,
+    // including its 1 MB output buffer. Zero means no limit.
+    uint64_t decoder_memory = 0;
+    // Write the entries as a tar stream to this descriptor instead of
+    // creating files. The prefix is not used.
+    int tar_fd = -1;
+};
+
+/* Handle to an extraction running in the background, see
+ * ZipFile::unzip_async. */
+class UnzipTask final {
+public:
+    UnzipTask(std::shared_ptr<TaskControl> control, std::future<UnzipSummary> result) noexcept;
+
+    UnzipProgress progress() const noexcept { return control->progress(); }
+
+    /* Asks the extraction to stop. It finishes the chunk it is on,
+     * removes the partially written file and skips the rest. */
+    void cancel() noexcept { control->cancel(); }
+
+    /* Returns true if the extraction has finished. */
+    bool wait_for(std::chrono::milliseconds timeout) const;
+
+    /* Waits for the extraction to end. Returns its summary or throws
+     * whatever it threw. May only be called once. */
+    UnzipSummary get();
+
+private:
+    std::shared_ptr<TaskControl> control;
+    std::future<UnzipSummary> result;
+};
 
 class ZipFile {
 
 public:
     ZipFile(const char *fname);
+    /* An archive that is already in memory. The data is used where it
+     * is, and the owner is kept until the ZipFile is destroyed to keep it
+     * alive. Options that work on the file, such as mapping windows and
+     * prefetching, are ignored. */
+    ZipFile(const unsigned char *data, uint64_t size, std::shared_ptr<const void> owner);
     ~ZipFile();
 
     size_t size() const noexcept { return entries.size(); }
 
-    void unzip(const std::string &prefix) const;
+    UnzipSummary unzip(const std::string &prefix, const UnzipOptions &opts=UnzipOptions()) const;
+
+    /* Starts the extraction in a background thread and returns at once.
+     * The ZipFile waits for it to end when destroyed. Starting another
+     * one first waits for the previous one. */
+    UnzipTask unzip_async(const std::string &prefix, const UnzipOptions &opts=UnzipOptions()) const;
 
     const std::vector<localheader> localheaders() const noexcept { return entries; }
+    const localheader& header(size_t i) const noexcept { return entries[i]; }
+    const centralheader& central(size_t i) const noexcept { return centrals[i]; }
+    /* Where the entry's data begins in the archive. */
+    uint64_t data_offset(size_t i) const noexcept { return data_offsets[i]; }
+
+    /* Building blocks for running entries on an outside thread pool,
+     * see batch.h. Unpack takes the start of the mapped archive. */
+    MMapper map() const;
+    UnpackResult unpack(size_t i, const std::string &prefix, const unsigned char *file_start) const;
+    /* The entry's data as it is in the archive, for reading it with an
+     * EntryReader or passing it on without decoding. */
+    RawEntry raw(size_t i, const unsigned char *file_start) const noexcept;
+
+    /* Opens entry i, which is itself an archive, without extracting it.
+     * A stored entry is used in place and a compressed one is decoded
+     * into memory. The result keeps what it needs of this one alive. */
+    std::unique_ptr<ZipFile> open_nested(size_t i) const;
+
+    /* Closes the archive file. The headers can still be read but
+     * nothing can be extracted any more. */
+    void close() noexcept;
 
 private:
 
     void run(const std::string &prefix, int num_threads) const noexcept;
+    UnzipSummary extract(const std::string &prefix, const UnzipOptions &opts, TaskControl *tc) const;
 
+    std::string read_at(uint64_t offset, uint64_t size);
+    void readEndRecord(uint64_t size);
+    void readCentralDirectory(const unsigned char *dir);
     void readLocalFileHeaders();
-    void readCentralDirectory();
+    void readLocalFileHeader(HeaderReader &reader, size_t i, size_t end);
 
     File zipfile;
+    // Set instead of the file for an archive in memory.
+    const unsigned char *memory = nullptr;
+    std::shared_ptr<const void> owner;
     std::vector<localheader> entries;
     std::vector<centralheader> centrals;
-    std::vector<long> data_offsets;
+    std::vector<uint64_t> data_offsets;
 
-    zip64endrecord z64end;
-    zip64locator z64loc;
+    zip64endrecord z64end{};
+    zip64locator z64loc{};
     endrecord endloc;
-    size_t fsize;
+    uint64_t fsize;
+    uint64_t dir_start;
+    uint64_t dir_size;
+    uint64_t num_entries;
+    // Bytes in front of the archive proper, all offsets in it are off by this.
+    uint64_t prefix_size;
 
     mutable std::unique_ptr<std::thread> t;
 };
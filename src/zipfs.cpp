@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include"zipfs.h"
+#include"utils.h"
+#include"stats.h"
+
+#include"portable_endian.h"
+
+#include<algorithm>
+#include<cstring>
+#include<stdexcept>
+
+namespace {
+
+std::vector<std::string> split_path(const std::string &path) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while(start <= path.size()) {
+        auto end = path.find('/', start);
+        if(end == std::string::npos) {
+            end = path.size();
+        }
+        if(end > start && path.compare(start, end - start, ".") != 0) {
+            parts.push_back(path.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return parts;
+}
+
+}
+
+ZipFS::ZipFS(const char *fname, std::shared_ptr<BlockCache> cache, uint64_t block_size) :
+    zip(fname), mapping(zip.map()), file_start(mapping), cache(std::move(cache)), block_size(block_size) {
+    if(block_size == 0) {
+        throw std::runtime_error("Block size must not be zero.");
+    }
+    nodes.push_back(Node{true, NO_ENTRY, {}});
+    for(size_t i=0; i<zip.size(); i++) {
+        add_entry(i);
+    }
+}
+
+ZipFS::ZipFS(const char *fname, uint64_t cache_bytes) :
+    ZipFS(fname, std::make_shared<BlockCache>(cache_bytes)) {
+}
+
+ZipFS::~ZipFS() {
+    cache->forget(this);
+}
+
+void ZipFS::add_entry(size_t i) {
+    const auto &lh = zip.header(i);
+    const bool is_dir = detect_filetype(lh, zip.central(i)) == DIRECTORY_ENTRY;
+    const auto parts = split_path(lh.fname);
+    if(parts.empty()) {
+        return;
+    }
+    size_t current = 0;
+    for(size_t p=0; p<parts.size(); p++) {
+        const bool last = p + 1 == parts.size();
+        auto it = nodes[current].children.find(parts[p]);
+        if(it == nodes[current].children.end()) {
+            const size_t child = nodes.size();
+            nodes.push_back(Node{!last || is_dir, last ? i : NO_ENTRY, {}});
+            nodes[current].children.emplace(parts[p], child);
+            current = child;
+            continue;
+        }
+        Node &n = nodes[it->second];
+        if(!last && !n.is_dir) {
+            throw std::runtime_error("Archive has a file that is also a directory: " + lh.fname);
+        }
+        if(last) {
+            if(n.is_dir != is_dir) {
+                throw std::runtime_error("Archive has a file that is also a directory: " + lh.fname);
+            }
+            // A later entry of the same name replaces the earlier one,
+            // the same as when extracting.
+            n.entry = i;
+        }
+        current = it->second;
+    }
+}
+
+const ZipFS::Node* ZipFS::find(const std::string &path) const {
+    size_t current = 0;
+    for(const auto &part : split_path(path)) {
+        const Node &n = nodes[current];
+        auto it = n.children.find(part);
+        if(it == n.children.end()) {
+            return nullptr;
+        }
+        current = it->second;
+    }
+    return &nodes[current];
+}
+
+const ZipFS::Node& ZipFS::lookup(const std::string &path) const {
+    const Node *n = find(path);
+    if(!n) {
+        throw std::runtime_error("No such file in archive: " + path);
+    }
+    return *n;
+}
+
+bool ZipFS::exists(const std::string &path) const {
+    return find(path) != nullptr;
+}
+
+ZipStat ZipFS::stat(const std::string &path) const {
+    const Node &n = lookup(path);
+    ZipStat s;
+    memset(&s, 0, sizeof(s));
+    if(n.entry == NO_ENTRY) {
+        s.type = DIRECTORY_ENTRY;
+        s.mode = 0755;
+        return s;
+    }
+    const auto &lh = zip.header(n.entry);
+    const auto &ch = zip.central(n.entry);
+    s.type = detect_filetype(lh, ch);
+    s.size = s.type == DIRECTORY_ENTRY ? 0 : lh.uncompressed_size;
+    if(ch.version_made_by>>8 == MADE_BY_UNIX) {
+        s.mode = (ch.external_file_attributes >> 16) & 07777;
+    } else {
+        s.mode = s.type == DIRECTORY_ENTRY ? 0755 : 0644;
+    }
+    if(lh.unix.atime != 0) {
+        s.uid = lh.unix.uid;
+        s.gid = lh.unix.gid;
+        s.mtime = lh.unix.mtime;
+    } else {
+        s.mtime = dos_to_unix_time(lh.last_mod_date, lh.last_mod_time);
+    }
+    s.compression = ch.compression_method;
+    s.compressed_size = lh.compressed_size;
+    return s;
+}
+
+std::vector<std::string> ZipFS::readdir(const std::string &path) const {
+    const Node &n = lookup(path);
+    if(!n.is_dir) {
+        throw std::runtime_error("Not a directory: " + path);
+    }
+    std::vector<std::string> names;
+    names.reserve(n.children.size());
+    for(const auto &c : n.children) {
+        names.push_back(c.first);
+    }
+    return names;
+}
+
+ZipFSFile ZipFS::open(const std::string &path) const {
+    const Node &n = lookup(path);
+    if(n.is_dir) {
+        throw std::runtime_error("Is a directory: " + path);
+    }
+    const auto &lh = zip.header(n.entry);
+    switch(zip.central(n.entry).compression_method) {
+    case ZIP_NO_COMPRESSION:
+        if(lh.compressed_size != lh.uncompressed_size) {
+            throw std::runtime_error("Stored entry has different compressed and uncompressed sizes.");
+        }
+        break;
+    case ZIP_DEFLATE:
+    case ZIP_LZMA:
+        break;
+    default:
+        throw std::runtime_error("Unsupported compression format.");
+    }
+    return ZipFSFile(this, n.entry);
+}
+
+ZipSpan ZipFS::view(const std::string &path) const {
+    const RawEntry e = raw(path);
+    if(e.compression != ZIP_NO_COMPRESSION) {
+        throw std::runtime_error("File is compressed: " + path);
+    }
+    if(e.data.size != e.uncompressed_size) {
+        throw std::runtime_error("Stored entry has different compressed and uncompressed sizes.");
+    }
+    return e.data;
+}
+
+RawEntry ZipFS::raw(const std::string &path) const {
+    const Node &n = lookup(path);
+    if(n.is_dir) {
+        throw std::runtime_error("Is a directory: " + path);
+    }
+    return zip.raw(n.entry, file_start);
+}
+
+GzipFrame gzip_frame(const RawEntry &e) {
+    if(e.compression != ZIP_DEFLATE) {
+        throw std::runtime_error("Only deflated entries can be sent as gzip.");
+    }
+    // Deflate, no flags, no time stamp, no extra flags, unknown OS.
+    GzipFrame g = {{0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255}, {}};
+    // Gzip keeps the size modulo 2^32.
+    const uint32_t trailer[2] = {htole32(e.crc32), htole32((uint32_t)e.uncompressed_size)};
+    memcpy(g.trailer, trailer, sizeof(g.trailer));
+    return g;
+}
+
+ZipFSFile::ZipFSFile(const ZipFS *fs, size_t entry) noexcept : fs(fs), entry(entry) {
+}
+
+ZipFSFile::ZipFSFile(ZipFSFile &&other) noexcept = default;
+ZipFSFile& ZipFSFile::operator=(ZipFSFile &&other) noexcept = default;
+ZipFSFile::~ZipFSFile() = default;
+
+uint64_t ZipFSFile::size() const noexcept {
+    return fs->zip.header(entry).uncompressed_size;
+}
+
+size_t ZipFSFile::pread(void *buf, size_t count, uint64_t offset) {
+    const uint64_t fsize = size();
+    if(offset >= fsize) {
+        return 0;
+    }
+    count = (size_t)std::min<uint64_t>(count, fsize - offset);
+    unsigned char *out = static_cast<unsigned char*>(buf);
+    const auto &ch = fs->zip.central(entry);
+    if(ch.compression_method == ZIP_NO_COMPRESSION) {
+        memcpy(out, fs->file_start + fs->zip.data_offset(entry) + offset, count);
+        return count;
+    }
+    size_t done = 0;
+    while(done < count) {
+        const uint64_t pos = offset + done;
+        const uint64_t block = pos / fs->block_size;
+        CachedBlock b = fs->cache->get(BlockKey{fs, entry, block});
+        if(!b) {
+            b = decode_block(block);
+        }
+        const size_t in_block = (size_t)(pos % fs->block_size);
+        const size_t n = std::min(b->size() - in_block, count - done);
+        memcpy(out + done, b->data() + in_block, n);
+        done += n;
+    }
+    return count;
+}
+
+CachedBlock ZipFSFile::decode_block(uint64_t block) {
+    const auto &lh = fs->zip.header(entry);
+    const uint64_t start = block*fs->block_size;
+    if(!reader || reader->position() > start) {
+        reader.reset();
+        reader.reset(new EntryReader(fs->zip.raw(entry, fs->file_start)));
+    }
+    // The blocks before the wanted one have to be decoded anyway, so they
+    // go to the cache as well.
+    while(true) {
+        const uint64_t current = reader->position() / fs->block_size;
+        const uint64_t length = std::min(fs->block_size, lh.uncompressed_size - reader->position());
+        std::shared_ptr<std::vector<unsigned char>> b;
+        try {
+            b = std::make_shared<std::vector<unsigned char>>(length);
+            reader->read(b->data(), length);
+        } catch(...) {
+            // The decoder's state is unknown, start over next time.
+            reader.reset();
+            throw;
+        }
+        fs->cache->put(BlockKey{fs, entry, current}, b);
+        if(current == block) {
+            return b;
+        }
+    }
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include"zipfile.h"
+#include"entryreader.h"
+#include"mmapper.h"
+#include"blockcache.h"
+
+#include<cstdint>
+#include<map>
+#include<memory>
+#include<string>
+#include<vector>
+
+struct ZipStat {
+    filetype type;
+    uint64_t size;
+    uint32_t mode; // Permission bits only.
+    uint32_t uid;
+    uint32_t gid;
+    int64_t mtime;
+    uint16_t compression;
+    uint64_t compressed_size;
+};
+
+/* The header and trailer that make a deflated entry a gzip member when
+ * written on either side of its data. */
+struct GzipFrame {
+    unsigned char header[10];
+    unsigned char trailer[8];
+};
+
+/* Throws unless the entry is deflated. */
+GzipFrame gzip_frame(const RawEntry &e);
+
+class ZipFS;
+
+/* A file opened from a ZipFS. A handle may only be used by one thread at
+ * a time, open one per thread instead. Handles must not outlive their
+ * file system. */
+class ZipFSFile final {
+public:
+    ZipFSFile(ZipFSFile &&other) noexcept;
+    ZipFSFile& operator=(ZipFSFile &&other) noexcept;
+    ~ZipFSFile();
+
+    uint64_t size() const noexcept;
+
+    /* Reads up to count bytes starting at offset. Returns fewer only at
+     * the end of the file. Throws if the entry's data is damaged. The
+     * CRC is checked whenever the entry gets decoded to its end, stored
+     * entries are returned as they are. */
+    size_t pread(void *buf, size_t count, uint64_t offset);
+
+private:
+    friend class ZipFS;
+    ZipFSFile(const ZipFS *fs, size_t entry) noexcept;
+
+    CachedBlock decode_block(uint64_t block);
+
+    const ZipFS *fs;
+    size_t entry;
+    // Kept between reads so that reading a file front to back decodes it once.
+    std::unique_ptr<EntryReader> reader;
+};
+
+/* A read-only view of an archive as a directory tree, for serving files
+ * straight out of it without extracting anything.
+ *
+ * Compressed entries are decoded in blocks that go to a cache shared by
+ * all readers, so a file that is read often is decoded once and then
+ * served from memory. Stored entries are copied straight from the
+ * memory mapped archive and bypass the cache.
+ *
+ * Paths are relative to the root of the archive. Leading slashes, empty
+ * components and "." are ignored, ".." is not resolved. Directories that
+ * only appear as part of other entries' names exist as well. Looking up
+ * a path that does not exist throws. Everything except ZipFSFile is safe
+ * to use from several threads at once. */
+class ZipFS final {
+public:
+    static const constexpr uint64_t DEFAULT_BLOCK_SIZE = 64*1024;
+
+    /* The cache can be shared between several file systems. */
+    ZipFS(const char *fname, std::shared_ptr<BlockCache> cache, uint64_t block_size=DEFAULT_BLOCK_SIZE);
+    explicit ZipFS(const char *fname, uint64_t cache_bytes=64*1024*1024);
+    ZipFS(const ZipFS &) = delete;
+    ZipFS& operator=(const ZipFS &) = delete;
+    ~ZipFS();
+
+    bool exists(const std::string &path) const;
+    ZipStat stat(const std::string &path) const;
+
+    /* Names of the directory's children, sorted. */
+    std::vector<std::string> readdir(const std::string &path) const;
+
+    /* Directories can not be opened. A symbolic link reads as its target. */
+    ZipFSFile open(const std::string &path) const;
+
+    /* The contents of a stored file without copying them, valid as long
+     * as the file system. Throws if the file is compressed. Nothing is
+     * checked against the CRC. */
+    ZipSpan view(const std::string &path) const;
+
+    /* The compressed data of a file, for passing it on as it is, such as
+     * deflate or gzip content encoding in HTTP. */
+    RawEntry raw(const std::string &path) const;
+
+private:
+    friend class ZipFSFile;
+
+    struct Node {
+        bool is_dir;
+        size_t entry; // NO_ENTRY for directories without an entry of their own.
+        std::map<std::string, size_t> children;
+    };
+    static const constexpr size_t NO_ENTRY = (size_t)-1;
+
+    void add_entry(size_t i);
+    const Node* find(const std::string &path) const;
+    const Node& lookup(const std::string &path) const;
+
+    ZipFile zip;
+    MMapper mapping;
+    const unsigned char *file_start;
+    std::shared_ptr<BlockCache> cache;
+    uint64_t block_size;
+    std::vector<Node> nodes; // The root is first.
+};
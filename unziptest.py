@@ -16,12 +16,18 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 
-import os, sys, stat, unittest, tempfile, subprocess
+import io, os, sys, gzip, stat, json, struct, signal, tarfile, zipfile, zlib, unittest, tempfile, subprocess
 import platform
+try:
+    import resource
+except ImportError:
+    resource = None # Windows
 from zipfile import ZipFile
 
 datadir = None
 unzip_exe = None
+# Archives made by bench/zipgen at build time.
+corpusdir = os.environ.get('ZIPTEST_CORPUS')
 
 class ZipTestBase(unittest.TestCase):
 
@@ -122,11 +128,828 @@ class TestUnzip(ZipTestBase):
                 self.assertTrue(stat.S_ISLNK(lstats.st_mode))
                 self.assertEqual(os.readlink(outsymlink), 'source.txt')
 
+class ExcOnlyTest(unittest.TestCase):
+
+    def setUp(self):
+        if not os.path.basename(unzip_exe).startswith('exc-unzip'):
+            self.skipTest('only implemented in the exception version')
+
+class TestOutputModes(ExcOnlyTest):
+
+    def run_mode(self, zipname, option):
+        zfile = os.path.join(datadir, zipname)
+        with tempfile.TemporaryDirectory() as testdir:
+            p = subprocess.run([unzip_exe, option, zfile], cwd=testdir,
+                               stdout=subprocess.PIPE, check=True)
+        return p.stdout.decode()
+
+    def test_quiet(self):
+        self.assertEqual(self.run_mode('subdirs.zip', '--quiet'), '')
+
+    def test_summary(self):
+        with ZipFile(os.path.join(datadir, 'manyfiles.zip')) as zf:
+            infos = zf.infolist()
+        expected = '%d entries, %d ok, 0 failed, %d bytes\n' % (len(infos), len(infos),
+                                                                sum(i.file_size for i in infos))
+        self.assertEqual(self.run_mode('manyfiles.zip', '--summary'), expected)
+
+    def test_jsonl(self):
+        with ZipFile(os.path.join(datadir, 'subdirs.zip')) as zf:
+            infos = zf.infolist()
+        lines = self.run_mode('subdirs.zip', '--jsonl').splitlines()
+        records = [json.loads(l) for l in lines]
+        self.assertEqual([r['name'] for r in records], [i.filename for i in infos])
+        for r, i in zip(records, infos):
+            self.assertTrue(r['ok'])
+            self.assertEqual(r['uncompressed_size'], i.file_size)
+
+    def test_failures_reported(self):
+        zfile = os.path.join(datadir, 'basic.zip')
+        with tempfile.TemporaryDirectory() as testdir:
+            subprocess.check_call([unzip_exe, '--quiet', zfile], cwd=testdir)
+            # Everything exists now, so every entry fails.
+            for options in ([], ['--stream'], ['--progress']):
+                with self.subTest(options=options):
+                    p = subprocess.run([unzip_exe, '--jsonl'] + options + [zfile], cwd=testdir,
+                                       stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+                    self.assertEqual(p.returncode, 1)
+                    records = [json.loads(l) for l in p.stdout.decode().splitlines()]
+                    self.assertTrue(len(records) > 0)
+                    for r in records:
+                        self.assertFalse(r['ok'])
+                        self.assertIn('exists', r['error'])
+
+class TestAsync(ExcOnlyTest, ZipTestBase):
+
+    def test_progress(self):
+        zfile = os.path.join(datadir, 'manyfiles.zip')
+        with ZipFile(zfile) as zf:
+            count = len(zf.infolist())
+        with tempfile.TemporaryDirectory() as pdir:
+            with tempfile.TemporaryDirectory() as testdir:
+                with ZipFile(zfile) as zf:
+                    zf.extractall(path=pdir)
+                p = subprocess.run([unzip_exe, '--quiet', '--progress', zfile], cwd=testdir,
+                                   stderr=subprocess.PIPE, check=True)
+                self.dirs_equal(pdir, testdir)
+        self.assertIn('%d/%d entries' % (count, count), p.stderr.decode())
+
+    def test_cancel(self):
+        if not corpusdir:
+            self.skipTest('generated corpus not available')
+        zfile = os.path.join(corpusdir, 'corpus-test.zip')
+        with tempfile.TemporaryDirectory() as testdir:
+            p = subprocess.Popen([unzip_exe, '--quiet', '--progress', zfile], cwd=testdir,
+                                 stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            # The first progress line means the handler is in place. The
+            # extraction may still finish before the signal gets there.
+            p.stderr.read(1)
+            p.send_signal(signal.SIGINT)
+            out, _ = p.communicate()
+            self.assertIn(p.returncode, (0, 1))
+            if p.returncode == 1:
+                self.assertIn('cancelled', out.decode())
+            for root, dirs, files in os.walk(testdir):
+                for f in files:
+                    self.assertFalse(f.endswith('$ZIPTMP'), f)
+
+class TestBatch(ExcOnlyTest, ZipTestBase):
+
+    archives = ['basic.zip', 'subdirs.zip', 'manyfiles.zip', 'lzma.zip']
+
+    def check_batch(self, testdir):
+        for name in self.archives:
+            with tempfile.TemporaryDirectory() as pdir:
+                with ZipFile(os.path.join(datadir, name)) as zf:
+                    zf.extractall(path=pdir)
+                self.dirs_equal(pdir, os.path.join(testdir, name[:-4]))
+
+    def test_arguments(self):
+        with tempfile.TemporaryDirectory() as testdir:
+            subprocess.check_call([unzip_exe, '--batch', '--quiet', '--threads', '3'] +
+                                  [os.path.join(datadir, n) for n in self.archives], cwd=testdir)
+            self.check_batch(testdir)
+
+    def test_stdin(self):
+        names = ''.join(os.path.join(datadir, n) + '\n' for n in self.archives)
+        with tempfile.TemporaryDirectory() as testdir:
+            p = subprocess.run([unzip_exe, '--batch', '--jsonl'], cwd=testdir, input=names.encode(),
+                               stdout=subprocess.PIPE, check=True)
+            self.check_batch(testdir)
+        records = [json.loads(l) for l in p.stdout.decode().splitlines()]
+        with ZipFile(os.path.join(datadir, 'subdirs.zip')) as zf:
+            expected = ['subdirs/' + i.filename for i in zf.infolist()]
+        names = [r['name'] for r in records]
+        for e in expected:
+            self.assertIn(e, names)
+        self.assertTrue(all(r['ok'] for r in records))
+
+    def test_missing_archive(self):
+        with tempfile.TemporaryDirectory() as testdir:
+            p = subprocess.run([unzip_exe, '--batch', '--quiet', os.path.join(datadir, 'basic.zip'),
+                                'nonexisting.zip'], cwd=testdir, stdout=subprocess.PIPE)
+            self.assertEqual(p.returncode, 1)
+            self.assertTrue(p.stdout.decode().startswith('FAIL: nonexisting.zip\n'))
+            self.assertTrue(os.path.isdir(os.path.join(testdir, 'basic')))
+
+class TestTar(ExcOnlyTest, ZipTestBase):
+
+    def tar_matches_zip(self, tf, zfile):
+        with ZipFile(zfile) as zf:
+            members = tf.getmembers()
+            self.assertEqual([m.name.rstrip('/') for m in members],
+                             [i.filename.rstrip('/') for i in zf.infolist()])
+            for m in members:
+                if m.isfile():
+                    self.assertEqual(tf.extractfile(m).read(), zf.read(m.name))
+
+    def test_to_file(self):
+        for name in ['basic.zip', 'small.zip', 'lzma.zip', 'direntry.zip', 'zip64.zip', 'manyfiles.zip']:
+            zfile = os.path.join(datadir, name)
+            with tempfile.TemporaryDirectory() as testdir:
+                subprocess.check_call([unzip_exe, '--quiet', '--tar', 'out.tar', zfile], cwd=testdir)
+                self.assertEqual(os.listdir(testdir), ['out.tar'])
+                with tarfile.open(os.path.join(testdir, 'out.tar')) as tf:
+                    self.tar_matches_zip(tf, zfile)
+
+    def test_to_stdout(self):
+        with tempfile.TemporaryDirectory() as testdir:
+            p = subprocess.run([unzip_exe, '--tar', '-', os.path.join(datadir, 'symlink.zip')],
+                               cwd=testdir, stdout=subprocess.PIPE, stderr=subprocess.PIPE, check=True)
+            self.assertEqual(os.listdir(testdir), [])
+            self.assertIn('OK: symlink.txt', p.stderr.decode())
+            with tarfile.open(fileobj=io.BytesIO(p.stdout)) as tf:
+                self.tar_matches_zip(tf, os.path.join(datadir, 'symlink.zip'))
+                link = tf.getmember('symlink.txt')
+                self.assertTrue(link.issym())
+                self.assertEqual(link.linkname, 'source.txt')
+        p = subprocess.run([unzip_exe, '--quiet', '--tar', '-', os.path.join(datadir, 'unixperms.zip')],
+                           stdout=subprocess.PIPE, check=True)
+        with tarfile.open(fileobj=io.BytesIO(p.stdout)) as tf:
+            self.assertEqual(tf.getmember('script.py').mode, 0o755)
+
+    def test_long_names(self):
+        names = ['d'*120 + '/' + 'f'*90, 'x'*250]
+        with tempfile.TemporaryDirectory() as testdir:
+            zfile = os.path.join(testdir, 'long.zip')
+            with zipfile.ZipFile(zfile, 'w') as zf:
+                for n in names:
+                    info = zipfile.ZipInfo(n)
+                    info.create_system = 3
+                    info.external_attr = 0o100644 << 16
+                    zf.writestr(info, n.encode(), compress_type=zipfile.ZIP_DEFLATED)
+            subprocess.check_call([unzip_exe, '--quiet', '--tar', 'out.tar', zfile], cwd=testdir)
+            with tarfile.open(os.path.join(testdir, 'out.tar')) as tf:
+                self.tar_matches_zip(tf, zfile)
+
+class TestZipFS(ExcOnlyTest):
+
+    def test_cat(self):
+        for name in ['basic.zip', 'small.zip', 'lzma.zip', 'subdirs.zip', 'zip64.zip', 'symlink.zip']:
+            zfile = os.path.join(datadir, name)
+            with ZipFile(zfile) as zf:
+                for info in zf.infolist():
+                    p = subprocess.run([unzip_exe, '--cat', info.filename, zfile],
+                                       stdout=subprocess.PIPE, check=True)
+                    self.assertEqual(p.stdout, zf.read(info))
+
+    def test_ls(self):
+        zfile = os.path.join(datadir, 'subdirs.zip')
+        ls = lambda d: subprocess.check_output([unzip_exe, '--ls', d, zfile]).decode().splitlines()
+        self.assertEqual(ls('/'), ['a/'])
+        self.assertEqual(ls('a/b/c/d'), ['e/', 'f/'])
+        self.assertEqual(ls('./a//b/c/d/e/'), ['file1.txt'])
+        self.assertEqual(subprocess.check_output([unzip_exe, '--ls', '.', os.path.join(datadir, 'direntry.zip')]),
+                         b'subdir/\n')
+
+    def test_gzip(self):
+        with tempfile.TemporaryDirectory() as d:
+            # The sizes and CRC of these are only in the data descriptors.
+            descfile = os.path.join(d, 'desc.zip')
+            with open(descfile, 'wb') as f:
+                with ZipFile(Unseekable(f), 'w') as zf:
+                    write_layout_files(zf)
+            for zfile in [os.path.join(datadir, 'basic.zip'), os.path.join(datadir, 'zip64.zip'), descfile]:
+                with ZipFile(zfile) as zf:
+                    for info in zf.infolist():
+                        p = subprocess.run([unzip_exe, '--cat', info.filename, '--gzip', zfile],
+                                           stdout=subprocess.PIPE, check=True)
+                        self.assertEqual(p.stdout[:2], b'\x1f\x8b')
+                        self.assertEqual(gzip.decompress(p.stdout), zf.read(info))
+
+    def test_errors(self):
+        for args in [['--cat', 'nonexisting.txt', 'basic.zip'],
+                     ['--cat', 'subdir', 'direntry.zip'],
+                     ['--cat', 'small.txt', '--gzip', 'small.zip'],
+                     ['--ls', 'content.txt', 'basic.zip']]:
+            args[-1] = os.path.join(datadir, args[-1])
+            p = subprocess.run([unzip_exe] + args, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            self.assertEqual(p.returncode, 1)
+            if args[0] == '--cat':
+                self.assertEqual(p.stdout, b'')
+
+class TestCheck(ExcOnlyTest):
+
+    def check(self, zfile):
+        return self.check_args([zfile])
+
+    def check_args(self, args):
+        with tempfile.TemporaryDirectory() as testdir:
+            p = subprocess.run([unzip_exe, '--test', '--jsonl'] + args, cwd=testdir, stdout=subprocess.PIPE)
+            self.assertEqual(os.listdir(testdir), [])
+        return p.returncode, [json.loads(l) for l in p.stdout.decode().splitlines()]
+
+    def test_archives(self):
+        for name in ['basic.zip', 'small.zip', 'lzma.zip', 'subdirs.zip', 'zip64.zip', 'symlink.zip', 'manyfiles.zip']:
+            zfile = os.path.join(datadir, name)
+            with self.subTest(name=name):
+                rc, results = self.check(zfile)
+                self.assertEqual(rc, 0)
+                with ZipFile(zfile) as zf:
+                    self.assertEqual(sorted(r['name'] for r in results), sorted(zf.namelist()))
+                self.assertTrue(all(r['ok'] for r in results))
+
+    def test_damaged(self):
+        with tempfile.TemporaryDirectory() as d:
+            for compression in (zipfile.ZIP_STORED, zipfile.ZIP_DEFLATED):
+                zfile = os.path.join(d, 'damaged.zip')
+                with ZipFile(zfile, 'w', compression) as zf:
+                    zf.writestr('good.txt', b'fine\n' * 1000)
+                    zf.writestr('bad.txt', b'broken\n' * 1000)
+                with ZipFile(zfile) as zf:
+                    info = zf.getinfo('bad.txt')
+                with open(zfile, 'r+b') as f:
+                    f.seek(info.header_offset + 30 + len(info.filename) + len(info.extra) + info.compress_size // 2)
+                    b = f.read(1)
+                    f.seek(-1, 1)
+                    f.write(bytes([b[0] ^ 0x55]))
+                rc, results = self.check(zfile)
+                self.assertEqual(rc, 1)
+                self.assertEqual({r['name']: r['ok'] for r in results}, {'good.txt': True, 'bad.txt': False})
+
+    def test_empty_entries(self):
+        data = io.BytesIO()
+        with ZipFile(data, 'w') as zf:
+            zf.writestr('stored', b'', compress_type=zipfile.ZIP_STORED)
+            zf.writestr('deflated', b'', compress_type=zipfile.ZIP_DEFLATED)
+            zf.writestr('next', b'fine\n')
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'empty.zip')
+            with open(zfile, 'wb') as f:
+                f.write(data.getvalue())
+            rc, results = self.check(zfile)
+            self.assertEqual(rc, 0)
+            # An empty entry's CRC is 0, make it claim otherwise.
+            with ZipFile(zfile) as zf:
+                infos = zf.infolist()[:2]
+                central = zf.start_dir
+            with open(zfile, 'r+b') as f:
+                for info in infos:
+                    f.seek(info.header_offset + 14)
+                    f.write(struct.pack('<I', 1))
+                    f.seek(central + 16)
+                    f.write(struct.pack('<I', 1))
+                    central += 46 + len(info.filename) + len(info.extra) + len(info.comment)
+            rc, results = self.check(zfile)
+            self.assertEqual(rc, 1)
+            self.assertEqual({r['name']: r['ok'] for r in results}, {'stored': False, 'deflated': False, 'next': True})
+
+    def test_pending_output(self):
+        # Inflate holds back some output for entries like these until it
+        # is called again after the last input.
+        sizes = [65535, 65536, 65537, 65539, 131073, 1000003]
+        data = io.BytesIO()
+        with ZipFile(data, 'w', zipfile.ZIP_DEFLATED) as zf:
+            for size in sizes:
+                zf.writestr('a%d' % size, b'a' * size)
+                zf.writestr('lzma%d' % size, b'a' * size, compress_type=zipfile.ZIP_LZMA)
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'pending.zip')
+            with open(zfile, 'wb') as f:
+                f.write(data.getvalue())
+            rc, results = self.check(zfile)
+            self.assertEqual(rc, 0)
+            self.assertEqual(len(results), 2 * len(sizes))
+            for size in sizes:
+                for name in ('a%d' % size, 'lzma%d' % size):
+                    p = subprocess.run([unzip_exe, '--cat', name, zfile], stdout=subprocess.PIPE, check=True)
+                    self.assertEqual(p.stdout, b'a' * size)
+            outer = os.path.join(d, 'outer.zip')
+            with ZipFile(outer, 'w', zipfile.ZIP_DEFLATED) as zf:
+                zf.writestr('pending.zip', data.getvalue())
+            rc, results = self.check_args(['--inner', 'pending.zip', outer])
+            self.assertEqual(rc, 0)
+            self.assertEqual(len(results), 2 * len(sizes))
+
+def regular_file(name):
+    """A ZipInfo for a regular Unix file, which writestr does not make from a name."""
+    info = zipfile.ZipInfo(name)
+    info.create_system = 3
+    info.external_attr = 0o100644 << 16
+    return info
+
+class Unseekable(io.RawIOBase):
+    """Makes zipfile write sizes in data descriptors after the data."""
+
+    def __init__(self, f):
+        self.f = f
+
+    def writable(self):
+        return True
+
+    def write(self, b):
+        return self.f.write(b)
+
+def write_zip64_central(fname, files):
+    """Stored entries where every size and offset is in zip64 extra fields."""
+    out = b''
+    central = b''
+    for name, data in files:
+        name = name.encode()
+        crc = zlib.crc32(data)
+        offset = len(out)
+        out += struct.pack('<IHHHHHIIIHH', 0x04034b50, 45, 0, 0, 0, 0x21, crc,
+                           0xFFFFFFFF, 0xFFFFFFFF, len(name), 20)
+        out += name + struct.pack('<HHQQ', 1, 16, len(data), len(data)) + data
+        central += struct.pack('<IHHHHHHIIIHHHHHII', 0x02014b50, (3 << 8) | 45, 45, 0, 0, 0, 0x21, crc,
+                               0xFFFFFFFF, 0xFFFFFFFF, len(name), 32, 0, 0xFFFF, 0,
+                               0o100644 << 16, 0xFFFFFFFF)
+        central += name + struct.pack('<HHQQQI', 1, 28, len(data), len(data), offset, 0)
+    dir_start = len(out)
+    out += central
+    z64_pos = len(out)
+    out += struct.pack('<IQHHIIQQQQ', 0x06064b50, 44, 45, 45, 0, 0, len(files), len(files),
+                       len(central), dir_start)
+    out += struct.pack('<IIQI', 0x07064b50, 0, z64_pos, 1)
+    out += struct.pack('<IHHHHIIH', 0x06054b50, 0, 0, 0xFFFF, 0xFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0)
+    with open(fname, 'wb') as f:
+        f.write(out)
+
+layout_files = [('a.txt', b'first file\n' * 100), ('dir/b.txt', b'second file\n' * 1000), ('empty', b'')]
+
+def write_layout_files(zf):
+    for name, data in layout_files:
+        info = zipfile.ZipInfo(name)
+        info.create_system = 3
+        info.external_attr = 0o100644 << 16
+        zf.writestr(info, data, compress_type=zipfile.ZIP_DEFLATED)
+
+class TestArchiveLayouts(ExcOnlyTest, ZipTestBase):
+
+    def check_archive(self, zfile):
+        with tempfile.TemporaryDirectory() as pdir:
+            with tempfile.TemporaryDirectory() as testdir:
+                with ZipFile(zfile) as zf:
+                    zf.extractall(path=pdir)
+                subprocess.check_call([unzip_exe, '--quiet', zfile], cwd=testdir)
+                self.dirs_equal(pdir, testdir)
+
+    def test_data_descriptors(self):
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'desc.zip')
+            with open(zfile, 'wb') as f:
+                with ZipFile(Unseekable(f), 'w') as zf:
+                    write_layout_files(zf)
+            with ZipFile(zfile) as zf:
+                self.assertTrue(all(i.flag_bits & 8 for i in zf.infolist()))
+            self.check_archive(zfile)
+
+    def test_zip64_central_directory(self):
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'z64.zip')
+            write_zip64_central(zfile, layout_files)
+            self.check_archive(zfile)
+
+    def test_prefix_and_comment(self):
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'sfx.zip')
+            with open(zfile, 'wb') as f:
+                f.write(b'#!/bin/sh\nexit 0\n' + b'PK\x05\x06' * 100)
+                with ZipFile(f, 'w') as zf:
+                    zf.comment = b'archive comment'
+                    write_layout_files(zf)
+            self.check_archive(zfile)
+
+    def test_not_a_zip(self):
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'junk.zip')
+            with open(zfile, 'wb') as f:
+                f.write(b'not an archive' * 10)
+            p = subprocess.run([unzip_exe, zfile], cwd=d, stdout=subprocess.PIPE)
+            self.assertEqual(p.returncode, 1)
+            self.assertIn(b'end of central directory', p.stdout)
+
+class TestStream(ExcOnlyTest, ZipTestBase):
+
+    def stream(self, data, testdir):
+        return subprocess.run([unzip_exe, '--quiet', '--stream', '-'], cwd=testdir, input=data,
+                              stdout=subprocess.PIPE)
+
+    def check_same(self, zfile):
+        with tempfile.TemporaryDirectory() as pdir:
+            with tempfile.TemporaryDirectory() as testdir:
+                with ZipFile(zfile) as zf:
+                    zf.extractall(path=pdir)
+                with open(zfile, 'rb') as f:
+                    p = self.stream(f.read(), testdir)
+                self.assertEqual(p.returncode, 0)
+                self.assertEqual(p.stdout, b'')
+                self.dirs_equal(pdir, testdir)
+
+    def test_stdin(self):
+        for zipname in ('basic.zip', 'small.zip', 'subdirs.zip', 'direntry.zip', 'zip64.zip', 'lzma.zip'):
+            with self.subTest(zipname=zipname):
+                self.check_same(os.path.join(datadir, zipname))
+
+    def test_file_types(self):
+        with tempfile.TemporaryDirectory() as testdir:
+            with open(os.path.join(datadir, 'symlink.zip'), 'rb') as f:
+                self.stream(f.read(), testdir)
+            with open(os.path.join(datadir, 'unixperms.zip'), 'rb') as f:
+                self.stream(f.read(), testdir)
+            self.assertEqual(os.readlink(os.path.join(testdir, 'symlink.txt')), 'source.txt')
+            self.assertEqual(os.stat(os.path.join(testdir, 'script.py')).st_mode, 33261)
+
+    def test_data_descriptors(self):
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'desc.zip')
+            with open(zfile, 'wb') as f:
+                with ZipFile(Unseekable(f), 'w') as zf:
+                    write_layout_files(zf)
+            self.check_same(zfile)
+
+    def test_skipped_entry_checked(self):
+        with tempfile.TemporaryDirectory() as d:
+            data = io.BytesIO()
+            with ZipFile(Unseekable(data), 'w') as zf:
+                write_layout_files(zf)
+            # Wrong in the data descriptor and the central directory alike.
+            crc = struct.pack('<I', zlib.crc32(layout_files[0][1]))
+            data = data.getvalue().replace(crc, struct.pack('<I', zlib.crc32(layout_files[0][1]) ^ 1))
+            with open(os.path.join(d, 'a.txt'), 'wb') as f:
+                f.write(b'already here')
+            p = self.stream(data, d)
+            self.assertEqual(p.returncode, 1)
+            self.assertIn(b'a.txt', p.stdout)
+            self.assertIn(b'CRC32', p.stdout)
+            self.assertNotIn(b'Unzipping failed', p.stdout)
+            with open(os.path.join(d, 'dir/b.txt'), 'rb') as f:
+                self.assertEqual(f.read(), layout_files[1][1])
+
+    def test_truncated(self):
+        with tempfile.TemporaryDirectory() as testdir:
+            with open(os.path.join(datadir, 'basic.zip'), 'rb') as f:
+                data = f.read()
+            p = self.stream(data[:len(data) - 30], testdir)
+            self.assertEqual(p.returncode, 1)
+            self.assertIn(b'Unzipping failed', p.stdout)
+
+class TestSalvage(ExcOnlyTest):
+
+    def salvage(self, zfile, testdir, returncode=0):
+        p = subprocess.run([unzip_exe, '--salvage', '--jsonl', '--threads', '3', zfile], cwd=testdir,
+                           stdout=subprocess.PIPE)
+        self.assertEqual(p.returncode, returncode)
+        return p
+
+    def check_files(self, testdir):
+        for name, data in layout_files:
+            with open(os.path.join(testdir, name), 'rb') as f:
+                self.assertEqual(f.read(), data)
+
+    def test_truncated(self):
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'partial.zip')
+            with open(zfile, 'wb') as f:
+                with ZipFile(f, 'w') as zf:
+                    write_layout_files(zf)
+                    zf.writestr('last.bin', os.urandom(100000))
+            with open(zfile, 'rb+') as f:
+                f.truncate(os.path.getsize(zfile) - 50000)
+            p = subprocess.run([unzip_exe, zfile], cwd=d, stdout=subprocess.PIPE)
+            self.assertIn(b'end of central directory', p.stdout)
+            with tempfile.TemporaryDirectory() as testdir:
+                p = self.salvage(zfile, testdir, 1)
+                results = {r['name']: r for r in map(json.loads, p.stdout.decode().splitlines())}
+                self.assertEqual(set(results), {'a.txt', 'dir/b.txt', 'empty', 'last.bin'})
+                self.assertFalse(results['last.bin']['ok'])
+                self.assertFalse(os.path.exists(os.path.join(testdir, 'last.bin')))
+                self.check_files(testdir)
+
+    def test_descriptors_without_central_directory(self):
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'desc.zip')
+            with open(zfile, 'wb') as f:
+                with ZipFile(Unseekable(f), 'w') as zf:
+                    write_layout_files(zf)
+                    # A stored archive inside is data, not entries.
+                    inner = io.BytesIO()
+                    with ZipFile(inner, 'w') as izf:
+                        izf.writestr('inner.txt', b'inside')
+                    zf.writestr('inner.zip', inner.getvalue())
+            with ZipFile(zfile) as zf:
+                dir_start = zf.start_dir
+            with open(zfile, 'rb+') as f:
+                f.truncate(dir_start)
+            with tempfile.TemporaryDirectory() as testdir:
+                p = self.salvage(zfile, testdir)
+                self.assertNotIn(b'"ok": false', p.stdout)
+                self.assertEqual(sorted(os.listdir(testdir)), ['a.txt', 'dir', 'empty', 'inner.zip'])
+                self.check_files(testdir)
+
+    def test_broken_end_record(self):
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'symlink.zip')
+            with open(os.path.join(datadir, 'symlink.zip'), 'rb') as f:
+                data = f.read()
+            with open(zfile, 'wb') as f:
+                f.write(data.replace(b'PK\x05\x06', b'XX\x05\x06'))
+            with tempfile.TemporaryDirectory() as testdir:
+                self.salvage(zfile, testdir)
+                # The remains of the central directory still say what is a link.
+                self.assertEqual(os.readlink(os.path.join(testdir, 'symlink.txt')), 'source.txt')
+
+class TestInMemory(ExcOnlyTest, ZipTestBase):
+
+    def check_same(self, zfile, options, inner_data=None):
+        with tempfile.TemporaryDirectory() as pdir:
+            with tempfile.TemporaryDirectory() as testdir:
+                with ZipFile(io.BytesIO(inner_data) if inner_data else zfile) as zf:
+                    zf.extractall(path=pdir)
+                p = subprocess.run([unzip_exe, '--quiet'] + options + [zfile], cwd=testdir, stdout=subprocess.PIPE)
+                self.assertEqual(p.returncode, 0)
+                self.assertEqual(p.stdout, b'')
+                self.dirs_equal(pdir, testdir)
+
+    def test_archives(self):
+        for name in ['basic.zip', 'subdirs.zip', 'zip64.zip', 'lzma.zip', 'manyfiles.zip']:
+            with self.subTest(name=name):
+                self.check_same(os.path.join(datadir, name), ['--in-memory'])
+
+    def test_nested(self):
+        inner = io.BytesIO()
+        with ZipFile(inner, 'w') as zf:
+            write_layout_files(zf)
+        middle = io.BytesIO()
+        with ZipFile(middle, 'w') as zf:
+            zf.writestr('inner.zip', inner.getvalue())
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'outer.zip')
+            with ZipFile(zfile, 'w') as zf:
+                zf.writestr('stored/inner.zip', inner.getvalue(), compress_type=zipfile.ZIP_STORED)
+                zf.writestr('deflated/inner.zip', inner.getvalue(), compress_type=zipfile.ZIP_DEFLATED)
+                zf.writestr('middle.zip', middle.getvalue(), compress_type=zipfile.ZIP_DEFLATED)
+            for options in (['--inner', 'stored/inner.zip'],
+                            ['--inner', 'deflated/inner.zip'],
+                            ['--in-memory', '--inner', 'stored/inner.zip'],
+                            ['--inner', 'middle.zip', '--inner', 'inner.zip']):
+                with self.subTest(options=options):
+                    self.check_same(zfile, options, inner.getvalue())
+            p = subprocess.run([unzip_exe, '--test', '--inner', 'deflated/inner.zip', zfile],
+                               cwd=d, stdout=subprocess.PIPE)
+            self.assertEqual(p.returncode, 0)
+            self.assertEqual(len(p.stdout.splitlines()), len(layout_files))
+            p = subprocess.run([unzip_exe, '--inner', 'missing.zip', zfile], cwd=d, stdout=subprocess.PIPE)
+            self.assertEqual(p.returncode, 1)
+            self.assertIn(b'No such file', p.stdout)
+
+    def test_nested_size_not_trusted(self):
+        if resource is None:
+            self.skipTest('needs resource limits')
+        inner = io.BytesIO()
+        with ZipFile(inner, 'w') as zf:
+            write_layout_files(zf)
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'outer.zip')
+            with ZipFile(zfile, 'w') as zf:
+                zf.writestr('inner.zip', inner.getvalue(), compress_type=zipfile.ZIP_DEFLATED)
+            with ZipFile(zfile) as zf:
+                info = zf.getinfo('inner.zip')
+            # Claim almost 4 GB in both headers.
+            with open(zfile, 'r+b') as f:
+                data = f.read()
+                f.seek(info.header_offset + 22)
+                f.write(struct.pack('<I', 0xF0000000))
+                f.seek(data.index(b'PK\x01\x02') + 24)
+                f.write(struct.pack('<I', 0xF0000000))
+            limit = lambda: resource.setrlimit(resource.RLIMIT_AS, (1 << 30, 1 << 30))
+            p = subprocess.run([unzip_exe, '--inner', 'inner.zip', zfile], cwd=d, stdout=subprocess.PIPE,
+                               stderr=subprocess.STDOUT, preexec_fn=limit)
+            self.assertEqual(p.returncode, 1)
+            self.assertIn(b'ends before its uncompressed size', p.stdout)
+
+class TestMappingModes(ExcOnlyTest, ZipTestBase):
+
+    def check_same(self, zfile, options):
+        with tempfile.TemporaryDirectory() as pdir:
+            with tempfile.TemporaryDirectory() as testdir:
+                with ZipFile(zfile) as zf:
+                    zf.extractall(path=pdir)
+                    subprocess.check_call([unzip_exe, '--quiet'] + options + [zfile], cwd=testdir)
+                    self.dirs_equal(pdir, testdir)
+
+    # The smallest window, so that entries straddle windows.
+    def test_window_many_files(self):
+        self.check_same(os.path.join(datadir, 'manyfiles.zip'), ['--map-window', '1'])
+
+    def test_window_zip64(self):
+        self.check_same(os.path.join(datadir, 'zip64.zip'), ['--map-window', '1'])
+
+    def test_window_corpus(self):
+        if not corpusdir:
+            self.skipTest('generated corpus not available')
+        self.check_same(os.path.join(corpusdir, 'corpus-test.zip'), ['--map-window', '1'])
+
+    def test_drop_cache(self):
+        self.check_same(os.path.join(datadir, 'subdirs.zip'), ['--drop-cache'])
+
+    def test_drop_cache_window(self):
+        self.check_same(os.path.join(datadir, 'manyfiles.zip'), ['--drop-cache', '--map-window', '1'])
+
+    def test_huge_pages(self):
+        self.check_same(os.path.join(datadir, 'lzma.zip'), ['--huge-pages'])
+        self.check_same(os.path.join(datadir, 'basic.zip'), ['--huge-pages', '--map-window', '1'])
+
+    def test_decoder_memory(self):
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'budget.zip')
+            with ZipFile(zfile, 'w') as zf:
+                zf.writestr(regular_file('deflated.txt'), b'deflate\n' * 10000, compress_type=zipfile.ZIP_DEFLATED)
+                # Python's LZMA encoder uses an 8 MB dictionary.
+                zf.writestr(regular_file('lzma.txt'), b'lzma\n' * 10000, compress_type=zipfile.ZIP_LZMA)
+            for mib, lzma_ok in (('4', False), ('64', True)):
+                with self.subTest(mib=mib), tempfile.TemporaryDirectory() as testdir:
+                    p = subprocess.run([unzip_exe, '--jsonl', '--decoder-memory', mib, zfile],
+                                       cwd=testdir, stdout=subprocess.PIPE)
+                    results = {r['name']: r for r in map(json.loads, p.stdout.decode().splitlines())}
+                    self.assertTrue(results['deflated.txt']['ok'])
+                    self.assertEqual(results['lzma.txt']['ok'], lzma_ok)
+                    if not lzma_ok:
+                        self.assertEqual(results['lzma.txt']['error'], 'Out of decoder memory.')
+
+    def test_prefetch(self):
+        if not corpusdir:
+            self.skipTest('generated corpus not available')
+        self.check_same(os.path.join(corpusdir, 'corpus-test.zip'), ['--prefetch', '1'])
+
+    def test_pread(self):
+        for name in ['basic.zip', 'subdirs.zip', 'zip64.zip', 'lzma.zip', 'manyfiles.zip']:
+            with self.subTest(name=name):
+                self.check_same(os.path.join(datadir, name), ['--input', 'pread'])
+        self.check_same(os.path.join(datadir, 'manyfiles.zip'), ['--input', 'pread', '--drop-cache', '--prefetch', '1'])
+
+    def test_pread_corpus(self):
+        if not corpusdir:
+            self.skipTest('generated corpus not available')
+        self.check_same(os.path.join(corpusdir, 'corpus-test.zip'), ['--input', 'pread'])
+
+    def test_pread_large_entries(self):
+        # Larger than a read block, so they reach the decoders in pieces.
+        big = os.urandom(3*1024*1024)
+        with tempfile.TemporaryDirectory() as d:
+            zfile = os.path.join(d, 'large.zip')
+            with ZipFile(zfile, 'w') as zf:
+                for name, data, compression in (('small.txt', b'unaligned\n', zipfile.ZIP_STORED),
+                                                ('stored.bin', big, zipfile.ZIP_STORED),
+                                                ('deflated.bin', big, zipfile.ZIP_DEFLATED),
+                                                ('lzma.bin', big, zipfile.ZIP_LZMA)):
+                    info = zipfile.ZipInfo(name)
+                    info.create_system = 3
+                    info.external_attr = 0o100644 << 16
+                    zf.writestr(info, data, compress_type=compression)
+            self.check_same(zfile, ['--input', 'pread'])
+            # Into a pipe, where only file mappings are spliced.
+            for options in (['--input', 'pread'], ['--input', 'mmap'], ['--in-memory']):
+                with self.subTest(options=options):
+                    p = subprocess.run([unzip_exe, '--quiet', '--tar', '-'] + options + [zfile],
+                                       stdout=subprocess.PIPE, check=True)
+                    with tarfile.open(fileobj=io.BytesIO(p.stdout)) as tf, ZipFile(zfile) as zf:
+                        for name in zf.namelist():
+                            self.assertEqual(tf.extractfile(name).read(), zf.read(name))
+
+    def test_unknown_input(self):
+        p = subprocess.run([unzip_exe, '--input', 'carrier-pigeon', os.path.join(datadir, 'basic.zip')],
+                           stdout=subprocess.PIPE)
+        self.assertEqual(p.returncode, 1)
+
+class TestStats(ExcOnlyTest):
+
+    def run_stats(self, zipname, *options):
+        zfile = os.path.join(datadir, zipname)
+        with tempfile.TemporaryDirectory() as testdir:
+            p = subprocess.run([unzip_exe] + list(options) + [zfile], cwd=testdir,
+                               stdout=subprocess.PIPE, stderr=subprocess.PIPE, check=True)
+        return p.stderr.decode()
+
+    def test_json(self):
+        report = json.loads(self.run_stats('subdirs.zip', '--stats=json'))
+        if not report['enabled']:
+            self.skipTest('statistics disabled at build time')
+        with ZipFile(os.path.join(datadir, 'subdirs.zip')) as zf:
+            infos = zf.infolist()
+        counters = report['counters']
+        self.assertEqual(counters['entries'], len(infos))
+        self.assertEqual(counters['failed'], 0)
+        self.assertEqual(counters['bytes_out'], sum(i.file_size for i in infos))
+        self.assertEqual(counters['rename'], len([i for i in infos if not i.is_dir()]))
+        self.assertEqual(report['phases']['parse_central']['calls'], 1)
+
+    def test_prefetch_counters(self):
+        report = json.loads(self.run_stats('manyfiles.zip', '--prefetch', '1', '--stats=json'))
+        if not report['enabled']:
+            self.skipTest('statistics disabled at build time')
+        with ZipFile(os.path.join(datadir, 'manyfiles.zip')) as zf:
+            infos = zf.infolist()
+        # Every entry's data is read ahead once. Small gaps between them
+        # are read along with them.
+        fetched = report['counters']['prefetch_bytes']
+        self.assertGreaterEqual(fetched, sum(i.compress_size for i in infos))
+        self.assertLessEqual(fetched, os.path.getsize(os.path.join(datadir, 'manyfiles.zip')))
+        self.assertGreaterEqual(report['gauges']['prefetch_depth'], 1024*1024)
+
+    def test_decoder_counters(self):
+        reports = [json.loads(self.run_stats('basic.zip', *options, '--stats=json'))
+                   for options in ([], ['--stream'], ['--salvage'])]
+        if not reports[0]['enabled']:
+            self.skipTest('statistics disabled at build time')
+        for r in reports:
+            self.assertGreater(r['counters']['decoder_allocs'], 0)
+            self.assertGreaterEqual(r['gauges']['decoder_peak_bytes'], 1024*1024)
+        # Salvage decodes every entry on its own worker the same way.
+        self.assertEqual(reports[0]['counters']['decoder_bytes'], reports[2]['counters']['decoder_bytes'])
+
+    def test_table(self):
+        report = self.run_stats('basic.zip', '--stats')
+        self.assertTrue('decode' in report or 'disabled' in report)
+
+    def test_trace(self):
+        zfile = os.path.join(datadir, 'subdirs.zip')
+        with tempfile.TemporaryDirectory() as testdir:
+            tracefile = os.path.join(testdir, 'trace.json')
+            p = subprocess.run([unzip_exe, '--trace', tracefile, zfile], cwd=testdir,
+                               stdout=subprocess.PIPE)
+            if b'disabled' in p.stdout:
+                self.skipTest('tracing disabled at build time')
+            self.assertEqual(p.returncode, 0)
+            with open(tracefile) as f:
+                events = json.load(f)['traceEvents']
+        with ZipFile(zfile) as zf:
+            names = sorted(zf.namelist())
+        spans = [e for e in events if e['name'] == 'unpack_entry']
+        self.assertEqual(sorted(e['args']['entry'] for e in spans), names)
+        for e in spans:
+            self.assertEqual(e['ph'], 'X')
+            self.assertGreaterEqual(e['dur'], 0)
+        self.assertTrue(any(e['name'] == 'parse_central' for e in events))
+
+    def test_trace_threads(self):
+        zfiles = [os.path.join(datadir, n) for n in ['basic.zip', 'subdirs.zip']]
+        with tempfile.TemporaryDirectory() as testdir:
+            tracefile = os.path.join(testdir, 'trace.json')
+            p = subprocess.run([unzip_exe, '--quiet', '--batch', '--threads', '2', '--trace', tracefile] + zfiles,
+                               cwd=testdir, stdout=subprocess.PIPE)
+            if b'disabled' in p.stdout:
+                self.skipTest('tracing disabled at build time')
+            self.assertEqual(p.returncode, 0)
+            with open(tracefile) as f:
+                trace = json.load(f)
+        self.assertEqual(trace['otherData']['dropped_spans'], 0)
+        events = trace['traceEvents']
+        names = {e['tid']: e['args']['name'] for e in events if e['name'] == 'thread_name'}
+        # The entries are unpacked by the workers, not the thread that started tracing.
+        for e in events:
+            if e['name'] == 'unpack_entry':
+                self.assertTrue(names[e['tid']].startswith('worker'))
+
+class TestGeneratedCorpus(ZipTestBase):
+
+    def setUp(self):
+        if not corpusdir:
+            self.skipTest('generated corpus not available')
+
+    def check_same(self, zipname):
+        zfile = os.path.join(corpusdir, zipname)
+        self.assertTrue(os.path.isfile(zfile))
+        with tempfile.TemporaryDirectory() as pdir:
+            with tempfile.TemporaryDirectory() as testdir:
+                with ZipFile(zfile) as zf:
+                    zf.extractall(path=pdir)
+                    subprocess.check_call([unzip_exe, zfile], cwd=testdir, stdout=subprocess.DEVNULL)
+                    self.dirs_equal(pdir, testdir)
+
+    def test_mixed(self):
+        self.check_same('corpus-test.zip')
+
+    def test_zip64(self):
+        self.check_same('corpus-zip64.zip')
+
 if __name__ == '__main__':
     datadir = os.path.join(sys.argv[1], 'testdata')
     unzip_exe = sys.argv[3]
     if not os.path.isabs(datadir):
         datadir = os.path.join(os.getcwd(), datadir)
+    if corpusdir and not os.path.isabs(corpusdir):
+        corpusdir = os.path.join(os.getcwd(), corpusdir)
     if not os.path.isabs(unzip_exe):
         unzip_exe = os.path.join(os.getcwd(), unzip_exe)
     if platform.system() == 'Windows':